@@ -18,6 +18,8 @@
 
 #include "ngx_base_fetch.h"
 
+#include <algorithm>
+
 #include "ngx_pagespeed.h"
 
 #include "net/instaweb/http/public/response_headers.h"
@@ -27,6 +29,19 @@
 
 namespace net_instaweb {
 
+namespace {
+
+// Buffers at least this large are handed to nginx without copying them into
+// pool buffers.  This is mostly .pagespeed. resources, which arrive from the
+// cache in a single write.
+const size_t kNoCopyThresholdBytes = 32 * 1024;
+
+// The Content-Length comes from the origin, so we don't reserve more than
+// this on its word.  Larger responses grow the buffer as they arrive.
+const int64 kMaxReserveBytes = 4 * 1024 * 1024;
+
+}  // namespace
+
 NgxBaseFetch::NgxBaseFetch(ngx_http_request_t* r,
                            NgxServerContext* server_context,
                            const RequestContextPtr& request_ctx)
@@ -120,8 +135,14 @@ ngx_int_t NgxBaseFetch::CopyBufferToNginx(ngx_chain_t** link_ptr) {
     return NGX_OK;
   }
 
-  int rc = ngx_psol::string_piece_to_buffer_chain(
-      request_->pool, buffer_, link_ptr, done_called_ /* send_last_buf */);
+  int rc;
+  if (buffer_.size() >= kNoCopyThresholdBytes) {
+    rc = ngx_psol::string_to_buffer_chain(
+        request_->pool, &buffer_, link_ptr, done_called_ /* send_last_buf */);
+  } else {
+    rc = ngx_psol::string_piece_to_buffer_chain(
+        request_->pool, buffer_, link_ptr, done_called_ /* send_last_buf */);
+  }
   if (rc != NGX_OK) {
     return rc;
   }
@@ -180,6 +201,14 @@ void NgxBaseFetch::HandleHeadersComplete() {
     server_context_->rewrite_stats()->resource_404_count()->Add(1);
   }
 
+  // When the length is known up front, as it is for resources served out of
+  // cache, size the buffer once instead of growing it as writes come in.
+  if (content_length_known() && content_length() > 0) {
+    Lock();
+    buffer_.reserve(std::min(content_length(), kMaxReserveBytes));
+    Unlock();
+  }
+
   RequestCollection();  // Headers available.
 }
 
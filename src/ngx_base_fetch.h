@@ -106,7 +106,7 @@ class NgxBaseFetch : public AsyncFetch {
   //   NGX_AGAIN: success
   //   NGX_OK: done, HandleDone has been called
   // Allocates an nginx buffer, copies our buffer_ contents into it, clears
-  // buffer_.
+  // buffer_.  Large contents are handed over to nginx without a copy.
   ngx_int_t CopyBufferToNginx(ngx_chain_t** link_ptr);
 
   void Lock();
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_cache_purger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#include "base/logging.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/abstract_shared_mem.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kSegmentName[] = "ngx_cache_purge";
+
+}  // namespace
+
+struct NgxCachePurger::SegmentHeader {
+  int64 generation;
+  int32 num_records;
+};
+
+struct NgxCachePurger::Record {
+  int64 timestamp_ms;
+  int32 is_prefix;
+  int32 length;
+  char url[kMaxUrlLength];
+};
+
+// Radix trie over purged URLs.  Each node can carry the time of an exact
+// purge of the URL it spells out, and of a prefix purge of everything under
+// it.  A prefix purge drops older purges below it, and purges that are no
+// newer than a prefix purge above them are never inserted, so the entries
+// the trie yields are the smallest set with the same effect.
+class NgxCachePurger::Trie {
+ public:
+  Trie() : root_(new Node(StringPiece())) {}
+  ~Trie() { delete root_; }
+
+  void Insert(const StringPiece& url, bool is_prefix, int64 timestamp_ms) {
+    Node* node = root_;
+    StringPiece rest = url;
+    while (node->prefix_ms < timestamp_ms) {
+      if (rest.empty()) {
+        if (is_prefix) {
+          node->prefix_ms = timestamp_ms;
+          Prune(node, timestamp_ms);
+        } else {
+          node->exact_ms = std::max(node->exact_ms, timestamp_ms);
+        }
+        return;
+      }
+      ChildMap::iterator p = node->children.find(rest[0]);
+      if (p == node->children.end()) {
+        Node* child = new Node(rest);
+        node->children[rest[0]] = child;
+        rest.clear();
+        node = child;
+        continue;
+      }
+      Node* child = p->second;
+      size_t common = 0;
+      size_t limit = std::min(child->label.size(), rest.size());
+      while (common < limit && child->label[common] == rest[common]) {
+        ++common;
+      }
+      if (common < child->label.size()) {
+        // Split the edge so that the purged URL ends on a node.
+        Node* middle = new Node(StringPiece(child->label.data(), common));
+        child->label.erase(0, common);
+        middle->children[child->label[0]] = child;
+        p->second = middle;
+        child = middle;
+      }
+      rest.remove_prefix(common);
+      node = child;
+    }
+    // Covered by an ancestor's newer prefix purge.
+  }
+
+  // Appends the surviving purges to *entries, in no particular order.
+  void Collect(EntryVector* entries) const {
+    GoogleString path;
+    Collect(root_, &path, entries);
+  }
+
+ private:
+  struct Node;
+  typedef std::map<char, Node*> ChildMap;
+  struct Node {
+    explicit Node(const StringPiece& l)
+        : label(l.data(), l.size()), exact_ms(0), prefix_ms(0) {}
+    ~Node() {
+      for (ChildMap::iterator p = children.begin(); p != children.end(); ++p) {
+        delete p->second;
+      }
+    }
+    GoogleString label;
+    int64 exact_ms;
+    int64 prefix_ms;
+    ChildMap children;
+  };
+
+  // Drops the purges at and below node that a prefix purge at timestamp_ms
+  // makes redundant.  Returns whether node is left with nothing in it.
+  static bool Prune(Node* node, int64 timestamp_ms) {
+    if (node->exact_ms <= timestamp_ms) {
+      node->exact_ms = 0;
+    }
+    for (ChildMap::iterator p = node->children.begin();
+         p != node->children.end();) {
+      Node* child = p->second;
+      if (child->prefix_ms <= timestamp_ms) {
+        child->prefix_ms = 0;
+      }
+      if (Prune(child, timestamp_ms) && child->prefix_ms == 0) {
+        delete child;
+        node->children.erase(p++);
+      } else {
+        ++p;
+      }
+    }
+    return node->exact_ms == 0 && node->children.empty();
+  }
+
+  static void Collect(const Node* node, GoogleString* path,
+                      EntryVector* entries) {
+    size_t length = path->size();
+    path->append(node->label);
+    if (node->prefix_ms != 0) {
+      entries->push_back(Entry(*path, true, node->prefix_ms));
+    }
+    if (node->exact_ms > node->prefix_ms) {
+      entries->push_back(Entry(*path, false, node->exact_ms));
+    }
+    for (ChildMap::const_iterator p = node->children.begin();
+         p != node->children.end(); ++p) {
+      Collect(p->second, path, entries);
+    }
+    path->resize(length);
+  }
+
+  Node* root_;
+
+  DISALLOW_COPY_AND_ASSIGN(Trie);
+};
+
+NgxCachePurger::NgxCachePurger(AbstractSharedMem* shm_runtime,
+                               const GoogleString& filename_prefix,
+                               ThreadSystem* thread_system, Timer* timer,
+                               int64 record_ttl_ms)
+    : shm_runtime_(shm_runtime),
+      segment_name_(StrCat(filename_prefix, kSegmentName)),
+      timer_(timer),
+      record_ttl_ms_(record_ttl_ms),
+      mutex_(thread_system->NewMutex()),
+      generation_(0),
+      next_expiry_ms_(kint64max) {
+}
+
+NgxCachePurger::~NgxCachePurger() {
+}
+
+size_t NgxCachePurger::SegmentSize() const {
+  return shm_runtime_->SharedMutexSize() + sizeof(SegmentHeader) +
+      kMaxRecords * sizeof(Record);
+}
+
+NgxCachePurger::SegmentHeader* NgxCachePurger::header() const {
+  return reinterpret_cast<SegmentHeader*>(const_cast<char*>(
+      segment_->Base() + shm_runtime_->SharedMutexSize()));
+}
+
+NgxCachePurger::Record* NgxCachePurger::records() const {
+  return reinterpret_cast<Record*>(header() + 1);
+}
+
+bool NgxCachePurger::InitSegment(bool parent, MessageHandler* handler) {
+  if (parent) {
+    segment_.reset(
+        shm_runtime_->CreateSegment(segment_name_, SegmentSize(), handler));
+    if (segment_.get() == NULL ||
+        !segment_->InitializeSharedMutex(0, handler)) {
+      segment_.reset(NULL);
+      handler->Message(kError, "Unable to create cache purge segment %s",
+                       segment_name_.c_str());
+      return false;
+    }
+    // CreateSegment zeroes the memory, so the table starts out empty.
+  } else {
+    segment_.reset(
+        shm_runtime_->AttachToSegment(segment_name_, SegmentSize(), handler));
+    if (segment_.get() == NULL) {
+      handler->Message(kError, "Unable to attach to cache purge segment %s",
+                       segment_name_.c_str());
+      return false;
+    }
+  }
+  shm_mutex_.reset(segment_->AttachToSharedMutex(0));
+  return true;
+}
+
+void NgxCachePurger::GlobalCleanup(MessageHandler* handler) {
+  if (segment_.get() != NULL) {
+    shm_runtime_->DestroySegment(segment_name_, handler);
+  }
+}
+
+bool NgxCachePurger::EntryIsOlder(const Entry& a, const Entry& b) {
+  return a.timestamp_ms < b.timestamp_ms;
+}
+
+GoogleString NgxCachePurger::WildcardPattern(const Entry& entry) {
+  GoogleString pattern = entry.url;
+  for (int i = 0, n = pattern.size(); i < n; ++i) {
+    if (pattern[i] == '*') {
+      pattern[i] = '?';
+    }
+  }
+  if (entry.is_prefix) {
+    pattern.push_back('*');
+  }
+  return pattern;
+}
+
+void NgxCachePurger::ReadRecords(int64 min_timestamp_ms, Trie* trie) {
+  const SegmentHeader* h = header();
+  const Record* r = records();
+  for (int i = 0; i < h->num_records; ++i) {
+    if (r[i].timestamp_ms >= min_timestamp_ms) {
+      trie->Insert(StringPiece(r[i].url, r[i].length), r[i].is_prefix != 0,
+                   r[i].timestamp_ms);
+    }
+  }
+}
+
+void NgxCachePurger::DropExpiredRecords(int64 min_timestamp_ms) {
+  SegmentHeader* h = header();
+  Record* r = records();
+  int kept = 0;
+  for (int i = 0; i < h->num_records; ++i) {
+    if (r[i].timestamp_ms >= min_timestamp_ms) {
+      if (kept != i) {
+        r[kept] = r[i];
+      }
+      ++kept;
+    }
+  }
+  h->num_records = kept;
+}
+
+bool NgxCachePurger::Purge(const StringPiece& url, bool is_prefix,
+                           GoogleString* error) {
+  if (segment_.get() == NULL) {
+    *error = "cache purging is unavailable";
+    return false;
+  }
+  if (url.empty() || url.size() > static_cast<size_t>(kMaxUrlLength)) {
+    *error = StrCat("URL must be 1 to ", IntegerToString(kMaxUrlLength),
+                    " bytes long");
+    return false;
+  }
+
+  ScopedMutex lock(shm_mutex_.get());
+  SegmentHeader* h = header();
+  Record* r = records();
+  // Purges are checked against cache entries' write times, which have
+  // millisecond resolution, so keep timestamps strictly increasing to make
+  // the newest purge win in the trie.
+  int64 now_ms = timer_->NowMs();
+  DropExpiredRecords(now_ms - record_ttl_ms_);
+  for (int i = 0; i < h->num_records; ++i) {
+    now_ms = std::max(now_ms, r[i].timestamp_ms + 1);
+  }
+
+  if (h->num_records == kMaxRecords) {
+    // Full; see whether dropping redundant records makes room.
+    Trie trie;
+    ReadRecords(0, &trie);
+    trie.Insert(url, is_prefix, now_ms);
+    EntryVector entries;
+    trie.Collect(&entries);
+    if (entries.size() > static_cast<size_t>(kMaxRecords)) {
+      *error = "too many purges outstanding; purge a common prefix "
+          "or flush the whole cache instead";
+      return false;
+    }
+    for (int i = 0, n = entries.size(); i < n; ++i) {
+      const Entry& entry = entries[i];
+      r[i].timestamp_ms = entry.timestamp_ms;
+      r[i].is_prefix = entry.is_prefix;
+      r[i].length = entry.url.size();
+      memcpy(r[i].url, entry.url.data(), entry.url.size());
+    }
+    h->num_records = entries.size();
+  } else {
+    Record* record = &r[h->num_records];
+    record->timestamp_ms = now_ms;
+    record->is_prefix = is_prefix;
+    record->length = url.size();
+    memcpy(record->url, url.data(), url.size());
+    ++h->num_records;
+  }
+  ++h->generation;
+  return true;
+}
+
+void NgxCachePurger::Refresh() {
+  if (segment_.get() == NULL) {
+    return;
+  }
+  // generation only ever grows, and an out-of-date read just means we pick
+  // up the change on the next request.
+  int64 generation =
+      *reinterpret_cast<volatile int64*>(&header()->generation);
+  int64 now_ms = timer_->NowMs();
+  {
+    ScopedMutex lock(mutex_.get());
+    if (generation == generation_ && now_ms < next_expiry_ms_) {
+      return;
+    }
+  }
+
+  // Expired records stay in the segment until the next Purge(), but are
+  // left out here.
+  Trie trie;
+  {
+    ScopedMutex lock(shm_mutex_.get());
+    generation = header()->generation;
+    ReadRecords(now_ms - record_ttl_ms_, &trie);
+  }
+  EntryVector entries;
+  trie.Collect(&entries);
+  std::stable_sort(entries.begin(), entries.end(), EntryIsOlder);
+
+  ScopedMutex lock(mutex_.get());
+  if (generation >= generation_) {
+    entries_.swap(entries);
+    generation_ = generation;
+    next_expiry_ms_ = entries_.empty() ?
+        kint64max : entries_.front().timestamp_ms + record_ttl_ms_;
+  }
+}
+
+bool NgxCachePurger::HasPurges() {
+  Refresh();
+  ScopedMutex lock(mutex_.get());
+  return !entries_.empty();
+}
+
+void NgxCachePurger::ApplyToOptions(RewriteOptions* options) {
+  Refresh();
+  ScopedMutex lock(mutex_.get());
+  for (int i = 0, n = entries_.size(); i < n; ++i) {
+    const Entry& entry = entries_[i];
+    // Strict entries are matched against each URL at lookup time and are
+    // left out of the options signature, so the rest of the cache survives.
+    options->AddUrlCacheInvalidationEntry(
+        WildcardPattern(entry), entry.timestamp_ms, true /* is_strict */);
+  }
+}
+
+void NgxCachePurger::PrintPurges(GoogleString* out) {
+  Refresh();
+  ScopedMutex lock(mutex_.get());
+  for (int i = 0, n = entries_.size(); i < n; ++i) {
+    const Entry& entry = entries_[i];
+    StrAppend(out, Integer64ToString(entry.timestamp_ms),
+              entry.is_prefix ? " prefix " : " url ", entry.url, "\n");
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Invalidates cached entries for individual URLs or URL prefixes, without
+// flushing the whole cache.
+//
+// Purge records live in a shared memory segment so that a purge received by
+// any worker applies in all of them.  Each worker keeps a compacted copy of
+// the records in a radix trie, rebuilt when the segment's generation number
+// changes, in which a prefix purge subsumes any older purges below it.  The
+// surviving records are handed to PSOL as strict URL cache invalidation
+// entries on the request's RewriteOptions, which PSOL checks against the
+// write time of each HTTP cache and metadata entry it looks up.  Strict
+// entries are not part of the options signature, so the rest of the cache
+// stays valid.
+//
+// A record is dropped once it is older than the longest anything may stay
+// cached, since by then every entry written before it has expired anyway.
+
+#ifndef NGX_CACHE_PURGER_H_
+#define NGX_CACHE_PURGER_H_
+
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class AbstractSharedMem;
+class AbstractSharedMemSegment;
+class MessageHandler;
+class RewriteOptions;
+class ThreadSystem;
+class Timer;
+
+class NgxCachePurger {
+ public:
+  static const int kMaxRecords = 1024;
+  static const int kMaxUrlLength = 1024;
+
+  // Records expire after record_ttl_ms.
+  NgxCachePurger(AbstractSharedMem* shm_runtime,
+                 const GoogleString& filename_prefix,
+                 ThreadSystem* thread_system, Timer* timer,
+                 int64 record_ttl_ms);
+  ~NgxCachePurger();
+
+  // Creates the segment in the parent process, or attaches to it in a child.
+  bool InitSegment(bool parent, MessageHandler* handler);
+  void GlobalCleanup(MessageHandler* handler);
+
+  // Invalidates everything cached for url, or for every URL starting with it
+  // if is_prefix, as of now.  On failure fills in *error.
+  bool Purge(const StringPiece& url, bool is_prefix, GoogleString* error);
+
+  // Whether there are any purge records to apply.  Cheap unless a purge
+  // happened since the last call.
+  bool HasPurges();
+
+  // Adds the purge records as cache invalidation entries to options, which
+  // must not be in use by a RewriteDriver yet.
+  void ApplyToOptions(RewriteOptions* options);
+
+  // Appends one line per purge record.
+  void PrintPurges(GoogleString* out);
+
+ private:
+  class Trie;
+  struct Record;
+  struct SegmentHeader;
+  struct Entry {
+    Entry(const StringPiece& u, bool p, int64 t)
+        : url(u.data(), u.size()), is_prefix(p), timestamp_ms(t) {}
+    GoogleString url;
+    bool is_prefix;
+    int64 timestamp_ms;
+  };
+  typedef std::vector<Entry> EntryVector;
+
+  static bool EntryIsOlder(const Entry& a, const Entry& b);
+  // The Wildcard PSOL matches entry against.  Wildcard cannot quote, so any
+  // * or ? in the URL itself is matched as ?, which can only purge more.
+  static GoogleString WildcardPattern(const Entry& entry);
+
+  // Rebuilds entries_ from the segment if it changed or an entry expired.
+  void Refresh();
+  // Reads the records in the segment written after min_timestamp_ms into
+  // *trie.  Requires shm_mutex_.
+  void ReadRecords(int64 min_timestamp_ms, Trie* trie);
+  // Removes the records written before min_timestamp_ms from the segment.
+  // Requires shm_mutex_.
+  void DropExpiredRecords(int64 min_timestamp_ms);
+  size_t SegmentSize() const;
+  SegmentHeader* header() const;
+  Record* records() const;
+
+  AbstractSharedMem* shm_runtime_;
+  GoogleString segment_name_;
+  Timer* timer_;
+  int64 record_ttl_ms_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  scoped_ptr<AbstractMutex> shm_mutex_;
+
+  // Protects the local copy below.
+  scoped_ptr<AbstractMutex> mutex_;
+  int64 generation_;
+  // When the oldest of entries_ expires.
+  int64 next_expiry_ms_;
+  // Ordered by timestamp, as AddUrlCacheInvalidationEntry requires.
+  EntryVector entries_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxCachePurger);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_CACHE_PURGER_H_
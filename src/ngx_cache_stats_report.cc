@@ -0,0 +1,243 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_cache_stats_report.h"
+
+#include <cstdio>
+
+#include "ngx_mem_cache.h"
+#include "ngx_tinylfu_cache.h"
+
+#include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/system/public/system_cache_path.h"
+#include "net/instaweb/system/public/system_caches.h"
+#include "net/instaweb/util/public/cache_stats.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+const char NgxCacheStatsReport::kMetadataCachePrefix[] = "ngx_metadata_cache";
+const char NgxCacheStatsReport::kPropertyCachePrefix[] = "ngx_property_cache";
+
+struct NgxCacheStatsReport::Row {
+  Row() : kind(""), hits(0), misses(0), inserts(0), deletes(0),
+          hit_latency_us(-1), hit_latency_p99_us(-1), insert_latency_us(-1),
+          insert_latency_p99_us(-1), bytes_read(-1), bytes_written(-1) {}
+
+  GoogleString name;
+  const char* kind;  // "use" or "tier"
+  int64 hits;
+  int64 misses;
+  int64 inserts;
+  int64 deletes;
+  // Negative where the cache doesn't record it.
+  double hit_latency_us;
+  double hit_latency_p99_us;
+  double insert_latency_us;
+  double insert_latency_p99_us;
+  double bytes_read;
+  double bytes_written;
+};
+
+namespace {
+
+// The names CacheStats gives its statistics, after the prefix.
+const char kHits[] = "_hits";
+const char kMisses[] = "_misses";
+const char kInserts[] = "_inserts";
+const char kDeletes[] = "_deletes";
+const char kHitLatencyHistogram[] = "_hit_latency_us";
+const char kInsertLatencyHistogram[] = "_insert_latency_us";
+const char kInsertSizeHistogram[] = "_insert_size_bytes";
+const char kLookupSizeHistogram[] = "_lookup_size_bytes";
+
+int64 VariableValue(Statistics* statistics, const StringPiece& name) {
+  Variable* variable = statistics->FindVariable(name);
+  return variable == NULL ? 0 : variable->Get();
+}
+
+void HistogramStats(Statistics* statistics, const StringPiece& name,
+                    double* average, double* p99, double* total) {
+  Histogram* histogram = statistics->FindHistogram(name);
+  if (histogram == NULL || histogram->Empty()) {
+    return;
+  }
+  double count = histogram->Count();
+  double mean = histogram->Average();
+  if (average != NULL) {
+    *average = mean;
+  }
+  if (p99 != NULL) {
+    *p99 = histogram->Percentile(99);
+  }
+  if (total != NULL) {
+    *total = mean * count;
+  }
+}
+
+GoogleString FormatDouble(double value, const char* format) {
+  if (value < 0) {
+    return "-";
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), format, value);
+  return buf;
+}
+
+GoogleString JsonNumber(double value) {
+  if (value < 0) {
+    return "null";
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.1f", value);
+  return buf;
+}
+
+}  // namespace
+
+void NgxCacheStatsReport::InitStats(Statistics* statistics) {
+  CacheStats::InitStats(kMetadataCachePrefix, statistics);
+  CacheStats::InitStats(kPropertyCachePrefix, statistics);
+}
+
+void NgxCacheStatsReport::CollectRows(Statistics* statistics,
+                                      std::vector<Row>* rows) {
+  // The HTTP cache counts for itself, and only records total lookup time,
+  // which we report as the hit latency.
+  Row http;
+  http.name = "http_cache";
+  http.kind = "use";
+  http.hits = VariableValue(statistics, HTTPCache::kCacheHits);
+  http.misses = VariableValue(statistics, HTTPCache::kCacheMisses);
+  http.inserts = VariableValue(statistics, HTTPCache::kCacheInserts);
+  http.deletes = VariableValue(statistics, HTTPCache::kCacheDeletes);
+  if (http.hits + http.misses > 0) {
+    double time_us = VariableValue(statistics, HTTPCache::kCacheTimeUs);
+    http.hit_latency_us = time_us / (http.hits + http.misses);
+  }
+  rows->push_back(http);
+
+  static const char* const kUses[] = {
+    kMetadataCachePrefix,
+    kPropertyCachePrefix,
+  };
+  static const char* const kTiers[] = {
+    SystemCachePath::kLruCache,
+    NgxTinyLfuCache::kStatsPrefix,
+    SystemCaches::kShmCache,
+    SystemCachePath::kFileCache,
+    SystemCaches::kMemcached,
+    NgxMemCache::kStatsPrefix,
+  };
+  for (int i = 0, n = arraysize(kUses) + arraysize(kTiers); i < n; ++i) {
+    bool is_use = i < static_cast<int>(arraysize(kUses));
+    GoogleString prefix = is_use ? kUses[i] : kTiers[i - arraysize(kUses)];
+    if (statistics->FindVariable(StrCat(prefix, kHits)) == NULL) {
+      continue;
+    }
+    Row row;
+    row.name = prefix;
+    row.kind = is_use ? "use" : "tier";
+    row.hits = VariableValue(statistics, StrCat(prefix, kHits));
+    row.misses = VariableValue(statistics, StrCat(prefix, kMisses));
+    row.inserts = VariableValue(statistics, StrCat(prefix, kInserts));
+    row.deletes = VariableValue(statistics, StrCat(prefix, kDeletes));
+    HistogramStats(statistics, StrCat(prefix, kHitLatencyHistogram),
+                   &row.hit_latency_us, &row.hit_latency_p99_us, NULL);
+    HistogramStats(statistics, StrCat(prefix, kInsertLatencyHistogram),
+                   &row.insert_latency_us, &row.insert_latency_p99_us, NULL);
+    HistogramStats(statistics, StrCat(prefix, kLookupSizeHistogram),
+                   NULL, NULL, &row.bytes_read);
+    HistogramStats(statistics, StrCat(prefix, kInsertSizeHistogram),
+                   NULL, NULL, &row.bytes_written);
+    rows->push_back(row);
+  }
+}
+
+void NgxCacheStatsReport::PrintHtml(Statistics* statistics,
+                                    GoogleString* out) {
+  std::vector<Row> rows;
+  CollectRows(statistics, &rows);
+  out->append(
+      "<table style='border-collapse:collapse' border=1 cellpadding=3>"
+      "<tr><th>cache</th><th>kind</th><th>hits</th><th>misses</th>"
+      "<th>hit ratio</th><th>inserts</th><th>deletes</th>"
+      "<th>hit us avg</th><th>hit us p99</th>"
+      "<th>insert us avg</th><th>insert us p99</th>"
+      "<th>bytes read</th><th>bytes written</th></tr>\n");
+  for (int i = 0, n = rows.size(); i < n; ++i) {
+    const Row& row = rows[i];
+    if (row.hits + row.misses + row.inserts == 0) {
+      continue;
+    }
+    double ratio = row.hits + row.misses == 0 ? -1 :
+        100.0 * row.hits / (row.hits + row.misses);
+    const GoogleString cells[] = {
+      row.name,
+      row.kind,
+      Integer64ToString(row.hits),
+      Integer64ToString(row.misses),
+      FormatDouble(ratio, "%.1f%%"),
+      Integer64ToString(row.inserts),
+      Integer64ToString(row.deletes),
+      FormatDouble(row.hit_latency_us, "%.0f"),
+      FormatDouble(row.hit_latency_p99_us, "%.0f"),
+      FormatDouble(row.insert_latency_us, "%.0f"),
+      FormatDouble(row.insert_latency_p99_us, "%.0f"),
+      FormatDouble(row.bytes_read, "%.0f"),
+      FormatDouble(row.bytes_written, "%.0f"),
+    };
+    out->append("<tr>");
+    for (int j = 0, m = arraysize(cells); j < m; ++j) {
+      StrAppend(out, "<td>", cells[j], "</td>");
+    }
+    out->append("</tr>\n");
+  }
+  out->append("</table>\n");
+}
+
+void NgxCacheStatsReport::PrintJson(Statistics* statistics,
+                                    GoogleString* out) {
+  std::vector<Row> rows;
+  CollectRows(statistics, &rows);
+  out->append("{");
+  for (int i = 0, n = rows.size(); i < n; ++i) {
+    const Row& row = rows[i];
+    double ratio = row.hits + row.misses == 0 ? -1 :
+        static_cast<double>(row.hits) / (row.hits + row.misses);
+    StrAppend(out, i == 0 ? "" : ",", "\n  \"", row.name, "\": {",
+              "\"kind\": \"", row.kind, "\"");
+    StrAppend(out, ", \"hits\": ", Integer64ToString(row.hits),
+              ", \"misses\": ", Integer64ToString(row.misses));
+    StrAppend(out, ", \"inserts\": ", Integer64ToString(row.inserts),
+              ", \"deletes\": ", Integer64ToString(row.deletes));
+    StrAppend(out, ", \"hit_ratio\": ",
+              ratio < 0 ? GoogleString("null") : FormatDouble(ratio, "%.4f"));
+    StrAppend(out, ", \"hit_latency_us\": ", JsonNumber(row.hit_latency_us),
+              ", \"hit_latency_p99_us\": ",
+              JsonNumber(row.hit_latency_p99_us));
+    StrAppend(out, ", \"insert_latency_us\": ",
+              JsonNumber(row.insert_latency_us),
+              ", \"insert_latency_p99_us\": ",
+              JsonNumber(row.insert_latency_p99_us));
+    StrAppend(out, ", \"bytes_read\": ", JsonNumber(row.bytes_read),
+              ", \"bytes_written\": ", JsonNumber(row.bytes_written), "}");
+  }
+  out->append("\n}\n");
+}
+
+}  // namespace net_instaweb
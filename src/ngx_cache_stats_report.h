@@ -0,0 +1,64 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Summarizes cache statistics per tier and per use, for the ?cache mode of
+// the statistics handler.
+//
+// SystemCaches already wraps each tier it builds (LRU, shared memory, file,
+// memcached) in a CacheStats, as do we for NgxMemCache and NgxTinyLfuCache.
+// SetupCaches() adds CacheStats around the metadata cache and the property
+// cache as a whole, under the prefixes below, and the HTTP cache keeps its
+// own counters.  This collects all of those into one row per cache: hits,
+// misses, hit ratio, inserts, deletes, hit and insert latency, and bytes
+// read and written.
+
+#ifndef NGX_CACHE_STATS_REPORT_H_
+#define NGX_CACHE_STATS_REPORT_H_
+
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+
+namespace net_instaweb {
+
+class Statistics;
+
+class NgxCacheStatsReport {
+ public:
+  // CacheStats prefixes for the metadata and property caches as a whole.
+  static const char kMetadataCachePrefix[];
+  static const char kPropertyCachePrefix[];
+
+  static void InitStats(Statistics* statistics);
+
+  // Appends an HTML table with a row per cache that has seen any traffic.
+  static void PrintHtml(Statistics* statistics, GoogleString* out);
+
+  // Appends the same as a JSON object keyed by cache name.
+  static void PrintJson(Statistics* statistics, GoogleString* out);
+
+ private:
+  struct Row;
+
+  static void CollectRows(Statistics* statistics, std::vector<Row>* rows);
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(NgxCacheStatsReport);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_CACHE_STATS_REPORT_H_
@@ -0,0 +1,714 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_dictionary_compressed_cache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <utility>
+
+#include "base/logging.h"
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/abstract_shared_mem.h"
+#include "net/instaweb/util/public/function.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/shared_string.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/stl_util.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+#include "third_party/zlib/zlib.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kOriginalBytes[] = "ngx_metadata_compression_original_bytes";
+const char kCompressedBytes[] = "ngx_metadata_compression_compressed_bytes";
+const char kCorruptPayloads[] = "ngx_metadata_compression_corrupt_payloads";
+const char kDictionaryTrainings[] =
+    "ngx_metadata_compression_dictionary_trainings";
+const char kDictionaryFetches[] =
+    "ngx_metadata_compression_dictionary_fetches";
+const char kCompressUsHistogram[] = "Metadata Compression Put us Histogram";
+const char kDecompressUsHistogram[] = "Metadata Compression Get us Histogram";
+
+const char kSegmentName[] = "ngx_metadata_dictionary";
+
+// Dictionaries are stored in the backend under these keys.
+const char kDictionaryKeyPrefix[] = "ngx_metadata_dictionary/";
+const char kCurrentDictionaryKey[] = "ngx_metadata_dictionary/current";
+
+// The first byte of each stored value says how the rest is encoded.
+const char kRawFormat = 'r';
+const char kZlibFormat = 'z';
+
+// We train once we've seen this much.  Values bigger than kMaxSampleBytes
+// are not typical of the metadata cache and are left out.
+const size_t kTrainingSampleBytes = 128 * 1024;
+const size_t kMinTrainingSamples = 100;
+const size_t kMaxSampleBytes = 4 * 1024;
+
+// Until we have a dictionary, we look for one published by another process
+// this often, in shared memory or else in the backend.
+const int64 kSharedDictionaryCheckMs = Timer::kSecondMs;
+const int64 kCurrentDictionaryCheckMs = 10 * Timer::kSecondMs;
+
+// Dictionaries fetched from the backend, in case many processes trained
+// their own.  Values written with dictionaries beyond this are misses.
+const size_t kMaxDictionaries = 64;
+
+// Training scores kGramLength-byte substrings by how many samples contain
+// them, then picks kSegmentLength-byte segments, starting every
+// kSegmentStride bytes, greedily by the total score of the substrings in them
+// that no earlier segment covered.  This is the COVER algorithm from zstd's
+// dictionary builder, minus the parameter search.
+const size_t kGramLength = 8;
+const size_t kSegmentLength = 64;
+const size_t kSegmentStride = 8;
+
+uint64 GramHash(const char* data) {
+  // FNV-1a.
+  uint64 h = 14695981039346656037ULL;
+  for (size_t i = 0; i < kGramLength; ++i) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// A segment is worth the scores of its substrings that occur in more than
+// one sample and aren't covered yet.  grams is sorted, and scores is indexed
+// like it.
+int SegmentScore(const GoogleString& sample, size_t start,
+                 const std::vector<uint64>& grams,
+                 const std::vector<int>& scores) {
+  int score = 0;
+  for (size_t i = start; i + kGramLength <= start + kSegmentLength; ++i) {
+    size_t g = std::lower_bound(grams.begin(), grams.end(),
+                                GramHash(&sample[i])) - grams.begin();
+    if (scores[g] > 1) {
+      score += scores[g];
+    }
+  }
+  return score;
+}
+
+GoogleString DictionaryKey(uint32 id) {
+  return StrCat(kDictionaryKeyPrefix, Integer64ToString(id));
+}
+
+}  // namespace
+
+// deflateSetDictionary() hashes the whole dictionary on every Put, so
+// there's a CPU cost to making it larger, and metadata values aren't diverse
+// enough to fill zlib's 32k window anyway.
+const size_t NgxDictionaryCompressedCache::kMaxDictionaryBytes;
+
+struct NgxSharedDictionary::SegmentHeader {
+  uint32 size;  // 0 until there is a dictionary.
+  char data[NgxDictionaryCompressedCache::kMaxDictionaryBytes];
+};
+
+NgxSharedDictionary::NgxSharedDictionary(AbstractSharedMem* shm_runtime,
+                                         const GoogleString& filename_prefix)
+    : shm_runtime_(shm_runtime),
+      segment_name_(StrCat(filename_prefix, kSegmentName)) {
+}
+
+NgxSharedDictionary::~NgxSharedDictionary() {
+}
+
+size_t NgxSharedDictionary::SegmentSize() const {
+  return shm_runtime_->SharedMutexSize() + sizeof(SegmentHeader);
+}
+
+NgxSharedDictionary::SegmentHeader* NgxSharedDictionary::header() const {
+  return reinterpret_cast<SegmentHeader*>(const_cast<char*>(
+      segment_->Base() + shm_runtime_->SharedMutexSize()));
+}
+
+bool NgxSharedDictionary::InitSegment(bool parent, MessageHandler* handler) {
+  if (parent) {
+    segment_.reset(
+        shm_runtime_->CreateSegment(segment_name_, SegmentSize(), handler));
+    if (segment_.get() == NULL ||
+        !segment_->InitializeSharedMutex(0, handler)) {
+      segment_.reset(NULL);
+      handler->Message(kError, "Unable to create dictionary segment %s",
+                       segment_name_.c_str());
+      return false;
+    }
+    // CreateSegment zeroes the memory, so there is no dictionary yet.
+  } else {
+    segment_.reset(
+        shm_runtime_->AttachToSegment(segment_name_, SegmentSize(), handler));
+    if (segment_.get() == NULL) {
+      handler->Message(kError, "Unable to attach to dictionary segment %s",
+                       segment_name_.c_str());
+      return false;
+    }
+  }
+  shm_mutex_.reset(segment_->AttachToSharedMutex(0));
+  return true;
+}
+
+void NgxSharedDictionary::GlobalCleanup(MessageHandler* handler) {
+  if (segment_.get() != NULL) {
+    shm_runtime_->DestroySegment(segment_name_, handler);
+  }
+}
+
+bool NgxSharedDictionary::Get(GoogleString* data) {
+  ScopedMutex lock(shm_mutex_.get());
+  const SegmentHeader* h = header();
+  if (h->size == 0) {
+    return false;
+  }
+  data->assign(h->data, h->size);
+  return true;
+}
+
+void NgxSharedDictionary::Publish(const StringPiece& data,
+                                  GoogleString* current) {
+  DCHECK_LE(data.size(), sizeof(header()->data));
+  ScopedMutex lock(shm_mutex_.get());
+  SegmentHeader* h = header();
+  if (h->size == 0 && !data.empty() && data.size() <= sizeof(h->data)) {
+    memcpy(h->data, data.data(), data.size());
+    h->size = data.size();
+  }
+  current->assign(h->data, h->size);
+}
+
+// Decompresses what the backend found before passing it on.  If it needs a
+// dictionary we don't have, the value is provisionally accepted, and
+// validated for real once the dictionary has been fetched in Done().
+class NgxDictionaryCompressedCache::DecompressCallback
+    : public CacheInterface::Callback {
+ public:
+  DecompressCallback(NgxDictionaryCompressedCache* cache,
+                     const GoogleString& key,
+                     CacheInterface::Callback* callback)
+      : cache_(cache),
+        key_(key),
+        callback_(callback),
+        validate_candidate_called_(false),
+        dictionary_id_(0),
+        need_dictionary_(false) {
+  }
+
+  virtual bool ValidateCandidate(const GoogleString& key,
+                                 CacheInterface::KeyState state) {
+    validate_candidate_called_ = true;
+    need_dictionary_ = false;
+    if (state == CacheInterface::kAvailable && !Decode()) {
+      return need_dictionary_;
+    }
+    return callback_->DelegatedValidateCandidate(key, state);
+  }
+
+  virtual void Done(CacheInterface::KeyState state);
+
+  // Called by DictionaryCallback once it has tried to fetch the dictionary.
+  void DictionaryDone() {
+    CacheInterface::KeyState state = CacheInterface::kNotFound;
+    need_dictionary_ = false;
+    if (Decode() && callback_->DelegatedValidateCandidate(
+            key_, CacheInterface::kAvailable)) {
+      state = CacheInterface::kAvailable;
+    }
+    callback_->DelegatedDone(state);
+    delete this;
+  }
+
+ private:
+  bool Decode() {
+    int64 start_us = cache_->timer_->NowUs();
+    GoogleString value;
+    DecodeResult result =
+        cache_->Decode(this->value()->Value(), &value, &dictionary_id_);
+    cache_->decompress_us_->Add(cache_->timer_->NowUs() - start_us);
+    switch (result) {
+      case kDecoded:
+        *callback_->value() = SharedString(value);
+        return true;
+      case kNeedDictionary:
+        need_dictionary_ = true;
+        return false;
+      case kCorrupt:
+        cache_->corrupt_payloads_->Add(1);
+        return false;
+    }
+    return false;
+  }
+
+  NgxDictionaryCompressedCache* cache_;
+  GoogleString key_;
+  CacheInterface::Callback* callback_;
+  bool validate_candidate_called_;
+  uint32 dictionary_id_;
+  bool need_dictionary_;
+
+  DISALLOW_COPY_AND_ASSIGN(DecompressCallback);
+};
+
+// Fetches a dictionary from the backend, either for a DecompressCallback
+// or, when that is NULL, to adopt as our current one.
+class NgxDictionaryCompressedCache::DictionaryCallback
+    : public CacheInterface::Callback {
+ public:
+  DictionaryCallback(NgxDictionaryCompressedCache* cache,
+                     DecompressCallback* decompress_callback)
+      : cache_(cache),
+        decompress_callback_(decompress_callback) {
+  }
+
+  virtual void Done(CacheInterface::KeyState state) {
+    if (state == CacheInterface::kAvailable) {
+      cache_->AddDictionary(value()->Value(), decompress_callback_ == NULL);
+    }
+    if (decompress_callback_ != NULL) {
+      decompress_callback_->DictionaryDone();
+    }
+    delete this;
+  }
+
+ private:
+  NgxDictionaryCompressedCache* cache_;
+  DecompressCallback* decompress_callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(DictionaryCallback);
+};
+
+void NgxDictionaryCompressedCache::DecompressCallback::Done(
+    CacheInterface::KeyState state) {
+  if (!validate_candidate_called_) {
+    // Like DelegatingCacheCallback, cover for caches that skip it.
+    DCHECK(state != CacheInterface::kAvailable);
+    callback_->DelegatedValidateCandidate(key_, state);
+  }
+  if (state == CacheInterface::kAvailable && need_dictionary_) {
+    cache_->dictionary_fetches_->Add(1);
+    cache_->cache_->Get(DictionaryKey(dictionary_id_),
+                        new DictionaryCallback(cache_, this));
+    return;
+  }
+  callback_->DelegatedDone(state);
+  delete this;
+}
+
+NgxDictionaryCompressedCache::NgxDictionaryCompressedCache(
+    CacheInterface* cache, NgxSharedDictionary* shared_dictionary,
+    QueuedWorkerPool* training_pool, ThreadSystem* thread_system,
+    Timer* timer, Statistics* statistics)
+    : cache_(cache),
+      shared_dictionary_(shared_dictionary),
+      training_sequence_(training_pool->NewSequence()),
+      timer_(timer),
+      name_(StrCat("NgxDictionaryCompressedCache using ", cache->Name())),
+      mutex_(thread_system->NewMutex()),
+      current_(NULL),
+      next_load_ms_(0),
+      training_(false),
+      sample_bytes_(0),
+      original_bytes_(statistics->GetVariable(kOriginalBytes)),
+      compressed_bytes_(statistics->GetVariable(kCompressedBytes)),
+      corrupt_payloads_(statistics->GetVariable(kCorruptPayloads)),
+      dictionary_trainings_(statistics->GetVariable(kDictionaryTrainings)),
+      dictionary_fetches_(statistics->GetVariable(kDictionaryFetches)),
+      compress_us_(statistics->GetHistogram(kCompressUsHistogram)),
+      decompress_us_(statistics->GetHistogram(kDecompressUsHistogram)) {
+}
+
+NgxDictionaryCompressedCache::~NgxDictionaryCompressedCache() {
+  STLDeleteValues(&dictionaries_);
+}
+
+void NgxDictionaryCompressedCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kOriginalBytes);
+  statistics->AddVariable(kCompressedBytes);
+  statistics->AddVariable(kCorruptPayloads);
+  statistics->AddVariable(kDictionaryTrainings);
+  statistics->AddVariable(kDictionaryFetches);
+  // Compressing a metadata entry should take microseconds; anything near a
+  // millisecond means something is wrong.
+  statistics->AddHistogram(kCompressUsHistogram)->SetMaxValue(
+      Timer::kMsUs);
+  statistics->AddHistogram(kDecompressUsHistogram)->SetMaxValue(
+      Timer::kMsUs);
+}
+
+void NgxDictionaryCompressedCache::PrintStats(Statistics* statistics,
+                                              GoogleString* out) {
+  int64 original = statistics->GetVariable(kOriginalBytes)->Get();
+  int64 compressed = statistics->GetVariable(kCompressedBytes)->Get();
+  if (original == 0 || compressed == 0) {
+    return;
+  }
+  Histogram* compress_us = statistics->GetHistogram(kCompressUsHistogram);
+  Histogram* decompress_us = statistics->GetHistogram(kDecompressUsHistogram);
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+           "Metadata cache compression: %.1f%% of original size, "
+           "%.2fx capacity, %.1fus per put, %.1fus per get\n",
+           100.0 * compressed / original,
+           static_cast<double>(original) / compressed,
+           compress_us->Average(), decompress_us->Average());
+  out->append(buf);
+}
+
+void NgxDictionaryCompressedCache::Get(const GoogleString& key,
+                                       Callback* callback) {
+  LoadCurrentDictionary();
+  cache_->Get(key, new DecompressCallback(this, key, callback));
+}
+
+void NgxDictionaryCompressedCache::Put(const GoogleString& key,
+                                       SharedString* value) {
+  LoadCurrentDictionary();
+  Sample(value->Value());
+  const Dictionary* dictionary;
+  {
+    ScopedMutex lock(mutex_.get());
+    dictionary = current_;
+  }
+  int64 start_us = timer_->NowUs();
+  SharedString encoded(Encode(value->Value(), dictionary));
+  compress_us_->Add(timer_->NowUs() - start_us);
+  original_bytes_->Add(value->size());
+  compressed_bytes_->Add(encoded.size());
+  cache_->Put(key, &encoded);
+}
+
+void NgxDictionaryCompressedCache::Delete(const GoogleString& key) {
+  cache_->Delete(key);
+}
+
+GoogleString NgxDictionaryCompressedCache::Encode(
+    const StringPiece& value, const Dictionary* dictionary) {
+  GoogleString encoded;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK) {
+    bool ok = true;
+    if (dictionary != NULL) {
+      ok = deflateSetDictionary(
+          &stream, reinterpret_cast<const Bytef*>(dictionary->data.data()),
+          dictionary->data.size()) == Z_OK;
+    }
+    if (ok) {
+      encoded.resize(1 + deflateBound(&stream, value.size()));
+      encoded[0] = kZlibFormat;
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(
+          value.data()));
+      stream.avail_in = value.size();
+      stream.next_out = reinterpret_cast<Bytef*>(&encoded[1]);
+      stream.avail_out = encoded.size() - 1;
+      ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+      encoded.resize(1 + stream.total_out);
+    }
+    deflateEnd(&stream);
+    if (ok && encoded.size() < 1 + value.size()) {
+      return encoded;
+    }
+  }
+  // Didn't help; store it as is.
+  encoded.clear();
+  encoded.reserve(1 + value.size());
+  encoded.push_back(kRawFormat);
+  value.AppendToString(&encoded);
+  return encoded;
+}
+
+NgxDictionaryCompressedCache::DecodeResult NgxDictionaryCompressedCache::Decode(
+    const StringPiece& encoded, GoogleString* value, uint32* dictionary_id) {
+  if (encoded.empty()) {
+    return kCorrupt;
+  }
+  StringPiece payload = encoded.substr(1);
+  if (encoded[0] == kRawFormat) {
+    payload.CopyToString(value);
+    return kDecoded;
+  }
+  if (encoded[0] != kZlibFormat) {
+    return kCorrupt;
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK) {
+    return kCorrupt;
+  }
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(
+      payload.data()));
+  stream.avail_in = payload.size();
+  value->clear();
+  DecodeResult result = kCorrupt;
+  char buf[4096];
+  for (;;) {
+    stream.next_out = reinterpret_cast<Bytef*>(buf);
+    stream.avail_out = sizeof(buf);
+    int status = inflate(&stream, Z_NO_FLUSH);
+    value->append(buf, sizeof(buf) - stream.avail_out);
+    if (status == Z_NEED_DICT) {
+      const Dictionary* dictionary = FindDictionary(stream.adler);
+      if (dictionary == NULL) {
+        *dictionary_id = stream.adler;
+        result = kNeedDictionary;
+        break;
+      }
+      if (inflateSetDictionary(
+              &stream, reinterpret_cast<const Bytef*>(dictionary->data.data()),
+              dictionary->data.size()) != Z_OK) {
+        break;
+      }
+    } else if (status == Z_STREAM_END) {
+      result = kDecoded;
+      break;
+    } else if (status != Z_OK) {
+      break;
+    }
+  }
+  inflateEnd(&stream);
+  return result;
+}
+
+void NgxDictionaryCompressedCache::Sample(const StringPiece& value) {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (current_ != NULL || training_ || value.size() > kMaxSampleBytes ||
+        training_sequence_ == NULL) {
+      return;
+    }
+    samples_.push_back(value.as_string());
+    sample_bytes_ += value.size();
+    if (sample_bytes_ < kTrainingSampleBytes ||
+        samples_.size() < kMinTrainingSamples) {
+      return;
+    }
+    training_ = true;
+    training_samples_.clear();
+    samples_.swap(training_samples_);
+    sample_bytes_ = 0;
+  }
+  // Training takes tens of milliseconds, once per process; keep it off the
+  // thread that happened to write the last sample.
+  training_sequence_->Add(MakeFunction(
+      this, &NgxDictionaryCompressedCache::Train,
+      &NgxDictionaryCompressedCache::CancelTraining));
+}
+
+void NgxDictionaryCompressedCache::CancelTraining() {
+  // Shed by the pool; sample afresh and try again.
+  ScopedMutex lock(mutex_.get());
+  training_ = false;
+  training_samples_.clear();
+}
+
+void NgxDictionaryCompressedCache::Train() {
+  Dictionary* dictionary = new Dictionary;
+  dictionary->data = TrainDictionary(training_samples_, kMaxDictionaryBytes);
+  training_samples_.clear();
+  if (shared_dictionary_ != NULL) {
+    // Another process may have published first; everyone uses that one.
+    GoogleString current;
+    shared_dictionary_->Publish(dictionary->data, &current);
+    dictionary->data.swap(current);
+  }
+  dictionary->id = adler32(
+      adler32(0, NULL, 0),
+      reinterpret_cast<const Bytef*>(dictionary->data.data()),
+      dictionary->data.size());
+  dictionary_trainings_->Add(1);
+  {
+    ScopedMutex lock(mutex_.get());
+    training_ = false;
+    if (current_ != NULL) {
+      // Adopted someone else's while we were training.
+      delete dictionary;
+      return;
+    }
+    DictionaryMap::iterator p = dictionaries_.find(dictionary->id);
+    if (p != dictionaries_.end()) {
+      delete dictionary;
+      dictionary = const_cast<Dictionary*>(p->second);
+    } else {
+      dictionaries_[dictionary->id] = dictionary;
+    }
+    current_ = dictionary;
+  }
+
+  // Store it by id so values written with it stay readable after a restart,
+  // and without shared memory offer it to the other processes that way.
+  SharedString data(dictionary->data);
+  cache_->Put(DictionaryKey(dictionary->id), &data);
+  if (shared_dictionary_ == NULL) {
+    cache_->Put(kCurrentDictionaryKey, &data);
+  }
+}
+
+const NgxDictionaryCompressedCache::Dictionary*
+NgxDictionaryCompressedCache::AddDictionary(const StringPiece& data,
+                                            bool make_current) {
+  if (data.empty() || data.size() > kMaxDictionaryBytes) {
+    return NULL;
+  }
+  uint32 id = adler32(adler32(0, NULL, 0),
+                      reinterpret_cast<const Bytef*>(data.data()),
+                      data.size());
+  ScopedMutex lock(mutex_.get());
+  DictionaryMap::iterator p = dictionaries_.find(id);
+  const Dictionary* dictionary;
+  if (p != dictionaries_.end()) {
+    dictionary = p->second;
+  } else if (dictionaries_.size() >= kMaxDictionaries) {
+    return NULL;
+  } else {
+    Dictionary* added = new Dictionary;
+    data.CopyToString(&added->data);
+    added->id = id;
+    dictionaries_[id] = added;
+    dictionary = added;
+  }
+  if (make_current && current_ == NULL) {
+    current_ = dictionary;
+    samples_.clear();
+    sample_bytes_ = 0;
+  }
+  return dictionary;
+}
+
+const NgxDictionaryCompressedCache::Dictionary*
+NgxDictionaryCompressedCache::FindDictionary(uint32 id) {
+  {
+    ScopedMutex lock(mutex_.get());
+    DictionaryMap::iterator p = dictionaries_.find(id);
+    if (p != dictionaries_.end()) {
+      return p->second;
+    }
+  }
+  // Another process may have just published it.
+  GoogleString data;
+  if (shared_dictionary_ != NULL && shared_dictionary_->Get(&data)) {
+    const Dictionary* dictionary = AddDictionary(data, true);
+    if (dictionary != NULL && dictionary->id == id) {
+      return dictionary;
+    }
+  }
+  return NULL;
+}
+
+void NgxDictionaryCompressedCache::LoadCurrentDictionary() {
+  int64 now_ms = timer_->NowMs();
+  {
+    ScopedMutex lock(mutex_.get());
+    if (current_ != NULL || now_ms < next_load_ms_) {
+      return;
+    }
+    next_load_ms_ = now_ms + (shared_dictionary_ != NULL ?
+                              kSharedDictionaryCheckMs :
+                              kCurrentDictionaryCheckMs);
+  }
+  if (shared_dictionary_ != NULL) {
+    GoogleString data;
+    if (shared_dictionary_->Get(&data)) {
+      AddDictionary(data, true);
+    }
+    return;
+  }
+  // The backend may not be usable yet when we're constructed, so this waits
+  // for the first operation.  Until some process has trained a dictionary
+  // there is none to find, so we keep looking until we have one, whether
+  // found or trained ourselves.
+  cache_->Get(kCurrentDictionaryKey, new DictionaryCallback(this, NULL));
+}
+
+GoogleString NgxDictionaryCompressedCache::TrainDictionary(
+    const StringVector& samples, size_t max_bytes) {
+  // Count, for each substring, how many samples contain it.
+  typedef std::pair<uint64, int> HashSample;
+  std::vector<HashSample> occurrences;
+  for (int s = 0, n = samples.size(); s < n; ++s) {
+    const GoogleString& sample = samples[s];
+    for (size_t i = 0; i + kGramLength <= sample.size(); ++i) {
+      occurrences.push_back(HashSample(GramHash(&sample[i]), s));
+    }
+  }
+  std::sort(occurrences.begin(), occurrences.end());
+  occurrences.erase(std::unique(occurrences.begin(), occurrences.end()),
+                    occurrences.end());
+  std::vector<uint64> grams;
+  std::vector<int> scores;
+  for (size_t i = 0; i < occurrences.size(); ++i) {
+    if (grams.empty() || grams.back() != occurrences[i].first) {
+      grams.push_back(occurrences[i].first);
+      scores.push_back(0);
+    }
+    ++scores.back();
+  }
+  occurrences.clear();
+
+  // Candidates are (score, (sample, offset)).  Scores only ever drop as we
+  // cover more substrings, so we can re-score lazily: a candidate whose
+  // fresh score still beats the next best stale one is the best.
+  typedef std::pair<int, std::pair<int, size_t> > Candidate;
+  std::priority_queue<Candidate> candidates;
+  for (int s = 0, n = samples.size(); s < n; ++s) {
+    const GoogleString& sample = samples[s];
+    for (size_t i = 0; i + kSegmentLength <= sample.size();
+         i += kSegmentStride) {
+      int score = SegmentScore(sample, i, grams, scores);
+      if (score > 0) {
+        candidates.push(Candidate(score, std::make_pair(s, i)));
+      }
+    }
+  }
+
+  StringVector chosen;
+  size_t total_bytes = 0;
+  while (!candidates.empty() && total_bytes + kSegmentLength <= max_bytes) {
+    Candidate candidate = candidates.top();
+    candidates.pop();
+    const GoogleString& sample = samples[candidate.second.first];
+    size_t start = candidate.second.second;
+    int score = SegmentScore(sample, start, grams, scores);
+    if (score <= 0) {
+      continue;
+    }
+    if (!candidates.empty() && score < candidates.top().first) {
+      candidates.push(Candidate(score, candidate.second));
+      continue;
+    }
+    chosen.push_back(sample.substr(start, kSegmentLength));
+    total_bytes += kSegmentLength;
+    for (size_t i = start; i + kGramLength <= start + kSegmentLength; ++i) {
+      size_t g = std::lower_bound(grams.begin(), grams.end(),
+                                  GramHash(&sample[i])) - grams.begin();
+      scores[g] = 0;
+    }
+  }
+
+  // zlib encodes nearer matches in fewer bits, so the best segments go last.
+  GoogleString dictionary;
+  dictionary.reserve(total_bytes);
+  for (int i = chosen.size() - 1; i >= 0; --i) {
+    dictionary.append(chosen[i]);
+  }
+  return dictionary;
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compresses metadata cache values with a zlib preset dictionary trained on
+// the values themselves.  Takes the place of CompressedCache when
+// "pagespeed CompressMetadataCacheDictionary on" is set.
+//
+// Metadata entries are a few hundred bytes of serialized protobuf, too short
+// for plain deflate to find much to reuse.  They do, however, share most of
+// their field tags, URL prefixes and option signatures with each other, and
+// a dictionary made of those lets even a short value refer back to them.
+//
+// Each process samples values as they are written.  Until it has enough of
+// them it compresses without a dictionary.  Then it trains one, on the
+// low-priority rewrite pool, and publishes it in an NgxSharedDictionary for
+// the other processes to adopt, unless one of them got there first.  Cache
+// eviction can't reach the shared copy, so values compressed with it stay
+// readable for as long as nginx runs.  It is also stored in the backend
+// cache under a key derived from its zlib dictionary id.  Compressed values
+// carry that id in their zlib header, so after a restart a value written
+// with an earlier dictionary can still be read back, if the backend kept it.
+// Without shared memory the backend copy is all there is, and processes
+// find the current dictionary there.
+
+#ifndef NGX_DICTIONARY_COMPRESSED_CACHE_H_
+#define NGX_DICTIONARY_COMPRESSED_CACHE_H_
+
+#include <map>
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/cache_interface.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class AbstractSharedMem;
+class AbstractSharedMemSegment;
+class Histogram;
+class MessageHandler;
+class Statistics;
+class ThreadSystem;
+class Timer;
+class Variable;
+
+// The current dictionary of every NgxDictionaryCompressedCache in the
+// server, in shared memory.
+class NgxSharedDictionary {
+ public:
+  NgxSharedDictionary(AbstractSharedMem* shm_runtime,
+                      const GoogleString& filename_prefix);
+  ~NgxSharedDictionary();
+
+  // Creates the segment in the parent process, or attaches to it in a child.
+  bool InitSegment(bool parent, MessageHandler* handler);
+  void GlobalCleanup(MessageHandler* handler);
+
+  // Copies the dictionary into *data, or returns false if there is none yet.
+  bool Get(GoogleString* data);
+  // Stores data as the dictionary unless there is one already, and copies
+  // whichever is there now into *current.
+  void Publish(const StringPiece& data, GoogleString* current);
+
+ private:
+  struct SegmentHeader;
+
+  size_t SegmentSize() const;
+  SegmentHeader* header() const;
+
+  AbstractSharedMem* shm_runtime_;
+  GoogleString segment_name_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  scoped_ptr<AbstractMutex> shm_mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedDictionary);
+};
+
+class NgxDictionaryCompressedCache : public CacheInterface {
+ public:
+  // Larger dictionaries are neither trained nor accepted.
+  static const size_t kMaxDictionaryBytes = 16 * 1024;
+
+  // Does not take ownership of cache or shared_dictionary, which is NULL
+  // without shared memory.  Trains on training_pool.
+  NgxDictionaryCompressedCache(CacheInterface* cache,
+                               NgxSharedDictionary* shared_dictionary,
+                               QueuedWorkerPool* training_pool,
+                               ThreadSystem* thread_system, Timer* timer,
+                               Statistics* statistics);
+  virtual ~NgxDictionaryCompressedCache();
+
+  static void InitStats(Statistics* statistics);
+
+  // Appends the compression ratio and CPU cost so far.
+  static void PrintStats(Statistics* statistics, GoogleString* out);
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, SharedString* value);
+  virtual void Delete(const GoogleString& key);
+  virtual const char* Name() const { return name_.c_str(); }
+  virtual CacheInterface* Backend() { return cache_; }
+  virtual bool IsBlocking() const { return cache_->IsBlocking(); }
+  virtual bool IsHealthy() const { return cache_->IsHealthy(); }
+  virtual void ShutDown() { cache_->ShutDown(); }
+
+ private:
+  class DecompressCallback;
+  class DictionaryCallback;
+  friend class DecompressCallback;
+  friend class DictionaryCallback;
+
+  enum DecodeResult {
+    kDecoded,
+    kNeedDictionary,
+    kCorrupt,
+  };
+
+  struct Dictionary {
+    GoogleString data;
+    uint32 id;  // zlib's adler32 of data.
+  };
+  typedef std::map<uint32, const Dictionary*> DictionaryMap;
+
+  // Builds a dictionary of at most max_bytes from the substrings that recur
+  // across the most samples.
+  static GoogleString TrainDictionary(const StringVector& samples,
+                                      size_t max_bytes);
+
+  GoogleString Encode(const StringPiece& value, const Dictionary* dictionary);
+  // On kNeedDictionary sets *dictionary_id to the one to fetch.
+  DecodeResult Decode(const StringPiece& encoded, GoogleString* value,
+                      uint32* dictionary_id);
+
+  // Adds a sample, queueing training once there are enough.
+  void Sample(const StringPiece& value);
+  // On training_sequence_.
+  void Train();
+  void CancelTraining();
+  // Registers a dictionary we read from the backend, returning it, or NULL if
+  // it is damaged.  Adopts it for compression if we have none of our own yet
+  // and make_current.
+  const Dictionary* AddDictionary(const StringPiece& data, bool make_current);
+  // Looks in shared memory too, but not in the backend.
+  const Dictionary* FindDictionary(uint32 id);
+  // Looks for the current dictionary in the backend, if we have none and
+  // haven't looked recently.
+  void LoadCurrentDictionary();
+
+  CacheInterface* cache_;
+  NgxSharedDictionary* shared_dictionary_;
+  QueuedWorkerPool::Sequence* training_sequence_;  // Owned by the pool.
+  Timer* timer_;
+  GoogleString name_;
+
+  scoped_ptr<AbstractMutex> mutex_;
+  // Dictionaries are immutable and live as long as we do, so pointers to
+  // them can be used without holding mutex_.
+  DictionaryMap dictionaries_;
+  const Dictionary* current_;
+  int64 next_load_ms_;
+  // While training_, the trainer owns training_samples_.
+  bool training_;
+  StringVector training_samples_;
+  StringVector samples_;
+  size_t sample_bytes_;
+
+  Variable* original_bytes_;
+  Variable* compressed_bytes_;
+  Variable* corrupt_payloads_;
+  Variable* dictionary_trainings_;
+  Variable* dictionary_fetches_;
+  Histogram* compress_us_;
+  Histogram* decompress_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxDictionaryCompressedCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_DICTIONARY_COMPRESSED_CACHE_H_
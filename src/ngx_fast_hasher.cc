@@ -0,0 +1,133 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_fast_hasher.h"
+
+#include <algorithm>
+
+namespace net_instaweb {
+
+namespace {
+
+// Arbitrary, but fixed: changing it changes every hash we produce.  With it,
+// MurmurHash3() below matches the reference MurmurHash3_x64_128.
+const uint64 kSeed = 0x9747b28cULL;
+
+const uint64 kC1 = 0x87c37b91114253d5ULL;
+const uint64 kC2 = 0x4cf5ad432745937fULL;
+
+inline uint64 Rotl64(uint64 x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64 FinalMix64(uint64 k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// Reads 8 bytes as a little-endian integer, regardless of alignment and host
+// byte order, so hashes agree across machines.
+inline uint64 LoadLittleEndian64(const unsigned char* p) {
+  uint64 result = 0;
+  for (int i = 7; i >= 0; --i) {
+    result = (result << 8) | p[i];
+  }
+  return result;
+}
+
+inline void StoreLittleEndian64(uint64 x, char* p) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = static_cast<char>(x & 0xff);
+    x >>= 8;
+  }
+}
+
+// MurmurHash3_x64_128, by Austin Appleby, who placed it in the public domain.
+void MurmurHash3(const StringPiece& content, uint64* h1_out, uint64* h2_out) {
+  const unsigned char* data =
+      reinterpret_cast<const unsigned char*>(content.data());
+  const size_t len = content.size();
+  const size_t nblocks = len / 16;
+
+  uint64 h1 = kSeed;
+  uint64 h2 = kSeed;
+
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint64 k1 = LoadLittleEndian64(data + i * 16);
+    uint64 k2 = LoadLittleEndian64(data + i * 16 + 8);
+
+    k1 *= kC1; k1 = Rotl64(k1, 31); k1 *= kC2; h1 ^= k1;
+    h1 = Rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= kC2; k2 = Rotl64(k2, 33); k2 *= kC1; h2 ^= k2;
+    h2 = Rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const unsigned char* tail = data + nblocks * 16;
+  uint64 k1 = 0;
+  uint64 k2 = 0;
+  // The reference implementation's switch, without the fallthroughs that
+  // nginx's warning flags reject.
+  const size_t rest = len & 15;
+  for (size_t i = rest; i > 8; --i) {
+    k2 ^= static_cast<uint64>(tail[i - 1]) << ((i - 9) * 8);
+  }
+  if (rest > 8) {
+    k2 *= kC2; k2 = Rotl64(k2, 33); k2 *= kC1; h2 ^= k2;
+  }
+  for (size_t i = std::min<size_t>(rest, 8); i > 0; --i) {
+    k1 ^= static_cast<uint64>(tail[i - 1]) << ((i - 1) * 8);
+  }
+  if (rest > 0) {
+    k1 *= kC1; k1 = Rotl64(k1, 31); k1 *= kC2; h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = FinalMix64(h1);
+  h2 = FinalMix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  *h1_out = h1;
+  *h2_out = h2;
+}
+
+}  // namespace
+
+NgxFastHasher::~NgxFastHasher() {
+}
+
+GoogleString NgxFastHasher::RawHash(const StringPiece& content) const {
+  uint64 h1, h2;
+  MurmurHash3(content, &h1, &h2);
+  char raw[16];
+  StoreLittleEndian64(h1, raw);
+  StoreLittleEndian64(h2, raw + 8);
+  return GoogleString(raw, sizeof(raw));
+}
+
+int NgxFastHasher::RawHashSizeInBytes() const {
+  return 16;
+}
+
+}  // namespace net_instaweb
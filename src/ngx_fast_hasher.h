@@ -0,0 +1,53 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Hasher built on the 128-bit x64 variant of MurmurHash3.  It is not
+// cryptographic, but the hashes we compute only need to be well distributed,
+// and it is several times cheaper than MD5 on the short strings that make up
+// most of our cache keys and option signatures.
+//
+// Hash() output has the same length and web64 alphabet as MD5Hasher, so
+// rewritten URLs keep their shape; only the hash characters differ.
+
+#ifndef NGX_FAST_HASHER_H_
+#define NGX_FAST_HASHER_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/hasher.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class NgxFastHasher : public Hasher {
+ public:
+  // Matches MD5Hasher::kDefaultHashSize.
+  static const int kDefaultHashSize = 10;
+
+  NgxFastHasher() : Hasher(kDefaultHashSize) {}
+  explicit NgxFastHasher(int hash_size) : Hasher(hash_size) {}
+  virtual ~NgxFastHasher();
+
+  virtual GoogleString RawHash(const StringPiece& content) const;
+  virtual int RawHashSizeInBytes() const;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(NgxFastHasher);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_FAST_HASHER_H_
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ngx_filter_cpu_timer.h"
+
+#include <time.h>
+
+#include <set>
+
+#include "net/instaweb/htmlparse/public/empty_html_filter.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_filter.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kCpuUsPrefix[] = "ngx_filter_cpu_us_";
+const char kFlushCpuUsPrefix[] = "ngx_filter_flush_cpu_us_";
+const char kOtherId[] = "other";
+const char kTimedRequests[] = "ngx_filter_cpu_timed_requests";
+
+const char kEndFilterName[] = "NgxFilterCpuTimerEnd";
+// What HtmlParse::ShowProgress() and HtmlParse::ApplyFilter() log.
+const char kProgressMarker[] = "HtmlParse::";
+const char kApplyFilterMarker[] = "HtmlParse::ApplyFilter:";
+
+// The distinct filter ids, in RewriteOptions order, then kOtherId.
+StringVector FilterIds() {
+  StringVector ids;
+  std::set<GoogleString> seen;
+  for (int i = RewriteOptions::kFirstFilter;
+       i < RewriteOptions::kEndOfFilters; ++i) {
+    GoogleString id = RewriteOptions::FilterId(
+        static_cast<RewriteOptions::Filter>(i));
+    if (!id.empty() && seen.insert(id).second) {
+      ids.push_back(id);
+    }
+  }
+  ids.push_back(kOtherId);
+  return ids;
+}
+
+int64 ThreadCpuUs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<int64>(ts.tv_sec) * Timer::kSecondUs +
+      ts.tv_nsec / 1000;
+}
+
+}  // namespace
+
+class NgxFilterCpuTimer::EndFilter : public EmptyHtmlFilter {
+ public:
+  EndFilter() {}
+  virtual const char* Name() const { return kEndFilterName; }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(EndFilter);
+};
+
+// The filter whose interval is running on a thread, if any.
+struct NgxFilterCpuTimer::ThreadState {
+  ThreadState() : slot(-1), start_us(0) {}
+
+  int slot;
+  int64 start_us;
+};
+
+void NgxFilterCpuTimer::DeleteThreadState(void* state) {
+  delete static_cast<ThreadState*>(state);
+}
+
+NgxFilterCpuTimer::NgxFilterCpuTimer(Statistics* statistics, Timer* timer,
+                                     int sample_every)
+    : timer_(timer),
+      sample_every_(sample_every),
+      requests_(0),
+      timed_requests_(statistics->GetVariable(kTimedRequests)),
+      learned_filter_names_(false) {
+  StringVector ids = FilterIds();
+  for (int i = 0, n = ids.size(); i < n; ++i) {
+    cpu_us_.push_back(statistics->GetVariable(StrCat(kCpuUsPrefix, ids[i])));
+    flush_cpu_us_.push_back(
+        statistics->GetHistogram(StrCat(kFlushCpuUsPrefix, ids[i])));
+  }
+  pthread_key_create(&thread_state_key_, DeleteThreadState);
+}
+
+NgxFilterCpuTimer::~NgxFilterCpuTimer() {
+  // Threads still running keep their ThreadState; it's small.
+  pthread_key_delete(thread_state_key_);
+}
+
+void NgxFilterCpuTimer::InitStats(Statistics* statistics) {
+  StringVector ids = FilterIds();
+  for (int i = 0, n = ids.size(); i < n; ++i) {
+    statistics->AddVariable(StrCat(kCpuUsPrefix, ids[i]));
+    statistics->AddHistogram(StrCat(kFlushCpuUsPrefix, ids[i]));
+  }
+  statistics->AddVariable(kTimedRequests);
+}
+
+void NgxFilterCpuTimer::AddEndFilter(RewriteDriver* driver) {
+  driver->AddOwnedPostRenderFilter(new EndFilter);
+}
+
+void NgxFilterCpuTimer::StartRequest(RewriteDriver* driver) {
+  bool sample = (++requests_ >= sample_every_);
+  if (sample) {
+    requests_ = 0;
+    timed_requests_->Add(1);
+    if (!learned_filter_names_) {
+      LearnFilterNames(driver);
+    }
+    if (driver->timer() == NULL) {
+      driver->set_timer(timer_);
+    }
+  }
+  // Pooled drivers keep this from their last request.
+  driver->set_log_rewrite_timing(sample);
+}
+
+void NgxFilterCpuTimer::LearnFilterNames(RewriteDriver* driver) {
+  StringVector ids = FilterIds();
+  std::map<GoogleString, int> id_slots;
+  for (int i = 0, n = ids.size(); i < n; ++i) {
+    id_slots[ids[i]] = i;
+  }
+  for (int i = RewriteOptions::kFirstFilter;
+       i < RewriteOptions::kEndOfFilters; ++i) {
+    RewriteOptions::Filter filter = static_cast<RewriteOptions::Filter>(i);
+    std::map<GoogleString, int>::const_iterator id_slot =
+        id_slots.find(RewriteOptions::FilterId(filter));
+    if (id_slot == id_slots.end()) {
+      continue;
+    }
+    // Filters that make .pagespeed. resources are registered by id, and
+    // know their own names.  For the others, the name RewriteOptions gives
+    // them usually matches, spaces aside.
+    RewriteFilter* rewrite_filter = driver->FindFilter(id_slot->first);
+    if (rewrite_filter != NULL) {
+      slots_[rewrite_filter->Name()] = id_slot->second;
+    }
+    GoogleString name = RewriteOptions::FilterName(filter);
+    GlobalReplaceSubstring(" ", "", &name);
+    slots_.insert(SlotMap::value_type(name, id_slot->second));
+  }
+  learned_filter_names_ = true;
+}
+
+int NgxFilterCpuTimer::Slot(const StringPiece& filter_name) const {
+  SlotMap::const_iterator p = slots_.find(filter_name.as_string());
+  return (p == slots_.end()) ? cpu_us_.size() - 1 : p->second;
+}
+
+NgxFilterCpuTimer::ThreadState* NgxFilterCpuTimer::CurrentThreadState() {
+  ThreadState* state =
+      static_cast<ThreadState*>(pthread_getspecific(thread_state_key_));
+  if (state == NULL) {
+    state = new ThreadState;
+    pthread_setspecific(thread_state_key_, state);
+  }
+  return state;
+}
+
+bool NgxFilterCpuTimer::HandleMessage(const StringPiece& message) {
+  size_t progress = message.find(kProgressMarker);
+  if (progress == StringPiece::npos) {
+    return false;
+  }
+  int64 now_us = ThreadCpuUs();
+  ThreadState* state = CurrentThreadState();
+  if (state->slot >= 0) {
+    int64 cpu_us = now_us - state->start_us;
+    cpu_us_[state->slot]->Add(cpu_us);
+    flush_cpu_us_[state->slot]->Add(cpu_us);
+  }
+  // Any other progress message, like the one for Flush(), ends the chain
+  // too.
+  state->slot = -1;
+  StringPiece rest = message.substr(progress);
+  if (rest.starts_with(kApplyFilterMarker)) {
+    StringPiece name = rest.substr(STATIC_STRLEN(kApplyFilterMarker));
+    TrimWhitespace(&name);
+    if (name != kEndFilterName) {
+      state->slot = Slot(name);
+      state->start_us = now_us;
+    }
+  }
+  return true;
+}
+
+}  // namespace net_instaweb
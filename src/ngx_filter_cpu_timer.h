@@ -0,0 +1,109 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Thread CPU time spent in each HTML filter, for one in every
+// "pagespeed FilterCpuTimingEvery" HTML requests.
+//
+// The filter chain is PSOL's, so we can't wrap the filters themselves.
+// What HtmlParse does offer is set_log_rewrite_timing(): it then logs
+// "HtmlParse::ApplyFilter:<name>" to the HTML parse message handler, on the
+// parsing thread, right before it runs each filter over the events of a
+// flush.  For the drivers we sample, that handler passes those messages to
+// HandleMessage() instead of logging them, and we charge the thread CPU
+// time used since the previous one to the previous filter.  A filter that
+// does nothing, added at the end of the chain, closes the last interval.
+//
+// Filters are reported by their RewriteOptions id, in the histogram
+// ngx_filter_flush_cpu_us_<id> with one sample per flush, and the counter
+// ngx_filter_cpu_us_<id>.  We learn which filter names go with which ids
+// from the first driver we sample; time in any filter we can't place goes
+// to "other".
+//
+// Work a filter hands off to the rewrite pools, RewriteContext::Rewrite()
+// included, happens outside the chain and isn't counted here.
+
+#ifndef NGX_FILTER_CPU_TIMER_H_
+#define NGX_FILTER_CPU_TIMER_H_
+
+#include <pthread.h>
+
+#include <map>
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class Histogram;
+class RewriteDriver;
+class Statistics;
+class Timer;
+class Variable;
+
+class NgxFilterCpuTimer {
+ public:
+  NgxFilterCpuTimer(Statistics* statistics, Timer* timer, int sample_every);
+  ~NgxFilterCpuTimer();
+
+  static void InitStats(Statistics* statistics);
+
+  // Adds the filter that ends the timed chain.  Call for every HTML driver
+  // while timing is on, since drivers are pooled.
+  static void AddEndFilter(RewriteDriver* driver);
+
+  // Decides whether to time the filters of this request's driver.  Only
+  // from the nginx thread.
+  void StartRequest(RewriteDriver* driver);
+
+  // For the HTML parse message handler: true if message is one of
+  // HtmlParse's progress messages, which it should then drop.
+  bool HandleMessage(const StringPiece& message);
+
+ private:
+  class EndFilter;
+  struct ThreadState;
+  typedef std::map<GoogleString, int> SlotMap;
+
+  static void DeleteThreadState(void* state);
+
+  void LearnFilterNames(RewriteDriver* driver);
+  int Slot(const StringPiece& filter_name) const;
+  ThreadState* CurrentThreadState();
+
+  Timer* timer_;
+  const int sample_every_;
+  int requests_;  // Since we last sampled one.
+
+  // By RewriteOptions id, plus "other" last.
+  std::vector<Variable*> cpu_us_;
+  std::vector<Histogram*> flush_cpu_us_;
+  Variable* timed_requests_;
+
+  // Filled in by the first sampled request, and read-only after that.
+  SlotMap slots_;
+  bool learned_filter_names_;
+
+  pthread_key_t thread_state_key_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxFilterCpuTimer);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_FILTER_CPU_TIMER_H_
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_html_load_shedder.h"
+
+#include "net/instaweb/util/public/simple_stats.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/stl_util.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+#include "net/instaweb/util/public/waveform.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kShedQueueDepth[] = "ngx_html_load_shed_queue_depth";
+const char kShedInFlight[] = "ngx_html_load_shed_in_flight";
+const char kShedLatency[] = "ngx_html_load_shed_latency";
+
+// Samples kept for the statistics page, per pool.
+const int kWaveformSamples = 200;
+
+// Weight of each new latency in the moving average.
+const double kLatencyWeight = 0.125;
+
+}  // namespace
+
+NgxHtmlLoadShedder::NgxHtmlLoadShedder(ThreadSystem* thread_system,
+                                       Timer* timer, Statistics* statistics,
+                                       int max_queue_depth, int max_in_flight,
+                                       int64 max_latency_ms)
+    : timer_(timer),
+      max_queue_depth_(max_queue_depth),
+      max_in_flight_(max_in_flight),
+      max_latency_ms_(max_latency_ms),
+      in_flight_(0),
+      latency_average_ms_(0),
+      last_latency_ms_(0),
+      shed_queue_depth_(statistics->GetVariable(kShedQueueDepth)),
+      shed_in_flight_(statistics->GetVariable(kShedInFlight)),
+      shed_latency_(statistics->GetVariable(kShedLatency)) {
+  for (int i = 0; i < RewriteDriverFactory::kNumWorkerPools; ++i) {
+    Variable* depth = new SimpleStatsVariable(thread_system->NewMutex());
+    queue_depth_variables_.push_back(depth);
+    queue_depths_.push_back(
+        new Waveform(thread_system, timer, kWaveformSamples, depth));
+  }
+}
+
+NgxHtmlLoadShedder::~NgxHtmlLoadShedder() {
+  STLDeleteElements(&queue_depths_);
+  STLDeleteElements(&queue_depth_variables_);
+}
+
+void NgxHtmlLoadShedder::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kShedQueueDepth);
+  statistics->AddVariable(kShedInFlight);
+  statistics->AddVariable(kShedLatency);
+}
+
+int64 NgxHtmlLoadShedder::QueueDepth(
+    RewriteDriverFactory::WorkerPoolCategory pool) const {
+  return queue_depth_variables_[pool]->Get();
+}
+
+bool NgxHtmlLoadShedder::ShouldShed() {
+  if (max_queue_depth_ > 0 &&
+      (QueueDepth(RewriteDriverFactory::kHtmlWorkers) > max_queue_depth_ ||
+       QueueDepth(RewriteDriverFactory::kRewriteWorkers) > max_queue_depth_)) {
+    shed_queue_depth_->Add(1);
+    return true;
+  }
+  if (max_in_flight_ > 0 && in_flight_ >= max_in_flight_) {
+    shed_in_flight_->Add(1);
+    return true;
+  }
+  if (max_latency_ms_ > 0 && latency_average_ms_ > max_latency_ms_) {
+    int64 now_ms = timer_->NowMs();
+    if (now_ms - last_latency_ms_ < kLatencyProbeIntervalMs) {
+      shed_latency_->Add(1);
+      return true;
+    }
+    // Let this one through as a probe.  Unless it brings the average down,
+    // the next goes through kLatencyProbeIntervalMs from now.
+    last_latency_ms_ = now_ms;
+  }
+  return false;
+}
+
+int64 NgxHtmlLoadShedder::HtmlRewriteStarted() {
+  ++in_flight_;
+  return timer_->NowMs();
+}
+
+void NgxHtmlLoadShedder::HtmlRewriteDone(int64 start_ms, bool completed) {
+  --in_flight_;
+  if (completed) {
+    int64 now_ms = timer_->NowMs();
+    latency_average_ms_ +=
+        kLatencyWeight * ((now_ms - start_ms) - latency_average_ms_);
+    last_latency_ms_ = now_ms;
+  }
+}
+
+}  // namespace net_instaweb
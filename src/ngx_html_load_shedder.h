@@ -0,0 +1,107 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Passes HTML through unrewritten while this worker process is overloaded.
+//
+// Once the rewrite worker pools back up, a ProxyFetch only adds its own wait
+// to the queue, and the client would get the origin HTML sooner without it.
+// Once ps_create_request_context has found that it would rewrite an HTML
+// response, it asks ShouldShed(), and serves the response as if pagespeed
+// were off for it when any of these is over its threshold:
+//  - the queue depth of the HTML or rewrite worker pool,
+//  - the number of HTML rewrites in flight in this process,
+//  - a moving average of how long recent HTML rewrites took.
+// A threshold of 0 disables that check.
+//
+// Nothing updates the latency average while we shed on it, so we let one
+// request through every kLatencyProbeIntervalMs to find out whether rewrites
+// have become fast again.
+//
+// Other than the queue depths, which worker threads update, this is only used
+// from the nginx thread, so it does no locking of its own.
+
+#ifndef NGX_HTML_LOAD_SHEDDER_H_
+#define NGX_HTML_LOAD_SHEDDER_H_
+
+#include <vector>
+
+#include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
+#include "net/instaweb/util/public/basictypes.h"
+
+namespace net_instaweb {
+
+class Statistics;
+class ThreadSystem;
+class Timer;
+class Variable;
+class Waveform;
+
+class NgxHtmlLoadShedder {
+ public:
+  static const int64 kLatencyProbeIntervalMs = 1000;
+
+  NgxHtmlLoadShedder(ThreadSystem* thread_system, Timer* timer,
+                     Statistics* statistics, int max_queue_depth,
+                     int max_in_flight, int64 max_latency_ms);
+  ~NgxHtmlLoadShedder();
+
+  static void InitStats(Statistics* statistics);
+
+  // Whether any threshold is set.
+  bool enabled() const {
+    return max_queue_depth_ > 0 || max_in_flight_ > 0 || max_latency_ms_ > 0;
+  }
+
+  // Records the queue depth of a worker pool, for
+  // QueuedWorkerPool::set_queue_size_stat.  Owned by this.
+  Waveform* queue_depth(RewriteDriverFactory::WorkerPoolCategory pool) {
+    return queue_depths_[pool];
+  }
+
+  // Whether to skip rewriting an HTML response now.  Counts the bypass if so.
+  bool ShouldShed();
+
+  // Call when a ProxyFetch is set up for an HTML response, and pass what
+  // this returns to HtmlRewriteDone() once it is finished, or abandoned.
+  int64 HtmlRewriteStarted();
+  void HtmlRewriteDone(int64 start_ms, bool completed);
+
+ private:
+  int64 QueueDepth(RewriteDriverFactory::WorkerPoolCategory pool) const;
+
+  Timer* timer_;
+  const int max_queue_depth_;
+  const int max_in_flight_;
+  const int64 max_latency_ms_;
+
+  // Current depth of each pool, exported by its Waveform.
+  std::vector<Variable*> queue_depth_variables_;
+  std::vector<Waveform*> queue_depths_;
+
+  int in_flight_;
+  double latency_average_ms_;
+  int64 last_latency_ms_;  // When latency_average_ms_ last changed.
+
+  Variable* shed_queue_depth_;
+  Variable* shed_in_flight_;
+  Variable* shed_latency_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxHtmlLoadShedder);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_HTML_LOAD_SHEDDER_H_
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_html_output_cache.h"
+
+#include "ngx_base_fetch.h"
+#include "ngx_request_context.h"
+#include "ngx_server_context.h"
+
+#include "net/instaweb/automatic/public/proxy_fetch.h"
+#include "net/instaweb/http/public/async_fetch.h"
+#include "net/instaweb/http/public/http_cache.h"
+#include "net/instaweb/http/public/http_value.h"
+#include "net/instaweb/http/public/meta_data.h"
+#include "net/instaweb/http/public/request_headers.h"
+#include "net/instaweb/http/public/response_headers.h"
+#include "net/instaweb/http/public/user_agent_matcher.h"
+#include "net/instaweb/public/global_constants.h"
+#include "net/instaweb/rewriter/public/rewrite_driver.h"
+#include "net/instaweb/rewriter/public/rewrite_options.h"
+#include "net/instaweb/util/public/hasher.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/shared_string.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kHtmlOutputCacheHits[] = "ngx_html_output_cache_hits";
+const char kHtmlOutputCacheMisses[] = "ngx_html_output_cache_misses";
+const char kHtmlOutputCacheInserts[] = "ngx_html_output_cache_inserts";
+const char kHtmlOutputCacheTooLarge[] = "ngx_html_output_cache_too_large";
+
+// The first time a page is rewritten, rewrites that miss the deadline leave
+// their resources unoptimized in the output.  So an entry is only kept for
+// kUnsettledEntryTtlMs, after which the page is rewritten again, until the
+// output comes out the same twice in a row; that one is kept for a day.
+const int64 kUnsettledEntryTtlMs = Timer::kMinuteMs;
+const int64 kSettledEntryTtlMs = Timer::kDayMs;
+
+// On the entry's own headers, the contents hash of the output it holds.
+const char kOutputHashHeader[] = "X-Ngx-Html-Output-Hash";
+
+// Rewriting can grow a page, by inlining resources for instance, so the
+// output we keep may be larger than the origin body we buffer.
+const size_t kMaxOutputBytes = 2 * NgxHtmlOutputCacheLookup::kMaxBodyBytes;
+
+// Sums up what PSOL looks at in the User-Agent when it picks filters and
+// rewrites, so that browsers alike in all of it share entries.  The raw
+// header would give nearly every client entries of its own.
+GoogleString BrowserClass(const UserAgentMatcher* matcher,
+                          const RewriteOptions* options,
+                          const RequestHeaders* request_headers) {
+  const char* header = request_headers->Lookup1(HttpAttributes::kUserAgent);
+  StringPiece user_agent(header == NULL ? "" : header);
+  GoogleString browser_class = UserAgentMatcher::DeviceTypeSuffix(
+      matcher->GetDeviceTypeForUAAndHeaders(user_agent, request_headers))
+      .as_string();
+  bool allow_mobile = options->enable_aggressive_rewriters_for_mobile();
+  bool traits[] = {
+    matcher->IsIe6or7(user_agent),
+    matcher->IsIe9(user_agent),
+    matcher->SupportsImageInlining(user_agent),
+    matcher->SupportsLazyloadImages(user_agent),
+    matcher->SupportsJsDefer(user_agent, allow_mobile),
+    matcher->SupportsWebp(user_agent),
+    matcher->SupportsWebpLosslessAlpha(user_agent),
+    matcher->SupportsDnsPrefetch(user_agent),
+    matcher->SupportsDnsPrefetchUsingRelPrefetch(user_agent),
+    matcher->SupportsSplitHtml(user_agent, allow_mobile),
+  };
+  browser_class.push_back('/');
+  for (int i = 0, n = arraysize(traits); i < n; ++i) {
+    browser_class.push_back(traits[i] ? '1' : '0');
+  }
+  StrAppend(&browser_class, "/", IntegerToString(
+      matcher->GetPrefetchMechanism(user_agent)));
+  return browser_class;
+}
+
+// Response headers that the rewrite may have changed, and that we restore
+// from the cache on a hit.  Everything else, Set-Cookie in particular, comes
+// from the current origin response.
+const char* const kCachedHeaders[] = {
+  HttpAttributes::kCacheControl,
+  HttpAttributes::kContentType,
+  HttpAttributes::kEtag,
+  HttpAttributes::kExpires,
+  HttpAttributes::kLastModified,
+  HttpAttributes::kXOriginalContentLength,
+  kPageSpeedHeader,
+};
+
+// For the slow request log.  Must happen before the base fetch is done, as
+// the log is written once the nginx side sees that.
+void SetOutcome(NgxBaseFetch* base_fetch,
+                NgxRequestContext::HtmlOutputCacheOutcome outcome) {
+  NgxRequestContext* context =
+      NgxRequestContext::DynamicCast(base_fetch->request_context().get());
+  if (context != NULL) {
+    context->set_html_output_cache_outcome(outcome);
+  }
+}
+
+}  // namespace
+
+// Stores the rewritten HTML as it passes through to the NgxBaseFetch.
+class NgxHtmlOutputCacheLookup::CaptureFetch : public SharedAsyncFetch {
+ public:
+  // previous_output_hash is that of the expired entry under key, if any.
+  CaptureFetch(AsyncFetch* base_fetch, NgxServerContext* server_context,
+               const GoogleString& key,
+               const GoogleString& previous_output_hash, Variable* inserts)
+      : SharedAsyncFetch(base_fetch),
+        server_context_(server_context),
+        key_(key),
+        previous_output_hash_(previous_output_hash),
+        inserts_(inserts),
+        too_large_(false) {
+  }
+
+ protected:
+  virtual bool HandleWrite(const StringPiece& content,
+                           MessageHandler* handler) {
+    // Stop capturing, rather than hold on to an output we won't cache.
+    if (!too_large_) {
+      if (output_.size() + content.size() > kMaxOutputBytes) {
+        too_large_ = true;
+        GoogleString().swap(output_);
+      } else {
+        content.AppendToString(&output_);
+      }
+    }
+    return SharedAsyncFetch::HandleWrite(content, handler);
+  }
+
+  virtual void HandleDone(bool success) {
+    // The base fetch may delete itself in Done(), taking the headers with it.
+    if (success && !too_large_ &&
+        response_headers()->status_code() == HttpStatus::kOK) {
+      MessageHandler* handler = server_context_->message_handler();
+      HTTPValue output;
+      output.SetHeaders(response_headers());
+      output.Write(output_, handler);
+
+      // The entry wraps the output's headers and body in headers of its own,
+      // which only control how long the HTTPCache keeps it.
+      GoogleString output_hash =
+          server_context_->contents_hasher()->Hash(output_);
+      bool settled = (output_hash == previous_output_hash_);
+      ResponseHeaders entry_headers;
+      entry_headers.SetStatusAndReason(HttpStatus::kOK);
+      entry_headers.Add(kOutputHashHeader, output_hash);
+      entry_headers.SetDateAndCaching(
+          server_context_->timer()->NowMs(),
+          settled ? kSettledEntryTtlMs : kUnsettledEntryTtlMs);
+      entry_headers.ComputeCaching();
+      server_context_->http_cache()->Put(key_, &entry_headers,
+                                         output.share()->Value(), handler);
+      inserts_->Add(1);
+    }
+    SharedAsyncFetch::HandleDone(success);
+    delete this;
+  }
+
+ private:
+  NgxServerContext* server_context_;
+  GoogleString key_;
+  GoogleString previous_output_hash_;
+  Variable* inserts_;
+  GoogleString output_;
+  bool too_large_;
+
+  DISALLOW_COPY_AND_ASSIGN(CaptureFetch);
+};
+
+class NgxHtmlOutputCacheLookup::CacheCallback : public HTTPCache::Callback {
+ public:
+  explicit CacheCallback(NgxHtmlOutputCacheLookup* lookup)
+      : HTTPCache::Callback(lookup->base_fetch_->request_context()),
+        lookup_(lookup) {
+  }
+
+  // Honor cache flushes and purges of the page's URL.
+  virtual bool IsCacheValid(const GoogleString& key,
+                            const ResponseHeaders& headers) {
+    return lookup_->driver_->options()->IsUrlCacheValid(
+        lookup_->url_, headers.date_ms());
+  }
+
+  virtual void Done(HTTPCache::FindResult find_result) {
+    bool hit = false;
+    if (find_result == HTTPCache::kFound) {
+      SetOutcome(lookup_->base_fetch_, NgxRequestContext::kHtmlOutputCacheHit);
+      hit = lookup_->ServeFromCache(http_value());
+    }
+    if (hit) {
+      lookup_->hits_->Add(1);
+      delete lookup_;
+    } else {
+      SetOutcome(lookup_->base_fetch_,
+                 NgxRequestContext::kHtmlOutputCacheMiss);
+      lookup_->misses_->Add(1);
+      // An expired entry comes back as the fallback value.
+      GoogleString previous_output_hash;
+      ResponseHeaders previous_headers;
+      if (!fallback_http_value()->Empty() &&
+          fallback_http_value()->ExtractHeaders(
+              &previous_headers, lookup_->server_context_->message_handler())) {
+        const char* hash = previous_headers.Lookup1(kOutputHashHeader);
+        if (hash != NULL) {
+          previous_output_hash = hash;
+        }
+      }
+      ProxyFetch* proxy_fetch = lookup_->StartProxyFetch(
+          true /* capture */, previous_output_hash);
+      proxy_fetch->Done(true /* success */);
+    }
+    delete this;
+  }
+
+ private:
+  NgxHtmlOutputCacheLookup* lookup_;
+
+  DISALLOW_COPY_AND_ASSIGN(CacheCallback);
+};
+
+NgxHtmlOutputCacheLookup::NgxHtmlOutputCacheLookup(
+    NgxServerContext* server_context,
+    ProxyFetchFactory* proxy_fetch_factory,
+    const GoogleString& url,
+    NgxBaseFetch* base_fetch,
+    RewriteDriver* driver,
+    ProxyFetchPropertyCallbackCollector* property_callback)
+    : server_context_(server_context),
+      proxy_fetch_factory_(proxy_fetch_factory),
+      url_(url),
+      base_fetch_(base_fetch),
+      driver_(driver),
+      property_callback_(property_callback) {
+  Statistics* statistics = server_context->statistics();
+  hits_ = statistics->GetVariable(kHtmlOutputCacheHits);
+  misses_ = statistics->GetVariable(kHtmlOutputCacheMisses);
+  inserts_ = statistics->GetVariable(kHtmlOutputCacheInserts);
+  too_large_ = statistics->GetVariable(kHtmlOutputCacheTooLarge);
+}
+
+NgxHtmlOutputCacheLookup::~NgxHtmlOutputCacheLookup() {
+}
+
+void NgxHtmlOutputCacheLookup::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kHtmlOutputCacheHits);
+  statistics->AddVariable(kHtmlOutputCacheMisses);
+  statistics->AddVariable(kHtmlOutputCacheInserts);
+  statistics->AddVariable(kHtmlOutputCacheTooLarge);
+}
+
+bool NgxHtmlOutputCacheLookup::Write(const StringPiece& data) {
+  data.AppendToString(&body_);
+  return body_.size() <= kMaxBodyBytes;
+}
+
+ProxyFetch* NgxHtmlOutputCacheLookup::StartProxyFetch() {
+  too_large_->Add(1);
+  SetOutcome(base_fetch_, NgxRequestContext::kHtmlOutputCacheTooLarge);
+  ProxyFetch* proxy_fetch = StartProxyFetch(false /* capture */, "");
+  return proxy_fetch;
+}
+
+ProxyFetch* NgxHtmlOutputCacheLookup::StartProxyFetch(
+    bool capture, const GoogleString& previous_output_hash) {
+  AsyncFetch* fetch = base_fetch_;
+  if (capture) {
+    fetch = new CaptureFetch(base_fetch_, server_context_, key_,
+                             previous_output_hash, inserts_);
+  }
+  // Will call StartParse etc.  The rewrite driver will take care of deleting
+  // itself if necessary.
+  ProxyFetch* proxy_fetch = proxy_fetch_factory_->CreateNewProxyFetch(
+      url_, fetch, driver_, property_callback_,
+      NULL /* original_content_fetch */);
+  proxy_fetch->Write(body_, server_context_->message_handler());
+  delete this;
+  return proxy_fetch;
+}
+
+void NgxHtmlOutputCacheLookup::Finish() {
+  // Relative URLs and the filters that apply depend on the URL, the options
+  // and the browser, so all of those go into the key as well as the body.
+  const Hasher* hasher = server_context_->contents_hasher();
+  key_ = StrCat("ngx_html/", url_, "@",
+                hasher->Hash(driver_->options()->signature()), "_",
+                BrowserClass(server_context_->user_agent_matcher(),
+                             driver_->options(),
+                             base_fetch_->request_headers()),
+                "_", hasher->Hash(body_));
+  server_context_->http_cache()->Find(
+      key_, server_context_->message_handler(), new CacheCallback(this));
+}
+
+void NgxHtmlOutputCacheLookup::Abandon() {
+  driver_->Cleanup();
+  if (property_callback_ != NULL) {
+    property_callback_->Detach(HttpStatus::kUnknownStatusCode);
+  }
+  base_fetch_->Done(false /* failure */);
+  delete this;
+}
+
+bool NgxHtmlOutputCacheLookup::ServeFromCache(HTTPValue* entry) {
+  MessageHandler* handler = server_context_->message_handler();
+  StringPiece serialized_output;
+  if (!entry->ExtractContents(&serialized_output)) {
+    return false;
+  }
+  SharedString storage(serialized_output);
+  HTTPValue output;
+  ResponseHeaders cached_headers;
+  StringPiece html;
+  if (!output.Link(&storage, &cached_headers, handler) ||
+      !output.ExtractContents(&html)) {
+    return false;
+  }
+
+  // Neither the driver nor the property cache lookup is needed after all.
+  driver_->Cleanup();
+  if (property_callback_ != NULL) {
+    property_callback_->Detach(HttpStatus::kOK);
+  }
+
+  ResponseHeaders* headers = base_fetch_->response_headers();
+  for (int i = 0, n = arraysize(kCachedHeaders); i < n; ++i) {
+    StringPiece name(kCachedHeaders[i]);
+    headers->RemoveAll(name);
+    for (int j = 0, m = cached_headers.NumAttributes(); j < m; ++j) {
+      if (StringCaseEqual(cached_headers.Name(j), name)) {
+        headers->Add(name, cached_headers.Value(j));
+      }
+    }
+  }
+  // Keep any Expires the same distance from Date as when it was rewritten.
+  int64 now_ms = server_context_->timer()->NowMs();
+  int64 date_ms, expires_ms;
+  if (cached_headers.ParseDateHeader(HttpAttributes::kDate, &date_ms) &&
+      cached_headers.ParseDateHeader(HttpAttributes::kExpires, &expires_ms)) {
+    headers->SetTimeHeader(HttpAttributes::kExpires,
+                           now_ms + expires_ms - date_ms);
+  }
+  headers->SetDate(now_ms);
+  headers->ComputeCaching();
+
+  base_fetch_->HeadersComplete();
+  base_fetch_->Write(html, handler);
+  base_fetch_->Done(true /* success */);
+  return true;
+}
+
+}  // namespace net_instaweb
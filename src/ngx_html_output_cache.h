@@ -0,0 +1,129 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Caches rewritten HTML keyed by the origin HTML it was rewritten from.
+//
+// With "pagespeed HtmlOutputCache on", the body filter hands an HTML
+// response's origin bytes to one of these instead of to a ProxyFetch.  Once
+// the body is complete we look it up in the HTTPCache under a key made from
+// the URL, a hash of the body, the options signature and the user agent:
+//  - On a hit, the cached output goes straight to the NgxBaseFetch, along
+//    with the headers the rewrite set last time, and no ProxyFetch runs.
+//  - On a miss, we start the ProxyFetch on the buffered body as usual and
+//    store what it writes.
+// Any change to the origin HTML changes the key, so entries never need to be
+// invalidated.  Rewrites that miss their deadline the first time round leave
+// the output partly unoptimized, so entries expire after a minute, and the
+// page is rewritten again, until the output is the same twice in a row; that
+// one is kept for a day.  A cache flush or purge of the URL also invalidates
+// them.
+//
+// This gives up streaming: nothing is sent to the client until the whole
+// origin body has arrived, so only turn it on for pages that the origin
+// sends quickly.  Bodies over kMaxBodyBytes are streamed to the ProxyFetch
+// as soon as they cross the limit, and not cached, as are outputs over twice
+// that.
+
+#ifndef NGX_HTML_OUTPUT_CACHE_H_
+#define NGX_HTML_OUTPUT_CACHE_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class HTTPValue;
+class NgxBaseFetch;
+class NgxServerContext;
+class ProxyFetch;
+class ProxyFetchFactory;
+class ProxyFetchPropertyCallbackCollector;
+class RewriteDriver;
+class Statistics;
+class Variable;
+
+class NgxHtmlOutputCacheLookup {
+ public:
+  static const size_t kMaxBodyBytes = 1024 * 1024;
+
+  // Takes ownership of driver and property_callback, which are what we
+  // would otherwise have passed to CreateNewProxyFetch.  driver's options
+  // must have their signature computed.
+  NgxHtmlOutputCacheLookup(NgxServerContext* server_context,
+                           ProxyFetchFactory* proxy_fetch_factory,
+                           const GoogleString& url,
+                           NgxBaseFetch* base_fetch,
+                           RewriteDriver* driver,
+                           ProxyFetchPropertyCallbackCollector*
+                               property_callback);
+
+  static void InitStats(Statistics* statistics);
+
+  // Buffers part of the origin body.  Returns false if the body has grown
+  // past kMaxBodyBytes, in which case the caller should call
+  // StartProxyFetch() and stream the rest of it.
+  bool Write(const StringPiece& data);
+
+  // Gives up on caching: starts the ProxyFetch, writes the buffered body to
+  // it and returns it.  Deletes this.
+  ProxyFetch* StartProxyFetch();
+
+  // The body is complete; serve it from cache or rewrite it.  Deletes this,
+  // possibly asynchronously.  Nothing should refer to the nginx request after
+  // this, as it may be gone by the time the lookup completes.
+  void Finish();
+
+  // The request went away before the body was complete.  Deletes this.
+  void Abandon();
+
+ private:
+  class CacheCallback;
+  class CaptureFetch;
+  friend class CacheCallback;
+
+  ~NgxHtmlOutputCacheLookup();
+
+  // Starts the ProxyFetch, capturing its output for the cache if asked to,
+  // and writes the buffered body to it.  previous_output_hash is from the
+  // expired entry being replaced, if any.  Deletes this.
+  ProxyFetch* StartProxyFetch(bool capture,
+                              const GoogleString& previous_output_hash);
+  // Sends the cached output to the base fetch, unless entry turns out to be
+  // corrupt.
+  bool ServeFromCache(HTTPValue* entry);
+
+  NgxServerContext* server_context_;
+  ProxyFetchFactory* proxy_fetch_factory_;
+  GoogleString url_;
+  NgxBaseFetch* base_fetch_;
+  RewriteDriver* driver_;
+  ProxyFetchPropertyCallbackCollector* property_callback_;
+  GoogleString key_prefix_;
+  GoogleString key_;
+  GoogleString body_;
+
+  Variable* hits_;
+  Variable* misses_;
+  Variable* inserts_;
+  Variable* too_large_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxHtmlOutputCacheLookup);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_HTML_OUTPUT_CACHE_H_
@@ -0,0 +1,1101 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+extern "C" {
+  #include <ngx_event.h>
+  #include <ngx_event_connect.h>
+}
+
+#include "ngx_mem_cache.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#include "base/logging.h"
+#include "net/instaweb/util/public/cache_stats.h"
+#include "net/instaweb/util/public/hasher.h"
+#include "net/instaweb/util/public/key_value_codec.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/shared_string.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/stl_util.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+const char NgxMemCache::kStatsPrefix[] = "ngx_memcached";
+
+namespace {
+
+const char kNgxMemCacheBatches[] = "ngx_memcached_batches";
+const char kNgxMemCacheErrors[] = "ngx_memcached_errors";
+const char kNgxMemCacheTimeouts[] = "ngx_memcached_timeouts";
+const char kNgxMemCacheEjections[] = "ngx_memcached_ejections";
+const char kNgxMemCacheReadmissions[] = "ngx_memcached_readmissions";
+const char kNgxMemCacheHotKeyLookups[] = "ngx_memcached_hot_key_lookups";
+
+const int kDefaultMemcachedPort = 11211;
+
+// After a server fails it is ejected from the ring for a while, so its keys
+// go to the next server rather than stalling every request on a dead host.
+// Servers that keep failing after re-admission stay out longer, up to
+// kRetryIntervalMs << kMaxRetryShift.
+const int64 kRetryIntervalMs = 5 * Timer::kSecondMs;
+const int kMaxRetryShift = 4;
+
+// Each server gets kRingHashesPerServer * 4 points on the ring, as in
+// libketama.
+const int kRingHashesPerServer = 40;
+
+// Lookups are counted in a small table indexed by the key's ring point; a
+// key is hot once its slot reaches kHotKeyThreshold.  The counts are halved
+// every kAccessDecayLookups lookups so keys cool down again.
+const int kAccessCountSlots = 4096;
+const int kHotKeyThreshold = 32;
+const int kAccessDecayLookups = 16384;
+
+// Writes to the command pipe interrupted by a signal are retried this often.
+const int kMaxSendCmdAttempts = 3;
+
+// memcached rejects items over 1MB by default; don't bother sending them.
+const size_t kMaxValueSize = 1024 * 1024 - 512;
+
+// Binary protocol constants, see
+// https://code.google.com/p/memcached/wiki/BinaryProtocolRevamped
+const int kHeaderSize = 24;
+const uint8 kRequestMagic = 0x80;
+const uint8 kResponseMagic = 0x81;
+const uint8 kOpNoop = 0x0a;
+const uint8 kOpGetKQ = 0x0d;
+const uint8 kOpSetQ = 0x11;
+const uint8 kOpDeleteQ = 0x14;
+const uint16 kStatusOk = 0x0000;
+const uint16 kStatusKeyNotFound = 0x0001;
+const int kSetExtrasSize = 8;  // 32-bit flags and 32-bit expiration
+
+void PutUint16(uint16 x, char* out) {
+  out[0] = static_cast<char>(x >> 8);
+  out[1] = static_cast<char>(x);
+}
+
+void PutUint32(uint32 x, char* out) {
+  out[0] = static_cast<char>(x >> 24);
+  out[1] = static_cast<char>(x >> 16);
+  out[2] = static_cast<char>(x >> 8);
+  out[3] = static_cast<char>(x);
+}
+
+uint16 GetUint16(const unsigned char* in) {
+  return (static_cast<uint16>(in[0]) << 8) | in[1];
+}
+
+uint32 GetUint32(const unsigned char* in) {
+  return (static_cast<uint32>(in[0]) << 24) |
+      (static_cast<uint32>(in[1]) << 16) |
+      (static_cast<uint32>(in[2]) << 8) | in[3];
+}
+
+// Appends a request with the given key, extras and value to out.
+void AppendRequest(uint8 opcode, uint32 opaque, StringPiece key,
+                   StringPiece extras, StringPiece value, GoogleString* out) {
+  char header[kHeaderSize];
+  memset(header, 0, sizeof(header));
+  header[0] = kRequestMagic;
+  header[1] = opcode;
+  PutUint16(key.size(), header + 2);
+  header[4] = static_cast<char>(extras.size());
+  PutUint32(extras.size() + key.size() + value.size(), header + 8);
+  PutUint32(opaque, header + 12);
+  out->append(header, sizeof(header));
+  out->append(extras.data(), extras.size());
+  out->append(key.data(), key.size());
+  out->append(value.data(), value.size());
+}
+
+// FNV-1a; the hashed key is already well mixed, we just need 32 bits of it.
+uint32 RingPoint(const GoogleString& hashed_key) {
+  uint32 h = 2166136261U;
+  for (int i = 0, n = hashed_key.size(); i < n; ++i) {
+    h = (h ^ static_cast<unsigned char>(hashed_key[i])) * 16777619U;
+  }
+  return h;
+}
+
+}  // namespace
+
+struct NgxMemCache::Operation {
+  enum Type { kGet, kPut, kDelete };
+
+  Operation(Type t, const GoogleString& k, Callback* c)
+      : type(t), key(k), callback(c), fallback(NULL) {}
+
+  Type type;
+  GoogleString key;
+  GoogleString hashed_key;
+  Callback* callback;  // kGet only
+  SharedString key_and_value;  // kPut only
+  // For a hot key read from a replica, the primary to ask if it misses.
+  Server* fallback;
+};
+
+// A persistent connection to one memcached server.  Only used on the nginx
+// thread.
+class NgxMemCache::Server {
+ public:
+  Server(NgxMemCache* cache, const StringPiece& spec);
+  ~Server();
+
+  bool Init(ngx_pool_t* pool);
+
+  // Serialize an operation into the output buffer.  They're sent on the next
+  // Flush().  AddGet holds on to op until the lookup completes.
+  void AddGet(Operation* op);
+  void AddPut(const Operation& op);
+  void AddDelete(const Operation& op);
+
+  // Terminates the lookups added since the last Flush() with a NOOP, and
+  // starts writing everything to the server.
+  void Flush();
+
+  // Drops the connection, reporting outstanding lookups as misses.
+  void Abort();
+
+  // Whether the server is on the ring.  An ejected server is re-admitted
+  // once its retry time has passed.
+  bool InRotation(int64 now_ms);
+  bool ejected() const { return ejected_; }
+  int64 retry_after_ms() const { return retry_after_ms_; }
+
+  void AppendStatus(int64 now_ms, GoogleString* out) const;
+
+ private:
+  // Lookups that were flushed together and are terminated by one NOOP.
+  // Lookup i was sent with opaque base_opaque + i, and the NOOP with
+  // base_opaque + lookups.size().
+  struct Batch {
+    explicit Batch(uint32 base) : base_opaque(base), next(0), sent_ms(0) {}
+    uint32 base_opaque;
+    size_t next;  // first lookup we haven't reported yet
+    int64 sent_ms;  // when Flush() queued it
+    std::vector<Operation*> lookups;
+  };
+
+  bool Connect();
+  void Close();
+  // Like Abort, but counts an error and ejects this server from the ring.
+  void Fail(bool timed_out);
+
+  // Returns false if the connection failed.
+  bool Write();
+  bool ProcessResponses();
+  // Sets the read timer for the earliest deadline: timeout_ms_ after the
+  // oldest batch in flight was sent, or after we started connecting or
+  // writing with nothing in flight.  Anchored so that a steady stream of new
+  // operations can't keep pushing it out.
+  void UpdateTimeout();
+
+  static void WriteHandler(ngx_event_t* wev);
+  static void ReadHandler(ngx_event_t* rev);
+
+  NgxMemCache* cache_;
+  GoogleString spec_;
+  ngx_url_t url_;
+  ngx_connection_t* connection_;
+  bool connecting_;
+  bool ejected_;
+  int64 ejected_at_ms_;
+  int64 retry_after_ms_;
+  int consecutive_failures_;
+  int64 failures_;
+  int64 ejections_;
+
+  GoogleString out_;
+  size_t out_pos_;
+  // When out_ last went from empty to holding something unsent, or -1.
+  int64 write_started_ms_;
+  GoogleString in_;
+
+  Batch* current_;
+  std::deque<Batch*> in_flight_;
+  uint32 next_opaque_;
+
+  DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+NgxMemCache::Server::Server(NgxMemCache* cache, const StringPiece& spec)
+    : cache_(cache),
+      connection_(NULL),
+      connecting_(false),
+      ejected_(false),
+      ejected_at_ms_(0),
+      retry_after_ms_(0),
+      consecutive_failures_(0),
+      failures_(0),
+      ejections_(0),
+      out_pos_(0),
+      write_started_ms_(-1),
+      current_(NULL),
+      next_opaque_(0) {
+  spec.CopyToString(&spec_);
+  ngx_memzero(&url_, sizeof(url_));
+}
+
+NgxMemCache::Server::~Server() {
+  Abort();
+}
+
+bool NgxMemCache::Server::Init(ngx_pool_t* pool) {
+  url_.url.data = reinterpret_cast<u_char*>(const_cast<char*>(spec_.c_str()));
+  url_.url.len = spec_.size();
+  url_.default_port = kDefaultMemcachedPort;
+  if (ngx_parse_url(pool, &url_) != NGX_OK || url_.naddrs == 0) {
+    ngx_log_error(NGX_LOG_ERR, cache_->log_, 0,
+                  "NgxMemCache: invalid memcached server \"%V\": %s",
+                  &url_.url, url_.err == NULL ? "no address" : url_.err);
+    return false;
+  }
+  return true;
+}
+
+bool NgxMemCache::Server::InRotation(int64 now_ms) {
+  if (ejected_ && now_ms >= retry_after_ms_) {
+    ejected_ = false;
+    cache_->readmissions_->Add(1);
+    cache_->message_handler_->Message(
+        kInfo, "NgxMemCache: re-admitting memcached server %s after %d ms",
+        spec_.c_str(), static_cast<int>(now_ms - ejected_at_ms_));
+  }
+  return !ejected_;
+}
+
+void NgxMemCache::Server::AddGet(Operation* op) {
+  if (ejected_) {
+    cache_->ReportGet(op, NULL);
+    return;
+  }
+  if (current_ == NULL) {
+    current_ = new Batch(next_opaque_);
+  }
+  AppendRequest(kOpGetKQ, current_->base_opaque + current_->lookups.size(),
+                op->hashed_key, StringPiece(), StringPiece(), &out_);
+  current_->lookups.push_back(op);
+}
+
+void NgxMemCache::Server::AddPut(const Operation& op) {
+  if (!ejected_) {
+    char extras[kSetExtrasSize];
+    memset(extras, 0, sizeof(extras));
+    AppendRequest(kOpSetQ, 0, op.hashed_key,
+                  StringPiece(extras, sizeof(extras)),
+                  op.key_and_value.Value(), &out_);
+  }
+}
+
+void NgxMemCache::Server::AddDelete(const Operation& op) {
+  if (!ejected_) {
+    AppendRequest(kOpDeleteQ, 0, op.hashed_key, StringPiece(), StringPiece(),
+                  &out_);
+  }
+}
+
+void NgxMemCache::Server::Flush() {
+  int64 now_ms = cache_->timer_->NowMs();
+  if (current_ != NULL) {
+    uint32 noop_opaque = current_->base_opaque + current_->lookups.size();
+    AppendRequest(kOpNoop, noop_opaque, StringPiece(), StringPiece(),
+                  StringPiece(), &out_);
+    next_opaque_ = noop_opaque + 1;
+    current_->sent_ms = now_ms;
+    in_flight_.push_back(current_);
+    current_ = NULL;
+  }
+  if (out_pos_ == out_.size()) {
+    return;
+  }
+  if (write_started_ms_ < 0) {
+    write_started_ms_ = now_ms;
+  }
+  if (connection_ == NULL && !Connect()) {
+    Fail(false);
+    return;
+  }
+  if (!connecting_ && !Write()) {
+    return;
+  }
+  UpdateTimeout();
+}
+
+bool NgxMemCache::Server::Connect() {
+  ngx_peer_connection_t pc;
+  ngx_memzero(&pc, sizeof(pc));
+  pc.sockaddr = url_.addrs[0].sockaddr;
+  pc.socklen = url_.addrs[0].socklen;
+  pc.name = &url_.addrs[0].name;
+  // get callback is dummy function, it just returns NGX_OK
+  pc.get = ngx_event_get_peer;
+  pc.log_error = NGX_ERROR_ERR;
+  pc.log = cache_->log_;
+  pc.rcvbuf = -1;
+
+  ngx_int_t rc = ngx_event_connect_peer(&pc);
+  if (rc != NGX_OK && rc != NGX_AGAIN) {
+    // ngx_event_connect_peer has already closed the connection, if any.
+    return false;
+  }
+
+  connection_ = pc.connection;
+  connection_->data = this;
+  connection_->read->handler = ReadHandler;
+  connection_->write->handler = WriteHandler;
+  connecting_ = (rc == NGX_AGAIN);
+
+  // Pipelined requests are small and latency sensitive.
+  int nodelay = 1;
+  setsockopt(connection_->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+             sizeof(nodelay));
+
+  if (ngx_handle_read_event(connection_->read, 0) != NGX_OK) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void NgxMemCache::Server::Close() {
+  if (connection_ != NULL) {
+    ngx_close_connection(connection_);
+    connection_ = NULL;
+  }
+  connecting_ = false;
+  out_.clear();
+  out_pos_ = 0;
+  write_started_ms_ = -1;
+  in_.clear();
+}
+
+void NgxMemCache::Server::Abort() {
+  Close();
+  if (current_ != NULL) {
+    in_flight_.push_back(current_);
+    current_ = NULL;
+  }
+  while (!in_flight_.empty()) {
+    Batch* batch = in_flight_.front();
+    in_flight_.pop_front();
+    for (size_t i = batch->next; i < batch->lookups.size(); ++i) {
+      cache_->ReportGet(batch->lookups[i], NULL);
+    }
+    delete batch;
+  }
+}
+
+void NgxMemCache::Server::Fail(bool timed_out) {
+  ++failures_;
+  ++ejections_;
+  cache_->errors_->Add(1);
+  cache_->ejections_->Add(1);
+  if (timed_out) {
+    cache_->timeouts_->Add(1);
+  }
+  int shift = std::min(consecutive_failures_, kMaxRetryShift);
+  ++consecutive_failures_;
+  int64 retry_interval_ms = kRetryIntervalMs << shift;
+  cache_->message_handler_->Message(
+      kError, "NgxMemCache: %s talking to memcached server %s, ejecting it "
+      "for %d ms", timed_out ? "timeout" : "error", spec_.c_str(),
+      static_cast<int>(retry_interval_ms));
+  ejected_ = true;
+  ejected_at_ms_ = cache_->timer_->NowMs();
+  retry_after_ms_ = ejected_at_ms_ + retry_interval_ms;
+  Abort();
+  cache_->UpdateHealth();
+}
+
+bool NgxMemCache::Server::Write() {
+  ngx_connection_t* c = connection_;
+  while (out_pos_ < out_.size()) {
+    ssize_t n = c->send(c, reinterpret_cast<u_char*>(&out_[out_pos_]),
+                        out_.size() - out_pos_);
+    if (n > 0) {
+      out_pos_ += n;
+    } else if (n == NGX_AGAIN || n == 0) {
+      // Nothing went out; wait for the socket to drain rather than spin.
+      if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        Fail(false);
+        return false;
+      }
+      return true;
+    } else {
+      c->error = 1;
+      Fail(false);
+      return false;
+    }
+  }
+  out_.clear();
+  out_pos_ = 0;
+  write_started_ms_ = -1;
+  return true;
+}
+
+void NgxMemCache::Server::UpdateTimeout() {
+  if (connection_ == NULL) {
+    return;
+  }
+  int64 started_ms = write_started_ms_;
+  if (!in_flight_.empty() &&
+      (started_ms < 0 || in_flight_.front()->sent_ms < started_ms)) {
+    started_ms = in_flight_.front()->sent_ms;
+  }
+  if (started_ms < 0) {
+    if (connection_->read->timer_set) {
+      ngx_del_timer(connection_->read);
+    }
+    return;
+  }
+  int64 remaining_ms =
+      started_ms + cache_->timeout_ms_ - cache_->timer_->NowMs();
+  ngx_add_timer(connection_->read,
+                static_cast<ngx_msec_t>(std::max<int64>(remaining_ms, 1)));
+}
+
+bool NgxMemCache::Server::ProcessResponses() {
+  size_t pos = 0;
+  while (in_.size() - pos >= static_cast<size_t>(kHeaderSize)) {
+    const unsigned char* header =
+        reinterpret_cast<const unsigned char*>(in_.data() + pos);
+    if (header[0] != kResponseMagic) {
+      return false;
+    }
+    uint8 opcode = header[1];
+    uint16 key_length = GetUint16(header + 2);
+    uint8 extras_length = header[4];
+    uint16 status = GetUint16(header + 6);
+    uint32 body_length = GetUint32(header + 8);
+    uint32 opaque = GetUint32(header + 12);
+    if (in_.size() - pos - kHeaderSize < body_length) {
+      break;  // Wait for the rest of the body.
+    }
+    StringPiece body(in_.data() + pos + kHeaderSize, body_length);
+    pos += kHeaderSize + body_length;
+
+    if (opcode != kOpGetKQ && opcode != kOpNoop) {
+      // Quiet sets and deletes only answer when something went wrong.
+      if (status != kStatusOk && status != kStatusKeyNotFound) {
+        cache_->errors_->Add(1);
+      }
+      continue;
+    }
+
+    if (in_flight_.empty()) {
+      return false;
+    }
+    Batch* batch = in_flight_.front();
+    size_t index = opaque - batch->base_opaque;
+    if (index < batch->next || index > batch->lookups.size()) {
+      return false;
+    }
+    // Quiet gets only answer hits, so anything we skipped over is a miss.
+    for (; batch->next < index; ++batch->next) {
+      cache_->ReportMiss(batch->lookups[batch->next]);
+    }
+    if (opcode == kOpNoop) {
+      if (index != batch->lookups.size()) {
+        return false;
+      }
+      in_flight_.pop_front();
+      delete batch;
+    } else {
+      if (index == batch->lookups.size()) {
+        return false;
+      }
+      Operation* op = batch->lookups[batch->next++];
+      if (status == kStatusOk &&
+          static_cast<uint32>(key_length) + extras_length <= body_length) {
+        StringPiece value = body.substr(key_length + extras_length);
+        cache_->ReportGet(op, &value);
+      } else {
+        cache_->ReportMiss(op);
+      }
+    }
+  }
+  in_.erase(0, pos);
+  return true;
+}
+
+void NgxMemCache::Server::WriteHandler(ngx_event_t* wev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(wev->data);
+  Server* server = static_cast<Server*>(c->data);
+  server->connecting_ = false;
+  if (server->Write()) {
+    server->UpdateTimeout();
+  }
+}
+
+void NgxMemCache::Server::ReadHandler(ngx_event_t* rev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(rev->data);
+  Server* server = static_cast<Server*>(c->data);
+
+  if (rev->timedout) {
+    server->Fail(true);
+    return;
+  }
+
+  u_char buf[16384];
+  for (;;) {
+    ssize_t n = c->recv(c, buf, sizeof(buf));
+    if (n == NGX_AGAIN) {
+      break;
+    } else if (n > 0) {
+      server->in_.append(reinterpret_cast<char*>(buf), n);
+    } else if (n == 0 && server->in_flight_.empty()) {
+      // The server dropped an idle connection; reconnect when needed.
+      server->Close();
+      return;
+    } else {
+      server->Fail(false);
+      return;
+    }
+  }
+
+  NgxMemCache* cache = server->cache_;
+  if (!server->ProcessResponses()) {
+    cache->message_handler_->Message(
+        kError, "NgxMemCache: unexpected response from memcached server %s",
+        server->spec_.c_str());
+    server->Fail(false);
+  } else {
+    server->consecutive_failures_ = 0;
+    server->UpdateTimeout();
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+      server->Fail(false);
+    }
+  }
+  // Send any hot-key lookups that missed on this replica to their primaries.
+  cache->FlushServers();
+}
+
+void NgxMemCache::Server::AppendStatus(int64 now_ms,
+                                       GoogleString* out) const {
+  GoogleString state = "idle";
+  if (ejected_) {
+    state = StrCat("ejected ", Integer64ToString(now_ms - ejected_at_ms_),
+                   " ms ago");
+    if (now_ms < retry_after_ms_) {
+      StrAppend(&state, ", re-admitted in ",
+                Integer64ToString(retry_after_ms_ - now_ms), " ms");
+    } else {
+      StrAppend(&state, ", re-admitted on next use");
+    }
+  } else if (connection_ != NULL) {
+    state = connecting_ ? "connecting" : "connected";
+  }
+  size_t lookups = 0;
+  for (std::deque<Batch*>::const_iterator p = in_flight_.begin(),
+           e = in_flight_.end(); p != e; ++p) {
+    lookups += (*p)->lookups.size() - (*p)->next;
+  }
+  StrAppend(out, "memcached server ", spec_, ": ", state, ", ");
+  StrAppend(out, IntegerToString(lookups), " lookups in flight, ",
+            Integer64ToString(failures_), " failures, ");
+  StrAppend(out, Integer64ToString(ejections_), " ejections\n");
+}
+
+NgxMemCache::NgxMemCache(const StringPiece& servers, int64 timeout_ms,
+                         int hot_key_replicas, Hasher* hasher,
+                         Statistics* statistics, Timer* timer,
+                         ThreadSystem* thread_system, MessageHandler* handler)
+    : timeout_ms_(timeout_ms),
+      hot_key_replicas_(std::max(1, hot_key_replicas)),
+      access_counts_(kAccessCountSlots, 0),
+      lookups_since_decay_(0),
+      replica_rotor_(0),
+      hasher_(hasher),
+      timer_(timer),
+      message_handler_(handler),
+      mutex_(thread_system->NewMutex()),
+      command_pending_(false),
+      shutdown_(false),
+      unhealthy_until_ms_(0),
+      log_(NULL),
+      pool_(NULL),
+      command_connection_(NULL),
+      pipe_fd_(-1),
+      batches_(statistics->GetVariable(kNgxMemCacheBatches)),
+      errors_(statistics->GetVariable(kNgxMemCacheErrors)),
+      timeouts_(statistics->GetVariable(kNgxMemCacheTimeouts)),
+      ejections_(statistics->GetVariable(kNgxMemCacheEjections)),
+      readmissions_(statistics->GetVariable(kNgxMemCacheReadmissions)),
+      hot_key_lookups_(statistics->GetVariable(kNgxMemCacheHotKeyLookups)) {
+  servers.CopyToString(&server_spec_);
+  StringPieceVector server_vector;
+  SplitStringPieceToVector(servers, ",", &server_vector, true);
+  for (int i = 0, n = server_vector.size(); i < n; ++i) {
+    StringPiece spec = server_vector[i];
+    TrimWhitespace(&spec);
+    servers_.push_back(new Server(this, spec));
+
+    // Place the server on the ring the way libketama does: four points out
+    // of each of kRingHashesPerServer MD5s of "host:port-i".
+    for (int j = 0; j < kRingHashesPerServer; ++j) {
+      GoogleString digest = hasher_->RawHash(
+          StrCat(spec, "-", IntegerToString(j)));
+      const unsigned char* bytes =
+          reinterpret_cast<const unsigned char*>(digest.data());
+      for (int k = 0; k + 4 <= static_cast<int>(digest.size()) && k < 16;
+           k += 4) {
+        uint32 point = (static_cast<uint32>(bytes[k + 3]) << 24) |
+            (static_cast<uint32>(bytes[k + 2]) << 16) |
+            (static_cast<uint32>(bytes[k + 1]) << 8) | bytes[k];
+        ring_.push_back(RingEntry(point, i));
+      }
+    }
+  }
+  std::sort(ring_.begin(), ring_.end());
+}
+
+NgxMemCache::~NgxMemCache() {
+  CancelAll();
+  STLDeleteElements(&servers_);
+  if (command_connection_ != NULL) {
+    ngx_close_connection(command_connection_);
+    command_connection_ = NULL;
+  }
+  if (pipe_fd_ != -1) {
+    close(pipe_fd_);
+    pipe_fd_ = -1;
+  }
+  if (pool_ != NULL) {
+    ngx_destroy_pool(pool_);
+    pool_ = NULL;
+  }
+}
+
+void NgxMemCache::InitStats(Statistics* statistics) {
+  CacheStats::InitStats(kStatsPrefix, statistics);
+  statistics->AddVariable(kNgxMemCacheBatches);
+  statistics->AddVariable(kNgxMemCacheErrors);
+  statistics->AddVariable(kNgxMemCacheTimeouts);
+  statistics->AddVariable(kNgxMemCacheEjections);
+  statistics->AddVariable(kNgxMemCacheReadmissions);
+  statistics->AddVariable(kNgxMemCacheHotKeyLookups);
+}
+
+// Create the pool, create the pipe, add the read event for the nginx thread,
+// and resolve the servers.  It should be called in the worker process.
+bool NgxMemCache::Init() {
+  log_ = ngx_cycle->log;
+
+  if (servers_.empty()) {
+    ngx_log_error(NGX_LOG_ERR, log_, 0,
+                  "NgxMemCache: no memcached servers in \"%s\"",
+                  server_spec_.c_str());
+    return false;
+  }
+
+  pool_ = ngx_create_pool(4096, log_);
+  if (pool_ == NULL) {
+    ngx_log_error(NGX_LOG_ERR, log_, 0, "NgxMemCache::Init create pool failed");
+    return false;
+  }
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    if (!servers_[i]->Init(pool_)) {
+      return false;
+    }
+  }
+
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    ngx_log_error(NGX_LOG_ERR, log_, ngx_errno, "NgxMemCache: pipe() failed");
+    return false;
+  }
+  if (ngx_nonblocking(pipe_fds[0]) == -1 ||
+      ngx_nonblocking(pipe_fds[1]) == -1) {
+    ngx_log_error(NGX_LOG_ERR, log_, ngx_errno,
+                  "NgxMemCache: nonblocking pipe failed");
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return false;
+  }
+
+  command_connection_ = ngx_get_connection(pipe_fds[0], log_);
+  if (command_connection_ == NULL) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return false;
+  }
+  command_connection_->recv = ngx_recv;
+  command_connection_->send = ngx_send;
+  command_connection_->recv_chain = ngx_recv_chain;
+  command_connection_->send_chain = ngx_send_chain;
+  command_connection_->log = log_;
+  command_connection_->read->log = log_;
+  command_connection_->write->log = log_;
+  command_connection_->data = this;
+  command_connection_->read->handler = CommandHandler;
+  if (ngx_add_event(command_connection_->read, NGX_READ_EVENT, 0) != NGX_OK) {
+    return false;
+  }
+
+  ScopedMutex lock(mutex_.get());
+  pipe_fd_ = pipe_fds[1];
+  return true;
+}
+
+void NgxMemCache::Get(const GoogleString& key, Callback* callback) {
+  Enqueue(new Operation(Operation::kGet, key, callback));
+}
+
+void NgxMemCache::MultiGet(MultiGetRequest* request) {
+  OperationVector ops;
+  ops.reserve(request->size());
+  for (int i = 0, n = request->size(); i < n; ++i) {
+    KeyCallback* key_callback = &(*request)[i];
+    ops.push_back(new Operation(Operation::kGet, key_callback->key,
+                                key_callback->callback));
+  }
+  delete request;
+  EnqueueBatch(&ops);
+}
+
+void NgxMemCache::Put(const GoogleString& key, SharedString* value) {
+  Operation* op = new Operation(Operation::kPut, key, NULL);
+  if (!key_value_codec::Encode(key, value, &op->key_and_value)) {
+    message_handler_->Message(
+        kError, "NgxMemCache::Put error: key size %d too large, first "
+        "100 bytes of key is: %s",
+        static_cast<int>(key.size()), key.substr(0, 100).c_str());
+    delete op;
+    return;
+  }
+  if (static_cast<size_t>(op->key_and_value.size()) > kMaxValueSize) {
+    delete op;
+    return;
+  }
+  Enqueue(op);
+}
+
+void NgxMemCache::PutWithKeyInValue(const GoogleString& key,
+                                    SharedString* key_and_value) {
+  if (static_cast<size_t>(key_and_value->size()) > kMaxValueSize) {
+    return;
+  }
+  Operation* op = new Operation(Operation::kPut, key, NULL);
+  op->key_and_value = *key_and_value;
+  Enqueue(op);
+}
+
+void NgxMemCache::Delete(const GoogleString& key) {
+  Enqueue(new Operation(Operation::kDelete, key, NULL));
+}
+
+bool NgxMemCache::IsHealthy() const {
+  ScopedMutex lock(mutex_.get());
+  return !shutdown_ && timer_->NowMs() >= unhealthy_until_ms_;
+}
+
+void NgxMemCache::ShutDown() {
+  ScopedMutex lock(mutex_.get());
+  if (!shutdown_) {
+    shutdown_ = true;
+    if (pipe_fd_ != -1) {
+      SendCmd('S');
+    }
+  }
+}
+
+void NgxMemCache::Enqueue(Operation* op) {
+  OperationVector ops(1, op);
+  EnqueueBatch(&ops);
+}
+
+void NgxMemCache::EnqueueBatch(OperationVector* ops) {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (!shutdown_ && pipe_fd_ != -1) {
+      if (command_pending_) {
+        pending_.insert(pending_.end(), ops->begin(), ops->end());
+        return;
+      }
+      if (SendCmd('C')) {
+        command_pending_ = true;
+        pending_.insert(pending_.end(), ops->begin(), ops->end());
+        return;
+      }
+      // Nothing would wake the nginx thread for these.
+      errors_->Add(1);
+    }
+  }
+  // We are not running (yet, or any more), or can't wake the nginx thread:
+  // lookups miss, writes are dropped.
+  for (int i = 0, n = ops->size(); i < n; ++i) {
+    Operation* op = (*ops)[i];
+    if (op->type == Operation::kGet) {
+      ValidateAndReportResult(op->key, kNotFound, op->callback);
+    }
+    delete op;
+  }
+}
+
+// Must be called with mutex_ held, so we don't wait for room in the pipe.
+// command_pending_ keeps it down to a byte or two, so it is only full if the
+// nginx thread has stopped reading it.
+bool NgxMemCache::SendCmd(const char command) {
+  for (int attempt = 0; attempt < kMaxSendCmdAttempts; ++attempt) {
+    int rc = write(pipe_fd_, &command, 1);
+    if (rc == 1) {
+      return true;
+    } else if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    break;
+  }
+  return false;
+}
+
+// The read handler for the command pipe, run on the nginx thread.
+void NgxMemCache::CommandHandler(ngx_event_t* cmdev) {
+  ngx_connection_t* c = static_cast<ngx_connection_t*>(cmdev->data);
+  NgxMemCache* cache = static_cast<NgxMemCache*>(c->data);
+
+  bool dispatch = false;
+  char commands[64];
+  for (;;) {
+    ssize_t rc = read(c->fd, commands, sizeof(commands));
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    } else if (rc <= 0) {
+      break;  // EAGAIN
+    }
+    for (ssize_t i = 0; i < rc; ++i) {
+      switch (commands[i]) {
+        case 'C':
+          dispatch = true;
+          break;
+        case 'S':
+          cache->CancelAll();
+          CHECK(ngx_del_event(cmdev, NGX_READ_EVENT, 0) == NGX_OK);
+          return;
+        default:
+          break;
+      }
+    }
+  }
+
+  if (dispatch) {
+    cache->DispatchPending();
+  }
+  CHECK(ngx_handle_read_event(cmdev, 0) == NGX_OK);
+}
+
+void NgxMemCache::DispatchPending() {
+  OperationVector ops;
+  {
+    ScopedMutex lock(mutex_.get());
+    ops.swap(pending_);
+    command_pending_ = false;
+  }
+  if (ops.empty()) {
+    return;
+  }
+  batches_->Add(1);
+  int64 now_ms = timer_->NowMs();
+  std::vector<Server*> targets;
+  for (int i = 0, n = ops.size(); i < n; ++i) {
+    Operation* op = ops[i];
+    op->hashed_key = hasher_->Hash(op->key);
+    uint32 point = RingPoint(op->hashed_key);
+    bool hot = (op->type == Operation::kGet) ?
+        RecordLookup(point) : IsHot(point);
+    // Deletes go to every replica, in case the key was hot when written.
+    int replicas = (hot || op->type == Operation::kDelete) ?
+        hot_key_replicas_ : 1;
+    ServersForPoint(point, replicas, now_ms, &targets);
+    if (targets.empty()) {
+      // Every server is ejected.
+      if (op->type == Operation::kGet) {
+        ReportGet(op, NULL);
+      } else {
+        delete op;
+      }
+      continue;
+    }
+    switch (op->type) {
+      case Operation::kGet: {
+        // Spread reads of a hot key over its replicas, falling back to the
+        // primary if the replica doesn't have it yet.
+        Server* server = targets[replica_rotor_++ % targets.size()];
+        if (server != targets[0]) {
+          op->fallback = targets[0];
+          hot_key_lookups_->Add(1);
+        }
+        server->AddGet(op);
+        break;
+      }
+      case Operation::kPut:
+        for (int j = 0, m = targets.size(); j < m; ++j) {
+          targets[j]->AddPut(*op);
+        }
+        delete op;
+        break;
+      case Operation::kDelete:
+        for (int j = 0, m = targets.size(); j < m; ++j) {
+          targets[j]->AddDelete(*op);
+        }
+        delete op;
+        break;
+    }
+  }
+  FlushServers();
+}
+
+void NgxMemCache::FlushServers() {
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    servers_[i]->Flush();
+  }
+}
+
+void NgxMemCache::CancelAll() {
+  OperationVector ops;
+  {
+    ScopedMutex lock(mutex_.get());
+    ops.swap(pending_);
+    command_pending_ = false;
+  }
+  for (int i = 0, n = ops.size(); i < n; ++i) {
+    Operation* op = ops[i];
+    if (op->type == Operation::kGet) {
+      ValidateAndReportResult(op->key, kNotFound, op->callback);
+    }
+    delete op;
+  }
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    servers_[i]->Abort();
+  }
+}
+
+void NgxMemCache::ServersForPoint(uint32 point, int max_servers,
+                                  int64 now_ms,
+                                  std::vector<Server*>* servers) {
+  servers->clear();
+  if (ring_.empty()) {
+    return;
+  }
+  // Walk clockwise from the first ring entry at or after point, skipping
+  // ejected servers and ones we already picked.
+  std::vector<RingEntry>::const_iterator start = std::lower_bound(
+      ring_.begin(), ring_.end(), RingEntry(point, 0));
+  int ring_index = start - ring_.begin();
+  std::vector<bool> seen(servers_.size(), false);
+  for (int i = 0, n = ring_.size();
+       i < n && static_cast<int>(servers->size()) < max_servers; ++i) {
+    int server_index = ring_[(ring_index + i) % n].second;
+    if (!seen[server_index]) {
+      seen[server_index] = true;
+      Server* server = servers_[server_index];
+      if (server->InRotation(now_ms)) {
+        servers->push_back(server);
+      }
+    }
+  }
+}
+
+bool NgxMemCache::RecordLookup(uint32 point) {
+  if (hot_key_replicas_ <= 1) {
+    return false;
+  }
+  if (++lookups_since_decay_ >= kAccessDecayLookups) {
+    lookups_since_decay_ = 0;
+    for (int i = 0; i < kAccessCountSlots; ++i) {
+      access_counts_[i] /= 2;
+    }
+  }
+  uint16& count = access_counts_[point % kAccessCountSlots];
+  if (count < kHotKeyThreshold) {
+    ++count;
+  }
+  return count >= kHotKeyThreshold;
+}
+
+bool NgxMemCache::IsHot(uint32 point) const {
+  return hot_key_replicas_ > 1 &&
+      access_counts_[point % kAccessCountSlots] >= kHotKeyThreshold;
+}
+
+void NgxMemCache::UpdateHealth() {
+  // We're only unhealthy while every server is ejected, and only until the
+  // first of them is due to be re-admitted.
+  int64 unhealthy_until_ms = 0;
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    Server* server = servers_[i];
+    if (!server->ejected()) {
+      unhealthy_until_ms = 0;
+      break;
+    }
+    if (unhealthy_until_ms == 0 ||
+        server->retry_after_ms() < unhealthy_until_ms) {
+      unhealthy_until_ms = server->retry_after_ms();
+    }
+  }
+  ScopedMutex lock(mutex_.get());
+  unhealthy_until_ms_ = unhealthy_until_ms;
+}
+
+void NgxMemCache::ReportMiss(Operation* op) {
+  Server* fallback = op->fallback;
+  if (fallback != NULL) {
+    // Picked up by the FlushServers() at the end of the read handler.
+    op->fallback = NULL;
+    fallback->AddGet(op);
+  } else {
+    ReportGet(op, NULL);
+  }
+}
+
+void NgxMemCache::ReportGet(Operation* op, const StringPiece* value_bytes) {
+  KeyState state = kNotFound;
+  if (value_bytes != NULL) {
+    SharedString key_and_value(*value_bytes);
+    GoogleString actual_key;
+    if (!key_value_codec::Decode(&key_and_value, &actual_key,
+                                 op->callback->value())) {
+      message_handler_->Message(
+          kError, "NgxMemCache::Get decoding error on key %s",
+          op->key.c_str());
+    } else if (actual_key != op->key) {
+      message_handler_->Message(
+          kError, "NgxMemCache::Get key collision %s != %s",
+          op->key.c_str(), actual_key.c_str());
+    } else {
+      state = kAvailable;
+    }
+  }
+  ValidateAndReportResult(op->key, state, op->callback);
+  delete op;
+}
+
+void NgxMemCache::PrintServerStatus(GoogleString* out) {
+  int64 now_ms = timer_->NowMs();
+  for (int i = 0, n = servers_.size(); i < n; ++i) {
+    servers_[i]->AppendStatus(now_ms, out);
+  }
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Memcached client that runs on the nginx worker's event loop.
+//
+// Cache operations may be issued from any thread.  They are appended to a
+// pending queue and the nginx thread is woken through a pipe, the same way
+// NgxUrlAsyncFetcher starts its fetches.  The nginx thread then writes
+// everything that queued up since the last wakeup to a single persistent
+// connection per server using the memcached binary protocol: lookups are
+// sent as quiet GETKQ requests terminated by a NOOP, so a whole MultiGet (or
+// a burst of unrelated Gets) costs one write and one round trip, and misses
+// are detected when the NOOP response comes back.  Puts and Deletes use the
+// quiet SETQ and DELETEQ forms and don't wait for a reply.
+//
+// Callbacks are run on the nginx thread.
+
+#ifndef NGX_MEM_CACHE_H_
+#define NGX_MEM_CACHE_H_
+
+extern "C" {
+  #include <ngx_config.h>
+  #include <ngx_core.h>
+}
+
+#include <utility>
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/cache_interface.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+#include "net/instaweb/util/public/thread_system.h"
+
+namespace net_instaweb {
+
+class Hasher;
+class MessageHandler;
+class SharedString;
+class Statistics;
+class Timer;
+class Variable;
+
+class NgxMemCache : public CacheInterface {
+ public:
+  // CacheStats prefix for the native client.
+  static const char kStatsPrefix[];
+
+  // servers is a comma-separated list of host[:port], as accepted by
+  // MemcachedServers.  Keys are hashed with hasher, which is not owned and
+  // must be an MD5Hasher, and spread over the servers with a consistent-hash
+  // ring.  Keys that see a lot of lookups are written to hot_key_replicas
+  // servers and read from any of them; 1 turns that off.
+  NgxMemCache(const StringPiece& servers, int64 timeout_ms,
+              int hot_key_replicas, Hasher* hasher, Statistics* statistics,
+              Timer* timer, ThreadSystem* thread_system,
+              MessageHandler* handler);
+  virtual ~NgxMemCache();
+
+  static void InitStats(Statistics* statistics);
+
+  // Creates the command pipe and resolves the servers.  Must be called in
+  // the worker process, before any cache operation is issued.
+  bool Init();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void MultiGet(MultiGetRequest* request);
+  virtual void Put(const GoogleString& key, SharedString* value);
+  virtual void Delete(const GoogleString& key);
+  virtual const char* Name() const { return "NgxMemCache"; }
+  virtual bool IsBlocking() const { return false; }
+  virtual bool IsHealthy() const;
+  virtual void ShutDown();
+
+  virtual bool MustEncodeKeyInValueOnPut() const { return true; }
+  virtual void PutWithKeyInValue(const GoogleString& key,
+                                 SharedString* key_and_value);
+
+  // Appends a line per server describing its connection state and any
+  // ejection from the ring.
+  void PrintServerStatus(GoogleString* out);
+
+  const GoogleString& server_spec() const { return server_spec_; }
+
+ private:
+  class Server;
+  struct Operation;
+  typedef std::vector<Operation*> OperationVector;
+  // A point on the consistent-hash ring and the index of its server.
+  typedef std::pair<uint32, int> RingEntry;
+
+  // Queues op for the nginx thread and wakes it up if needed.
+  void Enqueue(Operation* op);
+  void EnqueueBatch(OperationVector* ops);
+
+  // Send a command from the current thread to the nginx thread.
+  // 'C' : dispatch the pending operations
+  // 'S' : shut down, failing everything that is outstanding
+  bool SendCmd(const char command);
+  static void CommandHandler(ngx_event_t* cmdev);
+
+  // These run on the nginx thread.
+  void DispatchPending();
+  void FlushServers();
+  void CancelAll();
+  // Fills *servers with up to max_servers distinct servers in rotation,
+  // walking the ring from point.  The first one is the key's primary.
+  void ServersForPoint(uint32 point, int max_servers, int64 now_ms,
+                       std::vector<Server*>* servers);
+  // Counts a lookup of the key at point, returning whether it is hot.
+  bool RecordLookup(uint32 point);
+  bool IsHot(uint32 point) const;
+  // Recomputes unhealthy_until_ms_ after a server is ejected.
+  void UpdateHealth();
+
+  // Completes a lookup, with value_bytes holding the key-encoded value when
+  // the server had it, or NULL for a miss.  Deletes op.
+  void ReportGet(Operation* op, const StringPiece* value_bytes);
+  // Reports a miss, unless op was sent to a hot-key replica, in which case
+  // it is retried on the primary.
+  void ReportMiss(Operation* op);
+
+  GoogleString server_spec_;
+  int64 timeout_ms_;
+  int hot_key_replicas_;
+  std::vector<RingEntry> ring_;
+  // Decaying lookup counts for hot-key detection, indexed by ring point.
+  std::vector<uint16> access_counts_;
+  int lookups_since_decay_;
+  uint32 replica_rotor_;
+  Hasher* hasher_;
+  Timer* timer_;
+  MessageHandler* message_handler_;
+  std::vector<Server*> servers_;
+
+  // Protects pending_, command_pending_, shutdown_ and unhealthy_until_ms_.
+  scoped_ptr<ThreadSystem::CondvarCapableMutex> mutex_;
+  OperationVector pending_;
+  // True while a 'C' is sitting in the pipe, so a burst of operations only
+  // wakes the nginx thread once.
+  bool command_pending_;
+  bool shutdown_;
+  // We report ourselves unhealthy while every server is ejected.
+  int64 unhealthy_until_ms_;
+
+  ngx_log_t* log_;
+  ngx_pool_t* pool_;
+  ngx_connection_t* command_connection_;  // the command pipe
+  int pipe_fd_;  // the write pipe end
+
+  Variable* batches_;
+  Variable* errors_;
+  Variable* timeouts_;
+  Variable* ejections_;
+  Variable* readmissions_;
+  Variable* hot_key_lookups_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxMemCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_MEM_CACHE_H_
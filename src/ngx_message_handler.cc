@@ -20,6 +20,8 @@
 
 #include "apr_time.h"
 
+#include "ngx_filter_cpu_timer.h"
+
 #include "net/instaweb/util/public/abstract_mutex.h"
 #include "net/instaweb/util/public/debug.h"
 #include "net/instaweb/util/public/shared_circular_buffer.h"
@@ -59,7 +61,8 @@ namespace net_instaweb {
 NgxMessageHandler::NgxMessageHandler(AbstractMutex* mutex)
     : mutex_(mutex),
       buffer_(NULL),
-      log_(NULL) {
+      log_(NULL),
+      filter_cpu_timer_(NULL) {
   SetPidString(static_cast<int64>(getpid()));
 }
 
@@ -140,6 +143,10 @@ void NgxMessageHandler::FileMessageVImpl(MessageType type, const char* file,
                                          va_list args) {
   ngx_uint_t log_level = GetNgxLogLevel(type);
   GoogleString formatted_message = Format(msg, args);
+  if (type == kInfo && filter_cpu_timer_ != NULL &&
+      filter_cpu_timer_->HandleMessage(formatted_message)) {
+    return;
+  }
   if (log_ != NULL) {
     ngx_log_error(log_level, log_, 0/*ngx_err_t*/, "[%s %s] %s:%d:%s",
                   kModuleName, kModPagespeedVersion, file, line,
@@ -34,6 +34,7 @@ extern "C" {
 namespace net_instaweb {
 
 class AbstractMutex;
+class NgxFilterCpuTimer;
 class SharedCircularBuffer;
 class Timer;
 class Writer;
@@ -54,6 +55,11 @@ class NgxMessageHandler : public GoogleMessageHandler {
   // Messages logged before that will be passed on to handler_;
   void set_buffer(SharedCircularBuffer* buff);
   void set_log(ngx_log_t* log) { log_ = log; }
+  // For the HTML parse message handler: info messages go to timer first,
+  // which takes the ones it times filters by.  Not owned.
+  void set_filter_cpu_timer(NgxFilterCpuTimer* timer) {
+    filter_cpu_timer_ = timer;
+  }
 
   void SetPidString(const int64 pid) {
     pid_string_ = StrCat("[", Integer64ToString(pid), "]");
@@ -78,6 +84,7 @@ class NgxMessageHandler : public GoogleMessageHandler {
   GoogleMessageHandler handler_;
   SharedCircularBuffer* buffer_;
   ngx_log_t* log_;
+  NgxFilterCpuTimer* filter_cpu_timer_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxMessageHandler);
 };
@@ -30,6 +30,7 @@ extern "C" {
   #include <ngx_core.h>
   #include <ngx_http.h>
   #include <ngx_log.h>
+  #include <nginx.h>
 }
 
 #include <unistd.h>
@@ -37,11 +38,20 @@ extern "C" {
 #include <set>
 
 #include "ngx_base_fetch.h"
+#include "ngx_cache_purger.h"
+#include "ngx_cache_stats_report.h"
+#include "ngx_filter_cpu_timer.h"
+#include "ngx_html_load_shedder.h"
+#include "ngx_html_output_cache.h"
 #include "ngx_message_handler.h"
+#include "ngx_prometheus_statistics.h"
+#include "ngx_property_cache_batcher.h"
 #include "ngx_request_context.h"
+#include "ngx_request_trace.h"
 #include "ngx_rewrite_driver_factory.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_mem_statistics.h"
 #include "ngx_thread_system.h"
 
 #include "apr_time.h"
@@ -66,6 +76,7 @@ extern "C" {
 #include "net/instaweb/util/public/string.h"
 #include "net/instaweb/util/public/string_writer.h"
 #include "net/instaweb/util/public/time_util.h"
+#include "net/instaweb/util/public/url_to_filename_encoder.h"
 #include "net/instaweb/util/stack_buffer.h"
 
 extern ngx_module_t ngx_pagespeed;
@@ -189,6 +200,55 @@ ngx_int_t string_piece_to_buffer_chain(
   return NGX_OK;
 }
 
+// Pool cleanup handler for strings handed over by string_to_buffer_chain.
+void ps_delete_string(void* data) {
+  delete static_cast<GoogleString*>(data);
+}
+
+ngx_int_t string_to_buffer_chain(
+    ngx_pool_t* pool, GoogleString* str, ngx_chain_t** link_ptr,
+    bool send_last_buf) {
+  if (str->empty()) {
+    return string_piece_to_buffer_chain(pool, StringPiece(), link_ptr,
+                                        send_last_buf);
+  }
+
+  // Take over str's storage.  It lives until the pool is destroyed, which is
+  // after nginx is done with any buffers pointing into it.
+  GoogleString* owned = new GoogleString();
+  owned->swap(*str);
+
+  ngx_pool_cleanup_t* cleanup = ngx_pool_cleanup_add(pool, 0);
+  if (cleanup == NULL) {
+    delete owned;
+    return NGX_ERROR;
+  }
+  cleanup->handler = ps_delete_string;
+  cleanup->data = owned;
+
+  ngx_buf_t* b = static_cast<ngx_buf_t*>(ngx_calloc_buf(pool));
+  if (b == NULL) {
+    return NGX_ERROR;
+  }
+  b->start = b->pos = reinterpret_cast<u_char*>(
+      const_cast<char*>(owned->data()));
+  b->last = b->end = b->pos + owned->size();
+  // In memory but not ours to modify, so downstream filters must not write
+  // into it.
+  b->memory = 1;
+  b->last_buf = send_last_buf;
+
+  ngx_chain_t* cl = static_cast<ngx_chain_t*>(ngx_alloc_chain_link(pool));
+  if (cl == NULL) {
+    return NGX_ERROR;
+  }
+  cl->buf = b;
+  cl->next = NULL;
+  *link_ptr = cl;
+
+  return NGX_OK;
+}
+
 ngx_int_t copy_response_headers_to_ngx(
     ngx_http_request_t* r,
     const net_instaweb::ResponseHeaders& pagespeed_headers) {
@@ -311,6 +371,13 @@ ps_request_ctx_t* ps_get_request_context(ngx_http_request_t* r);
 
 void ps_initialize_server_context(ps_srv_conf_t* cfg);
 
+net_instaweb::NgxHtmlLoadShedder* ps_html_load_shedder(ngx_http_request_t* r);
+
+void ps_html_rewrite_done(ps_request_ctx_t* ctx, bool completed);
+
+void ps_record_phase(ps_request_ctx_t* ctx,
+                     net_instaweb::NgxRequestContext::Phase phase);
+
 namespace CreateRequestContext {
 enum Response {
   kOk,
@@ -322,9 +389,12 @@ enum Response {
   kBeacon,
   kStatistics,
   kMessages,
+  kPurge,
+  kTrace,
   kPagespeedSubrequest,
   kNotHeadOrGet,
   kErrorResponse,
+  kLoadShed,
 };
 }  // namespace CreateRequestContext
 
@@ -382,7 +452,14 @@ ngx_int_t ps_send_response(ngx_http_request_t *r) {
   // whole file in one chain buffers is too aggressive. It could consume
   // too much memory in busy servers.
 
+  if (cl != NULL) {
+    ps_record_phase(ctx, net_instaweb::NgxRequestContext::kFirstOutput);
+  }
   bool done = (rc == NGX_OK);
+  if (done) {
+    ps_html_rewrite_done(ctx, true /* completed */);
+    ps_record_phase(ctx, net_instaweb::NgxRequestContext::kDone);
+  }
 
   // body_filter can handle NULL chain.
   rc = ngx_http_next_body_filter(r, cl);
@@ -696,6 +773,48 @@ bool ps_is_global_only_option(const StringPiece& option_name) {
   return false;
 }
 
+// Options that size or configure per-process state shared by every server
+// block (caches, worker pools, shared memory segments), so they may only be
+// set in the http{} block.  These are stricter than global_only_options and
+// don't need to be repeated there.
+const char* const http_block_only_options[] = {
+  "HashFunction",
+  "LRUCacheAdmission",
+  "UseNativeMemcached",
+  "NativeMemcachedHotKeyReplicas",
+  "HtmlOutputCache",
+  "CompressMetadataCacheDictionary",
+  "ShardedStatistics",
+  "NumHtmlThreads",
+  "NumRewriteThreads",
+  "NumExpensiveRewriteThreads",
+  "LowPriorityLoadSheddingThreshold",
+  "HtmlLoadSheddingQueueDepth",
+  "HtmlLoadSheddingInFlight",
+  "HtmlLoadSheddingLatencyMs",
+  "ExpensiveRewriteCpus",
+  "ThreadCpuAffinity",
+  "LowPriorityRewriteNice",
+  "SchedulerSlackUs",
+  "QueueWaitSampleIntervalMs",
+  "FilterCpuTimingEvery",
+  "RequestTraceFile",
+  "RequestTraceSamplesPerMillion",
+  "CachePurgeTtlSec"
+};
+
+bool ps_is_http_block_only_option(const StringPiece& option_name) {
+  ngx_uint_t i;
+  ngx_uint_t size = sizeof(http_block_only_options) / sizeof(char*);
+  for (i = 0; i < size; i++) {
+    if (net_instaweb::StringCaseEqual(http_block_only_options[i],
+                                      option_name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 #define NGX_PAGESPEED_MAX_ARGS 10
 char* ps_configure(ngx_conf_t* cf,
                    net_instaweb::NgxRewriteOptions** options,
@@ -724,6 +843,12 @@ char* ps_configure(ngx_conf_t* cf,
           "UseNativeFetcher can only be set in the http{} block.");
     }
   }
+  if (ps_is_http_block_only_option(args[0])) {
+    if (option_level != PsConfigure::kServer) {
+      return string_piece_to_pool_string(cf->pool, net_instaweb::StrCat(
+          "\"", args[0], "\" can only be set in the http{} block."));
+    }
+  }
   if (option_level == PsConfigure::kLocation && n_args > 1) {
     if (ps_is_global_only_option(args[0])) {
       return string_piece_to_pool_string(cf->pool, net_instaweb::StrCat(
@@ -964,6 +1089,18 @@ char* ps_merge_loc_conf(ngx_conf_t* cf, void* parent, void* child) {
 void ps_release_request_context(void* data) {
   ps_request_ctx_t* ctx = static_cast<ps_request_ctx_t*>(data);
 
+  ps_html_rewrite_done(ctx, false /* abandoned */);
+
+  if (ctx->phase_timing != NULL) {
+    ps_srv_conf_t* cfg_s = ps_get_srv_config(ctx->r);
+    ctx->phase_timing->LogIfSlow(cfg_s->server_context->message_handler());
+    ctx->phase_timing = NULL;
+  }
+  if (ctx->trace != NULL) {
+    ctx->trace->End();
+    ctx->trace = NULL;
+  }
+
   // In the normal flow BaseFetch doesn't delete itself in HandleDone() because
   // we still need to receive notification via pipe and call
   // CollectAccumulatedWrites.  If there's an error and we're cleaning up early
@@ -986,6 +1123,12 @@ void ps_release_request_context(void* data) {
     ctx->proxy_fetch->Done(false /* failure */);
   }
 
+  // Likewise if we were still collecting the body for an HTML output cache
+  // lookup.
+  if (ctx->html_cache_lookup != NULL) {
+    ctx->html_cache_lookup->Abandon();
+  }
+
   if (ctx->inflater_ != NULL) {
     delete ctx->inflater_;
     ctx->inflater_ = NULL;
@@ -1127,6 +1270,68 @@ ps_loc_conf_t* ps_get_loc_config(ngx_http_request_t* r) {
       ngx_http_get_module_loc_conf(r, ngx_pagespeed));
 }
 
+// Whether "pagespeed AdminHandlers on" applies to r, from its location block
+// or else its server block.
+bool ps_admin_handlers_enabled(ngx_http_request_t* r, ps_srv_conf_t* cfg_s) {
+  ps_loc_conf_t* cfg_l = ps_get_loc_config(r);
+  const net_instaweb::NgxRewriteOptions* options = (cfg_l->options != NULL) ?
+      cfg_l->options : cfg_s->server_context->config();
+  return options->admin_handlers();
+}
+
+// NULL if load shedding is off.
+net_instaweb::NgxHtmlLoadShedder* ps_html_load_shedder(ngx_http_request_t* r) {
+  net_instaweb::NgxServerContext* server_context =
+      ps_get_srv_config(r)->server_context;
+  if (server_context == NULL) {
+    return NULL;
+  }
+  net_instaweb::NgxHtmlLoadShedder* shedder =
+      static_cast<net_instaweb::NgxRewriteDriverFactory*>(
+          server_context->factory())->html_load_shedder();
+  return (shedder != NULL && shedder->enabled()) ? shedder : NULL;
+}
+
+// Tells the load shedder an HTML rewrite it saw start is over, once.
+void ps_html_rewrite_done(ps_request_ctx_t* ctx, bool completed) {
+  if (ctx->html_rewrite_start_ms < 0) {
+    return;
+  }
+  net_instaweb::NgxHtmlLoadShedder* shedder = ps_html_load_shedder(ctx->r);
+  if (shedder != NULL) {
+    shedder->HtmlRewriteDone(ctx->html_rewrite_start_ms, completed);
+  }
+  ctx->html_rewrite_start_ms = -1;
+}
+
+void ps_record_phase(ps_request_ctx_t* ctx,
+                     net_instaweb::NgxRequestContext::Phase phase) {
+  if (ctx->phase_timing != NULL) {
+    ctx->phase_timing->RecordPhase(phase);
+  }
+  if (ctx->trace != NULL) {
+    ctx->trace->TracePrintf(
+        "ngx %s", net_instaweb::NgxRequestContext::PhaseName(phase));
+  }
+}
+
+// Comma separated ids of the filters options enables, for the slow request
+// log.
+GoogleString ps_enabled_filter_ids(
+    const net_instaweb::RewriteOptions* options) {
+  GoogleString ids;
+  for (int i = net_instaweb::RewriteOptions::kFirstFilter;
+       i < net_instaweb::RewriteOptions::kEndOfFilters; ++i) {
+    net_instaweb::RewriteOptions::Filter filter =
+        static_cast<net_instaweb::RewriteOptions::Filter>(i);
+    if (options->Enabled(filter)) {
+      StrAppend(&ids, ids.empty() ? "" : ",",
+                net_instaweb::RewriteOptions::FilterId(filter));
+    }
+  }
+  return ids;
+}
+
 // Wrapper around GetQueryOptions()
 net_instaweb::RewriteOptions* ps_determine_request_options(
     ngx_http_request_t* r,
@@ -1241,6 +1446,14 @@ bool ps_determine_options(ngx_http_request_t* r,
   // Start with directory options if we have them, otherwise request options.
   if (directory_options != NULL) {
     *options = directory_options->Clone();
+    // Directory options were cloned from the global options at configuration
+    // time, so they haven't seen any cache flushes since.
+    int64 cache_flush_timestamp_ms =
+        cfg_s->server_context->cache_flush_timestamp_ms();
+    if (cache_flush_timestamp_ms > 0) {
+      (*options)->UpdateCacheInvalidationTimestampMs(
+          cache_flush_timestamp_ms, cfg_s->server_context->lock_hasher());
+    }
   } else {
     *options = global_options->Clone();
   }
@@ -1380,7 +1593,7 @@ bool UrlMightHavePropertyCacheEntry(const net_instaweb::GoogleUrl& url) {
 // TODO(jud): Reuse ProxyInterface::InitiatePropertyCacheLookup.
 net_instaweb::ProxyFetchPropertyCallbackCollector*
 ps_initiate_property_cache_lookup(
-    net_instaweb::ServerContext* server_context,
+    net_instaweb::NgxServerContext* server_context,
     bool is_resource_fetch,
     const net_instaweb::GoogleUrl& request_url,
     net_instaweb::RewriteOptions* options,
@@ -1467,7 +1680,14 @@ ps_initiate_property_cache_lookup(
     }
   }
 
-  // All callbacks need to be registered before Reads to avoid race.
+  // All callbacks need to be registered before Reads to avoid race.  The
+  // reads are batched so every cohort of every page is looked up with a
+  // single MultiGet.
+  net_instaweb::NgxPropertyCacheBatcher* batcher =
+      server_context->property_cache_batcher();
+  if (batcher != NULL) {
+    batcher->StartBatch();
+  }
   if (property_callback != NULL) {
     page_property_cache->Read(property_callback);
   }
@@ -1477,6 +1697,9 @@ ps_initiate_property_cache_lookup(
   if (client_callback != NULL) {
     client_property_cache->Read(client_callback);
   }
+  if (batcher != NULL) {
+    batcher->FlushBatch();
+  }
 
   if (!added_callback) {
     callback_collector.reset(NULL);
@@ -1525,6 +1748,14 @@ CreateRequestContext::Response ps_create_request_context(
   if (url.PathSansQuery() == "/ngx_pagespeed_message") {
     return CreateRequestContext::kMessages;
   }
+  if (url.PathSansQuery() == "/ngx_pagespeed_purge" &&
+      ps_admin_handlers_enabled(r, cfg_s)) {
+    return CreateRequestContext::kPurge;
+  }
+  if (url.PathSansQuery() == "/ngx_pagespeed_trace" &&
+      ps_admin_handlers_enabled(r, cfg_s)) {
+    return CreateRequestContext::kTrace;
+  }
 
   net_instaweb::RewriteOptions* global_options =
       cfg_s->server_context->global_options();
@@ -1555,7 +1786,10 @@ CreateRequestContext::Response ps_create_request_context(
   ctx->r = r;
   ctx->is_resource_fetch = is_resource_fetch;
   ctx->write_pending = false;
-
+  ctx->html_rewrite_start_ms = -1;
+  ctx->phase_timing = NULL;
+  ctx->trace = NULL;
+  int64 start_us = cfg_s->server_context->timer()->NowUs();
 
   // Handles its own deletion.  We need to call Release() when we're done with
   // it, and call Done() on the associated parent (Proxy or Resource) fetch.  If
@@ -1580,6 +1814,17 @@ CreateRequestContext::Response ps_create_request_context(
   // parameters.  Keep url_string in sync with url.
   url.Spec().CopyToString(&url_string);
 
+  // Apply any URL purges as cache invalidation entries.  This costs us the
+  // pooled rewrite drivers, but only while there are purges outstanding.
+  net_instaweb::NgxCachePurger* purger =
+      cfg_s->server_context->ngx_rewrite_driver_factory()->cache_purger();
+  if (purger != NULL && purger->HasPurges()) {
+    if (custom_options == NULL) {
+      custom_options = cfg_s->server_context->global_options()->Clone();
+    }
+    purger->ApplyToOptions(custom_options);
+  }
+
   net_instaweb::RewriteOptions* options;
   if (custom_options == NULL) {
     options = cfg_s->server_context->global_options();
@@ -1595,6 +1840,40 @@ CreateRequestContext::Response ps_create_request_context(
     return CreateRequestContext::kPagespeedDisabled;
   }
 
+  // Only now that we know we would rewrite this HTML do we ask, so that the
+  // bypass counters only count responses we actually passed through.
+  if (!is_resource_fetch) {
+    net_instaweb::NgxHtmlLoadShedder* shedder = ps_html_load_shedder(r);
+    if (shedder != NULL && shedder->ShouldShed()) {
+      // Overloaded: the origin HTML gets to the client sooner without us.
+      delete custom_options;
+      ctx->base_fetch->Done(false);  // Not passed to Proxy/ResourceFetch yet.
+      ps_release_request_context(ctx);
+      return CreateRequestContext::kLoadShed;
+    }
+  }
+
+  const net_instaweb::NgxRewriteOptions* ngx_request_options =
+      net_instaweb::NgxRewriteOptions::DynamicCast(options);
+  if (ngx_request_options != NULL &&
+      ngx_request_options->slow_request_log_threshold_ms() >= 0) {
+    ctx->phase_timing = net_instaweb::NgxRequestContext::DynamicCast(
+        ctx->base_fetch->request_context().get());
+    ctx->phase_timing->StartPhaseTiming(
+        cfg_s->server_context->timer(), start_us / 1000,
+        ngx_request_options->slow_request_log_threshold_ms(), url_string,
+        is_resource_fetch,
+        is_resource_fetch ? GoogleString() : ps_enabled_filter_ids(options));
+  }
+  net_instaweb::NgxTraceLog* trace_log =
+      cfg_s->server_context->ngx_rewrite_driver_factory()->trace_log();
+  if (trace_log != NULL && trace_log->ShouldTrace()) {
+    ctx->trace = net_instaweb::NgxRequestContext::DynamicCast(
+        ctx->base_fetch->request_context().get())->StartTrace(
+            trace_log, start_us, url_string);
+  }
+  ps_record_phase(ctx, net_instaweb::NgxRequestContext::kOptionsDetermined);
+
   if (options->respect_x_forwarded_proto()) {
     bool modified_url = ps_apply_x_forwarded_proto(r, &url_string);
     if (modified_url) {
@@ -1606,6 +1885,8 @@ CreateRequestContext::Response ps_create_request_context(
   }
 
   bool page_callback_added = false;
+  ps_record_phase(
+      ctx, net_instaweb::NgxRequestContext::kPropertyCacheLookupStarted);
   scoped_ptr<net_instaweb::ProxyFetchPropertyCallbackCollector>
       property_callback(ps_initiate_property_cache_lookup(
           cfg_s->server_context,
@@ -1618,6 +1899,7 @@ CreateRequestContext::Response ps_create_request_context(
     net_instaweb::ResourceFetch::Start(
         url, custom_options /* null if there aren't custom options */,
         false /* using_spdy */, cfg_s->server_context, ctx->base_fetch);
+    ps_record_phase(ctx, net_instaweb::NgxRequestContext::kDriverCreated);
   } else {
     // If we don't have custom options we can use NewRewriteDriver which reuses
     // rewrite drivers and so is faster because there's no wait to construct
@@ -1630,21 +1912,50 @@ CreateRequestContext::Response ps_create_request_context(
       driver = cfg_s->server_context->NewRewriteDriver(
           ctx->base_fetch->request_context());
     } else {
+      // The HTML output cache keys on the signature.
+      cfg_s->server_context->ComputeSignature(custom_options);
       // NewCustomRewriteDriver takes ownership of custom_options.
       driver = cfg_s->server_context->NewCustomRewriteDriver(
           custom_options, ctx->base_fetch->request_context());
     }
 
+    ps_record_phase(ctx, net_instaweb::NgxRequestContext::kDriverCreated);
     ctx->modify_headers = driver->options()->modify_caching_headers();
 
+    // RewriteDeadlinePerFlushMs comes with the options, but the total is
+    // kept on the driver.  Set it even when -1, as pooled drivers keep it.
+    const net_instaweb::NgxRewriteOptions* ngx_options =
+        net_instaweb::NgxRewriteOptions::DynamicCast(driver->options());
+    if (ngx_options != NULL) {
+      driver->set_max_page_processing_delay_ms(
+          ngx_options->max_page_processing_delay_ms());
+    }
+
+    net_instaweb::NgxFilterCpuTimer* filter_cpu_timer =
+        cfg_s->server_context->ngx_rewrite_driver_factory()->
+            filter_cpu_timer();
+    if (filter_cpu_timer != NULL) {
+      filter_cpu_timer->StartRequest(driver);
+    }
+
     // TODO(jefftk): FlushEarlyFlow would go here.
 
-    // Will call StartParse etc.  The rewrite driver will take care of deleting
-    // itself if necessary.
-    ctx->proxy_fetch = cfg_s->proxy_fetch_factory->CreateNewProxyFetch(
-        url_string, ctx->base_fetch, driver,
-        property_callback.release(),
-        NULL /* original_content_fetch */);
+    if (r->method == NGX_HTTP_GET && r->headers_out.status == NGX_HTTP_OK &&
+        cfg_s->server_context->ngx_rewrite_driver_factory()->
+            use_html_output_cache()) {
+      // Hold off on the ProxyFetch until we've seen the whole body and
+      // checked whether we've rewritten it before.
+      ctx->html_cache_lookup = new net_instaweb::NgxHtmlOutputCacheLookup(
+          cfg_s->server_context, cfg_s->proxy_fetch_factory, url_string,
+          ctx->base_fetch, driver, property_callback.release());
+    } else {
+      // Will call StartParse etc.  The rewrite driver will take care of
+      // deleting itself if necessary.
+      ctx->proxy_fetch = cfg_s->proxy_fetch_factory->CreateNewProxyFetch(
+          url_string, ctx->base_fetch, driver,
+          property_callback.release(),
+          NULL /* original_content_fetch */);
+    }
   }
 
 
@@ -1662,12 +1973,31 @@ CreateRequestContext::Response ps_create_request_context(
   return CreateRequestContext::kOk;
 }
 
+// Send data to the proxy_fetch, or to the HTML output cache lookup while it
+// is still collecting the body.
+void ps_write_to_pagespeed(ps_request_ctx_t* ctx,
+                           ps_srv_conf_t* cfg_s,
+                           StringPiece data) {
+  if (ctx->html_cache_lookup != NULL) {
+    if (ctx->html_cache_lookup->Write(data)) {
+      return;
+    }
+    // Too big to cache; rewrite as it streams in.
+    ctx->proxy_fetch = ctx->html_cache_lookup->StartProxyFetch();
+    ctx->html_cache_lookup = NULL;
+    return;
+  }
+  CHECK(ctx->proxy_fetch != NULL);
+  ctx->proxy_fetch->Write(data, cfg_s->handler);
+}
+
 // Send each buffer in the chain to the proxy_fetch for optimization.
 // Eventually it will make it's way, optimized, to base_fetch.
 void ps_send_to_pagespeed(ngx_http_request_t* r,
                           ps_request_ctx_t* ctx,
                           ps_srv_conf_t* cfg_s,
                           ngx_chain_t* in) {
+  ps_record_phase(ctx, net_instaweb::NgxRequestContext::kFirstInput);
   ngx_chain_t* cur;
   int last_buf = 0;
   for (cur = in; cur != NULL; cur = cur->next) {
@@ -1677,11 +2007,10 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
     // pagespeed.
     cur->buf->last_buf = 0;
 
-    CHECK(ctx->proxy_fetch != NULL);
     if (ctx->inflater_ == NULL) {
-      ctx->proxy_fetch->Write(
-          StringPiece(reinterpret_cast<char*>(cur->buf->pos),
-                      cur->buf->last - cur->buf->pos), cfg_s->handler);
+      ps_write_to_pagespeed(
+          ctx, cfg_s, StringPiece(reinterpret_cast<char*>(cur->buf->pos),
+                                  cur->buf->last - cur->buf->pos));
     } else {
       char buf[net_instaweb::kStackBufferSize];
       ctx->inflater_->SetInput(reinterpret_cast<char*>(cur->buf->pos),
@@ -1693,8 +2022,8 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
           cfg_s->handler->Message(net_instaweb::kWarning,
                                   "Corrupted inflation");
         } else if (num_inflated_bytes > 0) {
-          ctx->proxy_fetch->Write(StringPiece(buf, num_inflated_bytes),
-                                  cfg_s->handler);
+          ps_write_to_pagespeed(ctx, cfg_s,
+                                StringPiece(buf, num_inflated_bytes));
         }
       }
     }
@@ -1704,6 +2033,14 @@ void ps_send_to_pagespeed(ngx_http_request_t* r,
   }
 
   if (last_buf) {
+    ps_record_phase(ctx, net_instaweb::NgxRequestContext::kLastInput);
+  }
+  if (ctx->html_cache_lookup != NULL) {
+    if (last_buf) {
+      ctx->html_cache_lookup->Finish();
+      ctx->html_cache_lookup = NULL;  // Deletes itself when done.
+    }
+  } else if (last_buf) {
     ctx->proxy_fetch->Done(true /* success */);
     ctx->proxy_fetch = NULL;  // ProxyFetch deletes itself on Done().
   } else {
@@ -1875,8 +2212,6 @@ ngx_int_t ps_header_filter(ngx_http_request_t* r) {
     // Don't handle subrequests.
     return ngx_http_next_header_filter(r);
   }
-  // Poll for cache flush on every request (polls are rate-limited).
-  cfg_s->server_context->FlushCacheIfNecessary();
 
   ps_request_ctx_t* ctx = ps_get_request_context(r);
 
@@ -1916,16 +2251,23 @@ ngx_int_t ps_header_filter(ngx_http_request_t* r) {
     case CreateRequestContext::kStaticContent:
     case CreateRequestContext::kStatistics:
     case CreateRequestContext::kMessages:
+    case CreateRequestContext::kPurge:
+    case CreateRequestContext::kTrace:
     case CreateRequestContext::kPagespeedSubrequest:
     case CreateRequestContext::kPagespeedDisabled:
     case CreateRequestContext::kInvalidUrl:
     case CreateRequestContext::kNotHeadOrGet:
     case CreateRequestContext::kErrorResponse:
+    case CreateRequestContext::kLoadShed:
       return ngx_http_next_header_filter(r);
     case CreateRequestContext::kOk:
       break;
   }
   ctx = ps_get_request_context(r);
+  net_instaweb::NgxHtmlLoadShedder* shedder = ps_html_load_shedder(r);
+  if (shedder != NULL) {
+    ctx->html_rewrite_start_ms = shedder->HtmlRewriteStarted();
+  }
 
   if (r->headers_out.content_encoding &&
       r->headers_out.content_encoding->value.len) {
@@ -2107,6 +2449,41 @@ void write_handler_response(const StringPiece& output, ngx_http_request_t* r,
   write_handler_response(output, r, net_instaweb::kContentTypeHtml, timer);
 }
 
+// Streams statistics in the OpenMetrics text format straight into nginx
+// buffers, for frequent scrapes.
+ngx_int_t write_prometheus_statistics_response(
+    ngx_http_request_t* r, net_instaweb::Statistics* statistics,
+    const StringPiece& vhost, net_instaweb::Timer* timer,
+    net_instaweb::MessageHandler* handler) {
+  net_instaweb::NgxBufferChainWriter writer(r->pool);
+  net_instaweb::NgxPrometheusStatistics::Write(statistics, vhost, &writer,
+                                               handler);
+  ngx_chain_t* out = writer.Finish();
+  if (out == NULL) {
+    // Out of pool memory; nothing has been sent yet.
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  net_instaweb::ResponseHeaders response_headers;
+  response_headers.SetStatusAndReason(net_instaweb::HttpStatus::kOK);
+  response_headers.set_major_version(1);
+  response_headers.set_minor_version(1);
+  response_headers.Add(net_instaweb::HttpAttributes::kContentType,
+                       net_instaweb::NgxPrometheusStatistics::kContentType);
+  response_headers.SetDate(timer->NowMs());
+  response_headers.Add(net_instaweb::HttpAttributes::kCacheControl,
+                       net_instaweb::HttpAttributes::kNoCache);
+  if (copy_response_headers_to_ngx(r, response_headers) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  r->headers_out.content_length_n = writer.size();
+
+  if (ngx_http_send_header(r) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  return ngx_http_output_filter(r, out);
+}
+
 // TODO(oschaaf): port SPDY specific functionality, shmcache stats
 // TODO(oschaaf): refactor this with the apache code to share this code
 ngx_int_t ps_statistics_handler(
@@ -2140,6 +2517,14 @@ ngx_int_t ps_statistics_handler(
       reinterpret_cast<char*>(r->args.data), r->args.len);
   params.Parse(query_string);
 
+  const GoogleString* format = params.Lookup1("format");
+  if (format != NULL && *format == "prometheus") {
+    return write_prometheus_statistics_response(
+        r, statistics,
+        global_stats_request ? "" : server_context->hostname_identifier(),
+        factory->timer(), message_handler);
+  }
+
   // Parse various mode query params.
   bool print_normal_config = params.Has("config");
 
@@ -2189,6 +2574,21 @@ ngx_int_t ps_statistics_handler(
   }
   GoogleString output;
   net_instaweb::StringWriter writer(&output);
+  if (params.Has("cache") && params.Has("json")) {
+    // The per-cache summary, rather than the console's time series.
+    net_instaweb::NgxCacheStatsReport::PrintJson(statistics, &output);
+    write_handler_response(output, r, net_instaweb::kContentTypeJson,
+                           factory->timer());
+    return NGX_OK;
+  }
+  if (params.Has("histograms") && params.Has("json")) {
+    // Current percentiles and buckets, rather than the console's.
+    net_instaweb::NgxSharedMemStatistics::PrintHistogramsJson(statistics,
+                                                              &output);
+    write_handler_response(output, r, net_instaweb::kContentTypeJson,
+                           factory->timer());
+    return NGX_OK;
+  }
   if (json) {
     statistics->console_logger()->DumpJSON(var_titles, hist_titles,
                                            start_time, end_time,
@@ -2201,7 +2601,8 @@ ngx_int_t ps_statistics_handler(
                 "<div style='float:right'>View "
                         "<a href='?config'>Configuration</a>, "
                         "<a href='?'>Statistics</a> "
-                        "(<a href='?memcached'>with memcached Stats</a>). "
+                        "(<a href='?memcached'>with memcached Stats</a>), "
+                        "<a href='?cache'>Caches</a>. "
                 "</div>",
                 message_handler);
 
@@ -2226,6 +2627,13 @@ ngx_int_t ps_statistics_handler(
       statistics->Dump(&writer, message_handler);
       writer.Write("</pre>", message_handler);
       statistics->RenderHistograms(&writer, message_handler);
+      factory->RenderWorkerPoolQueueDepths(&writer, message_handler);
+
+      if (params.Has("cache")) {
+        GoogleString cache_stats;
+        net_instaweb::NgxCacheStatsReport::PrintHtml(statistics, &cache_stats);
+        writer.Write(cache_stats, message_handler);
+      }
 
       if (params.Has("memcached")) {
         GoogleString memcached_stats;
@@ -2274,6 +2682,98 @@ ngx_int_t ps_messages_handler(
   return NGX_OK;
 }
 
+// Handles /ngx_pagespeed_purge?url=<url> and ?prefix=<url>, invalidating
+// cached resources and metadata for that URL or everything under it.  With
+// neither argument, lists the purges in effect.
+ngx_int_t ps_purge_handler(
+    ngx_http_request_t* r,
+    net_instaweb::NgxServerContext* server_context) {
+  net_instaweb::NgxRewriteDriverFactory* factory =
+      server_context->ngx_rewrite_driver_factory();
+  net_instaweb::NgxCachePurger* purger = factory->cache_purger();
+
+  net_instaweb::QueryParams params;
+  params.Parse(StringPiece(reinterpret_cast<char*>(r->args.data),
+                           r->args.len));
+  const GoogleString* url_param = params.Lookup1("url");
+  const GoogleString* prefix_param = params.Lookup1("prefix");
+
+  GoogleString output;
+  if (purger == NULL) {
+    output = "Cache purging is unavailable without shared memory.\n";
+  } else if (url_param == NULL && prefix_param == NULL) {
+    purger->PrintPurges(&output);
+  } else {
+    bool is_prefix = (url_param == NULL);
+    GoogleString purge_url = net_instaweb::UrlToFileNameEncoder::Unescape(
+        is_prefix ? *prefix_param : *url_param);
+    net_instaweb::GoogleUrl gurl(purge_url);
+    GoogleString error;
+    if (!gurl.is_valid()) {
+      error = "not an absolute URL";
+    } else if (purger->Purge(purge_url, is_prefix, &error)) {
+      net_instaweb::StrAppend(&output, "Purged ",
+                              is_prefix ? "prefix " : "", purge_url, "\n");
+    }
+    if (!error.empty()) {
+      net_instaweb::StrAppend(&output, "Purge of ", purge_url, " failed: ",
+                              error, "\n");
+      factory->message_handler()->Message(
+          net_instaweb::kWarning, "%s", output.c_str());
+    }
+  }
+
+  GoogleString html;
+  net_instaweb::StringWriter writer(&html);
+  WritePre(output, &writer, factory->message_handler());
+  write_handler_response(html, r, factory->timer());
+  return NGX_OK;
+}
+
+// Handles /ngx_pagespeed_trace?per_million=<n>, setting how many requests in
+// a million every worker traces until the next reload.  With no argument,
+// shows the rate in effect.
+ngx_int_t ps_trace_handler(
+    ngx_http_request_t* r,
+    net_instaweb::NgxServerContext* server_context) {
+  net_instaweb::NgxRewriteDriverFactory* factory =
+      server_context->ngx_rewrite_driver_factory();
+  net_instaweb::NgxTraceLog* trace_log = factory->trace_log();
+
+  net_instaweb::QueryParams params;
+  params.Parse(StringPiece(reinterpret_cast<char*>(r->args.data),
+                           r->args.len));
+  const GoogleString* rate_param = params.Lookup1("per_million");
+
+  GoogleString output;
+  if (trace_log == NULL) {
+    output = "Request tracing is off; set pagespeed RequestTraceFile.\n";
+  } else {
+    int64 per_million;
+    if (rate_param != NULL) {
+      if (net_instaweb::StringToInt64(*rate_param, &per_million) &&
+          per_million >= 0 &&
+          per_million <= net_instaweb::NgxTraceLog::kMillion) {
+        trace_log->set_samples_per_million(per_million);
+      } else {
+        net_instaweb::StrAppend(&output, "Invalid per_million: ",
+                                *rate_param, "\n");
+      }
+    }
+    net_instaweb::StrAppend(
+        &output, "Tracing ",
+        net_instaweb::Integer64ToString(trace_log->samples_per_million()),
+        " requests per million to ", trace_log->filename(),
+        " and the other workers' files.\n");
+  }
+
+  GoogleString html;
+  net_instaweb::StringWriter writer(&html);
+  WritePre(output, &writer, factory->message_handler());
+  write_handler_response(html, r, factory->timer());
+  return NGX_OK;
+}
+
 ngx_int_t ps_beacon_handler_helper(ngx_http_request_t* r,
                                    StringPiece beacon_data) {
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -2428,9 +2928,6 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
     return NGX_DECLINED;
   }
 
-  // Poll for cache flush on every request (polls are rate-limited).
-  cfg_s->server_context->FlushCacheIfNecessary();
-
   ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                  "http pagespeed handler \"%V\"", &r->uri);
 
@@ -2444,6 +2941,7 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
     case CreateRequestContext::kPagespeedSubrequest:
     case CreateRequestContext::kNotHeadOrGet:
     case CreateRequestContext::kErrorResponse:
+    case CreateRequestContext::kLoadShed:
       return NGX_DECLINED;
     case CreateRequestContext::kBeacon:
       return ps_beacon_handler(r);
@@ -2453,6 +2951,10 @@ ngx_int_t ps_content_handler(ngx_http_request_t* r) {
       return ps_statistics_handler(r, cfg_s->server_context);
     case CreateRequestContext::kMessages:
       return ps_messages_handler(r, cfg_s->server_context);
+    case CreateRequestContext::kPurge:
+      return ps_purge_handler(r, cfg_s->server_context);
+    case CreateRequestContext::kTrace:
+      return ps_trace_handler(r, cfg_s->server_context);
     case CreateRequestContext::kOk:
       break;
   }
@@ -2630,13 +3132,20 @@ ngx_int_t ps_init_module(ngx_cycle_t* cycle) {
     // NullStatistics.
     if (statistics == NULL) {
       statistics = cfg_m->driver_factory->statistics();
-      net_instaweb::NgxRewriteDriverFactory::InitStats(statistics);
+      cfg_m->driver_factory->InitStats(statistics);
     }
 
     ngx_http_core_loc_conf_t* clcf = static_cast<ngx_http_core_loc_conf_t*>(
         ngx_http_conf_get_module_loc_conf((*cscfp), ngx_http_core_module));
 
     cfg_m->driver_factory->set_resolver(clcf->resolver);
+
+    // For dividing ExpensiveRewriteCpus between the workers.
+    ngx_core_conf_t* ccf = reinterpret_cast<ngx_core_conf_t*>(
+        ngx_get_conf(cycle->conf_ctx, ngx_core_module));
+    if (ccf->worker_processes > 0) {
+      cfg_m->driver_factory->set_num_worker_processes(ccf->worker_processes);
+    }
     cfg_m->driver_factory->set_resolver_timeout(clcf->resolver_timeout);
 
     if (!cfg_m->driver_factory->CheckResolver()) {
@@ -2654,6 +3163,66 @@ ngx_int_t ps_init_module(ngx_cycle_t* cycle) {
   return NGX_OK;
 }
 
+// Polls for cache.flush from a per-worker timer rather than from the request
+// path, so requests never wait on the stat().  FlushCacheIfNecessary() does
+// its own rate limiting per server, so we run at the shortest poll interval.
+ngx_event_t ps_cache_flush_event;
+ngx_msec_t ps_cache_flush_interval_ms = 0;
+
+void ps_cache_flush_handler(ngx_event_t* ev) {
+  if (ngx_exiting) {
+    return;
+  }
+  ngx_cycle_t* cycle = static_cast<ngx_cycle_t*>(ev->data);
+  ngx_http_core_main_conf_t* cmcf = static_cast<ngx_http_core_main_conf_t*>(
+      ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module));
+  ngx_http_core_srv_conf_t** cscfp = static_cast<ngx_http_core_srv_conf_t**>(
+      cmcf->servers.elts);
+  for (ngx_uint_t s = 0; s < cmcf->servers.nelts; s++) {
+    ps_srv_conf_t* cfg_s = static_cast<ps_srv_conf_t*>(
+        cscfp[s]->ctx->srv_conf[ngx_pagespeed.ctx_index]);
+    if (cfg_s->server_context != NULL) {
+      cfg_s->server_context->FlushCacheIfNecessary();
+    }
+  }
+  ngx_add_timer(ev, ps_cache_flush_interval_ms);
+}
+
+void ps_cache_flush_event_init(ngx_cycle_t* cycle) {
+  ngx_http_core_main_conf_t* cmcf = static_cast<ngx_http_core_main_conf_t*>(
+      ngx_http_cycle_get_module_main_conf(cycle, ngx_http_core_module));
+  ngx_http_core_srv_conf_t** cscfp = static_cast<ngx_http_core_srv_conf_t**>(
+      cmcf->servers.elts);
+  int64 interval_sec = 0;
+  for (ngx_uint_t s = 0; s < cmcf->servers.nelts; s++) {
+    ps_srv_conf_t* cfg_s = static_cast<ps_srv_conf_t*>(
+        cscfp[s]->ctx->srv_conf[ngx_pagespeed.ctx_index]);
+    if (cfg_s->server_context != NULL) {
+      int64 poll_sec =
+          cfg_s->server_context->config()->cache_flush_poll_interval_sec();
+      if (poll_sec > 0 && (interval_sec == 0 || poll_sec < interval_sec)) {
+        interval_sec = poll_sec;
+      }
+    }
+  }
+  if (interval_sec == 0) {
+    return;  // Polling is off everywhere.
+  }
+
+  ps_cache_flush_interval_ms = interval_sec * 1000;
+  ngx_memzero(&ps_cache_flush_event, sizeof(ps_cache_flush_event));
+  ps_cache_flush_event.handler = ps_cache_flush_handler;
+  ps_cache_flush_event.data = cycle;
+  ps_cache_flush_event.log = cycle->log;
+#if (nginx_version >= 1007005)
+  // Don't hold up a graceful shutdown waiting for the next poll.
+  ps_cache_flush_event.cancelable = 1;
+#endif
+  // Poll once now, so that a flush from before this worker started applies
+  // to its first requests.
+  ps_cache_flush_handler(&ps_cache_flush_event);
+}
+
 // Called when nginx forks worker processes.  No threads should be started
 // before this.
 ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
@@ -2693,6 +3262,10 @@ ngx_int_t ps_init_child_process(ngx_cycle_t* cycle) {
   if (!cfg_m->driver_factory->InitNgxUrlAsyncFecther()) {
     return NGX_ERROR;
   }
+  if (!cfg_m->driver_factory->InitNgxMemCaches()) {
+    return NGX_ERROR;
+  }
+  ps_cache_flush_event_init(cycle);
   cfg_m->driver_factory->StartThreads();
 
   return NGX_OK;
@@ -42,6 +42,9 @@ namespace net_instaweb {
 
 class GzipInflater;
 class NgxBaseFetch;
+class NgxHtmlOutputCacheLookup;
+class NgxRequestContext;
+class NgxRequestTrace;
 class ProxyFetch;
 class RewriteDriver;
 
@@ -56,6 +59,14 @@ ngx_int_t string_piece_to_buffer_chain(
     ngx_pool_t* pool, StringPiece sp,
     ngx_chain_t** link_ptr, bool send_last_buf);
 
+// Like string_piece_to_buffer_chain, but instead of copying takes over the
+// storage of *str, leaving it empty, and returns a single buffer pointing at
+// it.  The storage is freed when the pool is destroyed.  Use for large bodies
+// where the extra copy into 8k pool buffers would be expensive.
+ngx_int_t string_to_buffer_chain(
+    ngx_pool_t* pool, GoogleString* str,
+    ngx_chain_t** link_ptr, bool send_last_buf);
+
 StringPiece str_to_string_piece(ngx_str_t s);
 
 // s1: ngx_str_t, s2: string literal
@@ -82,12 +93,23 @@ ngx_int_t copy_response_headers_to_ngx(
 
 typedef struct {
   net_instaweb::ProxyFetch* proxy_fetch;
+  // Set instead of proxy_fetch while we collect the body for a lookup in the
+  // HTML output cache.
+  net_instaweb::NgxHtmlOutputCacheLookup* html_cache_lookup;
   net_instaweb::NgxBaseFetch* base_fetch;
   ngx_http_request_t* r;
   bool is_resource_fetch;
   bool write_pending;
   bool modify_headers;
   net_instaweb::GzipInflater* inflater_;
+  // When the HTML rewrite started, for NgxHtmlLoadShedder, or -1 if it is
+  // not being tracked.
+  int64 html_rewrite_start_ms;
+  // The base fetch's request context when SlowRequestLogThresholdMs is on,
+  // for recording phases, otherwise NULL.
+  net_instaweb::NgxRequestContext* phase_timing;
+  // The request's root trace if it is being traced, otherwise NULL.
+  net_instaweb::NgxRequestTrace* trace;
 } ps_request_ctx_t;
 
 // called by net_instaweb::NgxBaseFetch to notify event
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_prometheus_statistics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "net/instaweb/util/public/statistics.h"
+
+namespace net_instaweb {
+
+const char NgxPrometheusStatistics::kContentType[] =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+namespace {
+
+GoogleString FormatValue(double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  return buf;
+}
+
+}  // namespace
+
+NgxBufferChainWriter::NgxBufferChainWriter(ngx_pool_t* pool)
+    : pool_(pool),
+      head_(NULL),
+      tail_(NULL),
+      size_(0),
+      failed_(false) {
+}
+
+NgxBufferChainWriter::~NgxBufferChainWriter() {
+}
+
+bool NgxBufferChainWriter::AddBuffer() {
+  ngx_buf_t* b = ngx_create_temp_buf(pool_, kBufferSize);
+  ngx_chain_t* cl = ngx_alloc_chain_link(pool_);
+  if (b == NULL || cl == NULL) {
+    failed_ = true;
+    return false;
+  }
+  cl->buf = b;
+  cl->next = NULL;
+  if (tail_ == NULL) {
+    head_ = cl;
+  } else {
+    tail_->next = cl;
+  }
+  tail_ = cl;
+  return true;
+}
+
+bool NgxBufferChainWriter::Write(const StringPiece& str,
+                                 MessageHandler* handler) {
+  const char* data = str.data();
+  size_t remaining = str.size();
+  while (remaining > 0 && !failed_) {
+    if (tail_ == NULL || tail_->buf->last == tail_->buf->end) {
+      if (!AddBuffer()) {
+        break;
+      }
+    }
+    ngx_buf_t* b = tail_->buf;
+    size_t n = std::min(remaining, static_cast<size_t>(b->end - b->last));
+    b->last = ngx_cpymem(b->last, data, n);
+    data += n;
+    remaining -= n;
+    size_ += n;
+  }
+  return !failed_;
+}
+
+ngx_chain_t* NgxBufferChainWriter::Finish() {
+  if (tail_ == NULL) {
+    AddBuffer();
+  }
+  if (failed_) {
+    return NULL;
+  }
+  tail_->buf->last_buf = 1;
+  return head_;
+}
+
+// Statistics has no way to list its variables other than Dump(), so we parse
+// its "name: value" lines as they are written, a line at a time.
+class NgxPrometheusStatistics::VariableWriter : public Writer {
+ public:
+  VariableWriter(const StringPiece& vhost, Writer* out)
+      : labels_(Labels(vhost, "")),
+        out_(out) {
+  }
+
+  virtual bool Write(const StringPiece& str, MessageHandler* handler) {
+    StringPiece rest(str);
+    while (!rest.empty()) {
+      size_t newline = rest.find('\n');
+      if (newline == StringPiece::npos) {
+        rest.AppendToString(&line_);
+        break;
+      }
+      rest.substr(0, newline).AppendToString(&line_);
+      WriteLine(handler);
+      line_.clear();
+      rest = rest.substr(newline + 1);
+    }
+    return true;
+  }
+
+  virtual bool Flush(MessageHandler* handler) { return true; }
+
+ private:
+  void WriteLine(MessageHandler* handler) {
+    size_t colon = line_.find(':');
+    if (colon == GoogleString::npos) {
+      return;
+    }
+    StringPiece name(line_.data(), colon);
+    StringPiece value(line_.data() + colon + 1, line_.size() - colon - 1);
+    TrimWhitespace(&value);
+    GoogleString metric = MetricName(name);
+    out_->Write(StrCat("# TYPE ", metric, " unknown\n"), handler);
+    out_->Write(StrCat(metric, labels_, " ", value, "\n"), handler);
+  }
+
+  const GoogleString labels_;
+  Writer* out_;
+  GoogleString line_;
+
+  DISALLOW_COPY_AND_ASSIGN(VariableWriter);
+};
+
+GoogleString NgxPrometheusStatistics::MetricName(const StringPiece& name) {
+  GoogleString metric = StrCat("pagespeed_", name);
+  for (size_t i = 0; i < metric.size(); ++i) {
+    char c = metric[i];
+    if (c >= 'A' && c <= 'Z') {
+      metric[i] = c - 'A' + 'a';
+    } else if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+                 c == '_' || c == ':')) {
+      metric[i] = '_';
+    }
+  }
+  return metric;
+}
+
+GoogleString NgxPrometheusStatistics::Labels(const StringPiece& vhost,
+                                             const StringPiece& extra) {
+  GoogleString labels;
+  if (!vhost.empty()) {
+    labels = "vhost=\"";
+    for (size_t i = 0; i < vhost.size(); ++i) {
+      char c = vhost[i];
+      if (c == '\\' || c == '"') {
+        labels.push_back('\\');
+        labels.push_back(c);
+      } else if (c == '\n') {
+        labels.append("\\n");
+      } else {
+        labels.push_back(c);
+      }
+    }
+    labels.push_back('"');
+  }
+  if (!extra.empty()) {
+    if (!labels.empty()) {
+      labels.push_back(',');
+    }
+    extra.AppendToString(&labels);
+  }
+  return labels.empty() ? labels : StrCat("{", labels, "}");
+}
+
+void NgxPrometheusStatistics::Write(Statistics* statistics,
+                                    const StringPiece& vhost,
+                                    Writer* writer, MessageHandler* handler) {
+  VariableWriter variable_writer(vhost, writer);
+  statistics->Dump(&variable_writer, handler);
+
+  static const double kQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static const char* const kQuantileLabels[] = {
+    "quantile=\"0.5\"", "quantile=\"0.9\"", "quantile=\"0.99\"",
+    "quantile=\"0.999\""
+  };
+  const GoogleString labels = Labels(vhost, "");
+  const StringVector& names = statistics->HistogramNames();
+  for (int i = 0, n = names.size(); i < n; ++i) {
+    Histogram* histogram = statistics->FindHistogram(names[i]);
+    GoogleString metric = MetricName(names[i]);
+    double count = histogram->Count();
+    writer->Write(StrCat("# TYPE ", metric, " summary\n"), handler);
+    for (int j = 0, m = arraysize(kQuantiles); j < m; ++j) {
+      double value = histogram->Percentile(100 * kQuantiles[j]);
+      writer->Write(StrCat(metric, Labels(vhost, kQuantileLabels[j]), " ",
+                           FormatValue(value), "\n"), handler);
+    }
+    writer->Write(StrCat(metric, "_count", labels, " ",
+                         FormatValue(count), "\n"), handler);
+    writer->Write(StrCat(metric, "_sum", labels, " ",
+                         FormatValue(histogram->Average() * count), "\n"),
+                  handler);
+  }
+  writer->Write("# EOF\n", handler);
+}
+
+}  // namespace net_instaweb
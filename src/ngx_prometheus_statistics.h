@@ -0,0 +1,96 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Statistics in the OpenMetrics text format, for
+// /ngx_pagespeed_statistics?format=prometheus.
+//
+// Monitoring scrapes the statistics page every few seconds, so this avoids
+// what the HTML page does: the output goes straight into nginx buffers
+// rather than through a GoogleString, and there is no HTML to render.
+// Variables are exported as "unknown" metrics, since Statistics doesn't say
+// which are counters, and histograms as summaries with their p50, p90, p99
+// and p999.
+
+#ifndef NGX_PROMETHEUS_STATISTICS_H_
+#define NGX_PROMETHEUS_STATISTICS_H_
+
+extern "C" {
+#include <ngx_http.h>
+}
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+#include "net/instaweb/util/public/writer.h"
+
+namespace net_instaweb {
+
+class MessageHandler;
+class Statistics;
+
+// Writes into a chain of nginx buffers allocated from a pool.
+class NgxBufferChainWriter : public Writer {
+ public:
+  explicit NgxBufferChainWriter(ngx_pool_t* pool);
+  virtual ~NgxBufferChainWriter();
+
+  virtual bool Write(const StringPiece& str, MessageHandler* handler);
+  virtual bool Flush(MessageHandler* handler) { return true; }
+
+  // Marks the last buffer as such and returns the chain, which always has at
+  // least one link.  NULL if an allocation failed.
+  ngx_chain_t* Finish();
+
+  off_t size() const { return size_; }
+
+ private:
+  static const size_t kBufferSize = 8192;
+
+  bool AddBuffer();
+
+  ngx_pool_t* pool_;
+  ngx_chain_t* head_;
+  ngx_chain_t* tail_;
+  off_t size_;
+  bool failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxBufferChainWriter);
+};
+
+class NgxPrometheusStatistics {
+ public:
+  static const char kContentType[];
+
+  // Writes all variables and histograms, ending with "# EOF".  If vhost is
+  // not empty every sample gets it as a vhost label.
+  static void Write(Statistics* statistics, const StringPiece& vhost,
+                    Writer* writer, MessageHandler* handler);
+
+ private:
+  class VariableWriter;
+
+  // "pagespeed_" plus name, lowercased, with anything that isn't allowed in
+  // a metric name replaced by '_'.
+  static GoogleString MetricName(const StringPiece& name);
+  static GoogleString Labels(const StringPiece& vhost,
+                             const StringPiece& extra);
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(NgxPrometheusStatistics);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_PROMETHEUS_STATISTICS_H_
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_property_cache_batcher.h"
+
+#include "base/logging.h"
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/delegating_cache_callback.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kPropertyCacheLookupUsHistogram[] =
+    "Property Cache Lookup Time us Histogram";
+
+}  // namespace
+
+struct NgxPropertyCacheBatcher::Batch {
+  Batch(int64 start, int n) : start_us(start), remaining(n) {}
+  int64 start_us;
+  int remaining;  // protected by NgxPropertyCacheBatcher::mutex_
+};
+
+class NgxPropertyCacheBatcher::BatchCallback : public DelegatingCacheCallback {
+ public:
+  BatchCallback(NgxPropertyCacheBatcher* batcher, Batch* batch,
+                CacheInterface::Callback* callback)
+      : DelegatingCacheCallback(callback),
+        batcher_(batcher),
+        batch_(batch) {}
+  virtual ~BatchCallback() {}
+
+  virtual void Done(CacheInterface::KeyState state) {
+    batcher_->LookupDone(batch_);
+    DelegatingCacheCallback::Done(state);  // deletes this
+  }
+
+ private:
+  NgxPropertyCacheBatcher* batcher_;
+  Batch* batch_;
+
+  DISALLOW_COPY_AND_ASSIGN(BatchCallback);
+};
+
+NgxPropertyCacheBatcher::NgxPropertyCacheBatcher(CacheInterface* backend,
+                                                 Timer* timer,
+                                                 ThreadSystem* thread_system,
+                                                 Statistics* statistics)
+    : backend_(backend),
+      timer_(timer),
+      lookup_latency_us_(
+          statistics->GetHistogram(kPropertyCacheLookupUsHistogram)),
+      mutex_(thread_system->NewMutex()),
+      batch_(NULL) {
+}
+
+NgxPropertyCacheBatcher::~NgxPropertyCacheBatcher() {
+  DCHECK(batch_ == NULL);
+}
+
+void NgxPropertyCacheBatcher::InitStats(Statistics* statistics) {
+  Histogram* histogram =
+      statistics->AddHistogram(kPropertyCacheLookupUsHistogram);
+  // Anything over a second is a cache that's broken, not slow.
+  histogram->SetMaxValue(Timer::kSecondUs);
+}
+
+void NgxPropertyCacheBatcher::StartBatch() {
+  ScopedMutex lock(mutex_.get());
+  DCHECK(batch_ == NULL);
+  batch_ = new MultiGetRequest;
+}
+
+void NgxPropertyCacheBatcher::FlushBatch() {
+  MultiGetRequest* request;
+  {
+    ScopedMutex lock(mutex_.get());
+    request = batch_;
+    batch_ = NULL;
+  }
+  DCHECK(request != NULL);
+  if (request == NULL) {
+    return;
+  }
+  if (request->empty()) {
+    delete request;
+    return;
+  }
+
+  // The callbacks may run on other threads, or synchronously inside
+  // MultiGet, so they have to be wrapped before anything is sent.
+  Batch* batch = new Batch(timer_->NowUs(), request->size());
+  for (int i = 0, n = request->size(); i < n; ++i) {
+    KeyCallback* key_callback = &(*request)[i];
+    key_callback->callback =
+        new BatchCallback(this, batch, key_callback->callback);
+  }
+  backend_->MultiGet(request);
+}
+
+void NgxPropertyCacheBatcher::LookupDone(Batch* batch) {
+  bool last;
+  {
+    ScopedMutex lock(mutex_.get());
+    last = (--batch->remaining == 0);
+  }
+  if (last) {
+    lookup_latency_us_->Add(timer_->NowUs() - batch->start_us);
+    delete batch;
+  }
+}
+
+void NgxPropertyCacheBatcher::Get(const GoogleString& key,
+                                  Callback* callback) {
+  {
+    ScopedMutex lock(mutex_.get());
+    if (batch_ != NULL) {
+      batch_->push_back(KeyCallback(key, callback));
+      return;
+    }
+  }
+  backend_->Get(key, callback);
+}
+
+void NgxPropertyCacheBatcher::MultiGet(MultiGetRequest* request) {
+  backend_->MultiGet(request);
+}
+
+void NgxPropertyCacheBatcher::Put(const GoogleString& key,
+                                  SharedString* value) {
+  backend_->Put(key, value);
+}
+
+void NgxPropertyCacheBatcher::Delete(const GoogleString& key) {
+  backend_->Delete(key);
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Sits between the property caches and their backend so that all the cohort
+// lookups for a request reach the backend as a single MultiGet.
+//
+// PropertyCache::Read issues one Get per cohort, and we Read up to three
+// pages per request (page, fallback page, client).  Between StartBatch() and
+// FlushBatch() Gets are collected rather than forwarded; FlushBatch() sends
+// them to the backend in one MultiGet and records how long it took for the
+// last of them to complete.  Outside a batch everything is passed through.
+
+#ifndef NGX_PROPERTY_CACHE_BATCHER_H_
+#define NGX_PROPERTY_CACHE_BATCHER_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/cache_interface.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class Histogram;
+class SharedString;
+class Statistics;
+class ThreadSystem;
+class Timer;
+
+class NgxPropertyCacheBatcher : public CacheInterface {
+ public:
+  // Does not take ownership of backend, timer or statistics.
+  NgxPropertyCacheBatcher(CacheInterface* backend, Timer* timer,
+                          ThreadSystem* thread_system,
+                          Statistics* statistics);
+  virtual ~NgxPropertyCacheBatcher();
+
+  static void InitStats(Statistics* statistics);
+
+  // Called on the nginx thread around the PropertyCache::Read calls for one
+  // request.  Batches don't nest.
+  void StartBatch();
+  void FlushBatch();
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void MultiGet(MultiGetRequest* request);
+  virtual void Put(const GoogleString& key, SharedString* value);
+  virtual void Delete(const GoogleString& key);
+  virtual CacheInterface* Backend() { return backend_; }
+  virtual const char* Name() const { return "NgxPropertyCacheBatcher"; }
+  virtual bool IsBlocking() const { return backend_->IsBlocking(); }
+  virtual bool IsHealthy() const { return backend_->IsHealthy(); }
+  virtual void ShutDown() { backend_->ShutDown(); }
+  virtual bool MustEncodeKeyInValueOnPut() const {
+    return backend_->MustEncodeKeyInValueOnPut();
+  }
+  virtual void PutWithKeyInValue(const GoogleString& key,
+                                 SharedString* key_and_value) {
+    backend_->PutWithKeyInValue(key, key_and_value);
+  }
+
+ private:
+  class BatchCallback;
+  struct Batch;
+
+  // Called by BatchCallback when one lookup in batch completes.
+  void LookupDone(Batch* batch);
+
+  CacheInterface* backend_;
+  Timer* timer_;
+  Histogram* lookup_latency_us_;
+
+  // Protects batch_ and the remaining counts of batches in flight.
+  scoped_ptr<AbstractMutex> mutex_;
+  // Non-NULL between StartBatch() and FlushBatch().
+  MultiGetRequest* batch_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxPropertyCacheBatcher);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_PROPERTY_CACHE_BATCHER_H_
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ngx_queue_wait_sampler.h"
+
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/function.h"
+#include "net/instaweb/util/public/scheduler.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+// By pool, in the order of RewriteDriverFactory::WorkerPoolCategory.
+const char* const kQueueWaitHistograms[] = {
+  "ngx_html_queue_wait_us",
+  "ngx_rewrite_queue_wait_us",
+  "ngx_low_priority_queue_wait_us",
+};
+
+COMPILE_ASSERT(arraysize(kQueueWaitHistograms) ==
+               RewriteDriverFactory::kNumWorkerPools,
+               one_histogram_per_pool);
+
+}  // namespace
+
+NgxQueueWaitSampler::NgxQueueWaitSampler(
+    RewriteDriverFactory* factory, ThreadSystem* thread_system,
+    Scheduler* scheduler, Statistics* statistics, int64 interval_ms)
+    : factory_(factory),
+      scheduler_(scheduler),
+      timer_(scheduler->timer()),
+      interval_us_(interval_ms * Timer::kMsUs),
+      mutex_(thread_system->NewMutex()),
+      stopped_(true) {
+  for (int i = 0; i < RewriteDriverFactory::kNumWorkerPools; ++i) {
+    sequences_[i] = NULL;
+    queued_us_[i] = -1;
+    waits_[i] = statistics->GetHistogram(kQueueWaitHistograms[i]);
+  }
+}
+
+NgxQueueWaitSampler::~NgxQueueWaitSampler() {
+  // The pools own the sequences.
+}
+
+void NgxQueueWaitSampler::InitStats(Statistics* statistics) {
+  for (int i = 0, n = arraysize(kQueueWaitHistograms); i < n; ++i) {
+    statistics->AddHistogram(kQueueWaitHistograms[i]);
+  }
+}
+
+void NgxQueueWaitSampler::Start() {
+  for (int i = 0; i < RewriteDriverFactory::kNumWorkerPools; ++i) {
+    sequences_[i] = factory_->WorkerPool(
+        static_cast<RewriteDriverFactory::WorkerPoolCategory>(i))->
+        NewSequence();
+  }
+  {
+    ScopedMutex lock(mutex_.get());
+    stopped_ = false;
+  }
+  Sample();
+}
+
+void NgxQueueWaitSampler::Stop() {
+  ScopedMutex lock(mutex_.get());
+  stopped_ = true;
+}
+
+void NgxQueueWaitSampler::Sample() {
+  ScopedMutex lock(mutex_.get());
+  if (stopped_) {
+    return;
+  }
+  int64 now_us = timer_->NowUs();
+  for (int i = 0; i < RewriteDriverFactory::kNumWorkerPools; ++i) {
+    if (sequences_[i] == NULL) {
+      continue;
+    }
+    if (queued_us_[i] < 0) {
+      queued_us_[i] = now_us;
+      sequences_[i]->Add(
+          MakeFunction(this, &NgxQueueWaitSampler::SampleRan, i));
+    }
+  }
+  // We never cancel this; see Stop().
+  scheduler_->AddAlarm(now_us + interval_us_,
+                       MakeFunction(this, &NgxQueueWaitSampler::Sample));
+}
+
+void NgxQueueWaitSampler::SampleRan(int pool) {
+  ScopedMutex lock(mutex_.get());
+  waits_[pool]->Add(timer_->NowUs() - queued_us_[pool]);
+  queued_us_[pool] = -1;
+}
+
+}  // namespace net_instaweb
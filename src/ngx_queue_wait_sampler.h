@@ -0,0 +1,86 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Measures how long work waits in each rewrite worker pool.
+//
+// HTML parsing goes to the HTML pool, and resource fetches and the
+// RewriteContext bookkeeping to the rewrite pool; every
+// RewriteContext::Rewrite() call, image recompression included, runs in the
+// low-priority pool.  An HTML response may be waiting on any of them.
+//
+// Every interval_ms the scheduler thread queues a no-op on a sequence of
+// each pool, unless the previous one has yet to run, and records in the
+// pool's histogram how long it waited.  That is the wait any new work would
+// have seen.
+
+#ifndef NGX_QUEUE_WAIT_SAMPLER_H_
+#define NGX_QUEUE_WAIT_SAMPLER_H_
+
+#include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class Histogram;
+class Scheduler;
+class Statistics;
+class ThreadSystem;
+class Timer;
+
+class NgxQueueWaitSampler {
+ public:
+  NgxQueueWaitSampler(RewriteDriverFactory* factory,
+                      ThreadSystem* thread_system, Scheduler* scheduler,
+                      Statistics* statistics, int64 interval_ms);
+  ~NgxQueueWaitSampler();
+
+  static void InitStats(Statistics* statistics);
+
+  // Call once the scheduler thread is running.
+  void Start();
+  // Call before the worker pools shut down.  Samples already queued may
+  // still run, and an alarm may still fire, so the factory should only
+  // delete us after its threads are gone.
+  void Stop();
+
+ private:
+  void Sample();
+  void SampleRan(int pool);
+
+  RewriteDriverFactory* factory_;
+  Scheduler* scheduler_;
+  Timer* timer_;
+  const int64 interval_us_;
+
+  scoped_ptr<AbstractMutex> mutex_;
+  bool stopped_;
+  QueuedWorkerPool::Sequence*
+      sequences_[RewriteDriverFactory::kNumWorkerPools];
+  // When the outstanding sample was queued, or -1 if there is none.
+  int64 queued_us_[RewriteDriverFactory::kNumWorkerPools];
+
+  Histogram* waits_[RewriteDriverFactory::kNumWorkerPools];
+
+  DISALLOW_COPY_AND_ASSIGN(NgxQueueWaitSampler);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_QUEUE_WAIT_SAMPLER_H_
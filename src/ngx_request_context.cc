@@ -21,16 +21,29 @@ extern "C" {
 }
 
 #include "ngx_pagespeed.h"
+#include "ngx_request_trace.h"
 
 #include "base/logging.h"
 #include "net/instaweb/http/public/meta_data.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/timer.h"
 
 namespace net_instaweb {
 
 NgxRequestContext::NgxRequestContext(AbstractMutex* logging_mutex,
                                      ngx_http_request_t* r)
     : RequestContext(logging_mutex),
-      local_port_(-1) {
+      local_port_(-1),
+      timer_(NULL),
+      start_ms_(0),
+      threshold_ms_(-1),
+      is_resource_fetch_(false),
+      html_output_cache_outcome_(kHtmlOutputCacheNotUsed),
+      trace_(NULL) {
+  for (int i = 0; i < kNumPhases; ++i) {
+    phase_ms_[i] = -1;
+  }
+
   // Note that at the time we create a RequestContext we have full
   // access to the nginx internal request structure.  However,
   // due to Cloning and (I believe) Detaching, we can initiate fetches after
@@ -78,4 +91,114 @@ NgxRequestContext* NgxRequestContext::DynamicCast(RequestContext* rc) {
   return out;
 }
 
+namespace {
+
+// Indexed by NgxRequestContext::Phase.
+const char* const kPhaseNames[] = {
+  "options",
+  "pcache_lookup",
+  "driver",
+  "first_input",
+  "last_input",
+  "first_output",
+  "done",
+};
+
+// Indexed by NgxRequestContext::HtmlOutputCacheOutcome.
+const char* const kHtmlOutputCacheOutcomeNames[] = {
+  NULL,
+  "hit",
+  "miss",
+  "too_large",
+};
+
+}  // namespace
+
+void NgxRequestContext::StartPhaseTiming(Timer* timer, int64 start_ms,
+                                         int64 threshold_ms,
+                                         const StringPiece& url,
+                                         bool is_resource_fetch,
+                                         const StringPiece& filters) {
+  timer_ = timer;
+  start_ms_ = start_ms;
+  threshold_ms_ = threshold_ms;
+  url.CopyToString(&url_);
+  is_resource_fetch_ = is_resource_fetch;
+  filters.CopyToString(&filters_);
+}
+
+const char* NgxRequestContext::PhaseName(Phase phase) {
+  return kPhaseNames[phase];
+}
+
+void NgxRequestContext::RecordPhase(Phase phase) {
+  if (timer_ != NULL && phase_ms_[phase] < 0) {
+    phase_ms_[phase] = timer_->NowMs();
+  }
+}
+
+void NgxRequestContext::LogIfSlow(MessageHandler* handler) {
+  COMPILE_ASSERT(arraysize(kPhaseNames) == kNumPhases, one_name_per_phase);
+  COMPILE_ASSERT(arraysize(kHtmlOutputCacheOutcomeNames) ==
+                 kHtmlOutputCacheTooLarge + 1, one_name_per_outcome);
+  if (timer_ == NULL) {
+    return;
+  }
+  // A request abandoned part way is logged too, up to where it got.
+  RecordPhase(kDone);
+  int64 total_ms = phase_ms_[kDone] - start_ms_;
+  if (total_ms < threshold_ms_) {
+    return;
+  }
+
+  GoogleString phases;
+  for (int i = 0; i < kNumPhases; ++i) {
+    if (phase_ms_[i] >= 0) {
+      StrAppend(&phases, " ", kPhaseNames[i], "=+",
+                Integer64ToString(phase_ms_[i] - start_ms_), "ms");
+    }
+  }
+
+  GoogleString details;
+  if (!filters_.empty()) {
+    StrAppend(&details, "; filters=", filters_);
+  }
+  const char* outcome = kHtmlOutputCacheOutcomeNames[
+      base::subtle::Acquire_Load(&html_output_cache_outcome_)];
+  if (outcome != NULL) {
+    StrAppend(&details, "; html_output_cache=", outcome);
+  }
+
+  handler->Message(
+      kWarning, "Slow pagespeed %s request, %s ms: %s;%s%s",
+      is_resource_fetch_ ? "resource" : "HTML",
+      Integer64ToString(total_ms).c_str(), url_.c_str(), phases.c_str(),
+      details.c_str());
+}
+
+NgxRequestTrace* NgxRequestContext::StartTrace(NgxTraceLog* log,
+                                               int64 start_us,
+                                               const StringPiece& url) {
+  DCHECK(trace_ == NULL);
+  trace_ = new NgxRequestTrace(log, log->NextTraceId(), start_us, url);
+  set_root_trace_context(trace_);
+  return trace_;
+}
+
+RequestTrace* NgxRequestContext::CreateDependentTraceContext(
+    const StringPiece& label) {
+  if (trace_ == NULL) {
+    return NULL;
+  }
+  return trace_->NewDependent(label);
+}
+
+void NgxRequestContext::ReleaseDependentTraceContext(RequestTrace* t) {
+  if (trace_ == NULL || t == NULL) {
+    RequestContext::ReleaseDependentTraceContext(t);
+    return;
+  }
+  trace_->ReleaseDependent(static_cast<NgxRequestTrace*>(t));
+}
+
 }  // namespace net_instaweb
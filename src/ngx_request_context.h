@@ -25,6 +25,7 @@
 
 #include "ngx_pagespeed.h"
 
+#include "base/atomicops.h"
 #include "net/instaweb/http/public/request_context.h"
 #include "net/instaweb/util/public/basictypes.h"
 #include "net/instaweb/util/public/string.h"
@@ -34,9 +35,34 @@
 namespace net_instaweb {
 
 class AbstractMutex;
+class MessageHandler;
+class NgxRequestTrace;
+class NgxTraceLog;
+class Timer;
 
 class NgxRequestContext : public RequestContext {
  public:
+  // Where pagespeed is in handling the request, for the slow request log.
+  // Each is recorded the first time it is reached.
+  enum Phase {
+    kOptionsDetermined,
+    kPropertyCacheLookupStarted,
+    kDriverCreated,  // Or the ResourceFetch started.
+    kFirstInput,     // The first origin bytes went to the ProxyFetch.
+    kLastInput,
+    kFirstOutput,    // We sent the first of pagespeed's response.
+    kDone,
+    kNumPhases
+  };
+
+  // What NgxHtmlOutputCacheLookup did with an HTML response.
+  enum HtmlOutputCacheOutcome {
+    kHtmlOutputCacheNotUsed,
+    kHtmlOutputCacheHit,
+    kHtmlOutputCacheMiss,
+    kHtmlOutputCacheTooLarge
+  };
+
   NgxRequestContext(AbstractMutex* logging_mutex,
                     ngx_http_request_t* ps_request_context);
 
@@ -47,6 +73,35 @@ class NgxRequestContext : public RequestContext {
   int local_port() const { return local_port_; }
   const GoogleString& local_ip() const { return local_ip_; }
 
+  // Starts recording phases, from when pagespeed first saw the request,
+  // start_ms.  Requests taking threshold_ms or more will be logged by
+  // LogIfSlow(), along with filters, the ids of the filters that were
+  // enabled.  Phases are only recorded, and LogIfSlow() only called, from the
+  // nginx thread.
+  void StartPhaseTiming(Timer* timer, int64 start_ms, int64 threshold_ms,
+                        const StringPiece& url, bool is_resource_fetch,
+                        const StringPiece& filters);
+  void RecordPhase(Phase phase);
+  static const char* PhaseName(Phase phase);
+  // If phase timing is on and the request took at least the threshold,
+  // writes the phases, the filters and the HTML output cache outcome as one
+  // warning to handler.
+  void LogIfSlow(MessageHandler* handler);
+
+  // Makes an NgxRequestTrace the root trace context, so that PSOL traces
+  // this request to log, and returns it.  start_us is when pagespeed first
+  // saw the request.
+  NgxRequestTrace* StartTrace(NgxTraceLog* log, int64 start_us,
+                              const StringPiece& url);
+  // NULL unless the request is being traced.
+  virtual RequestTrace* CreateDependentTraceContext(const StringPiece& label);
+  virtual void ReleaseDependentTraceContext(RequestTrace* t);
+
+  // Called from whichever thread the HTML output cache lookup finishes on.
+  void set_html_output_cache_outcome(HtmlOutputCacheOutcome outcome) {
+    base::subtle::Release_Store(&html_output_cache_outcome_, outcome);
+  }
+
  protected:
   virtual ~NgxRequestContext();
 
@@ -54,6 +109,16 @@ class NgxRequestContext : public RequestContext {
   int local_port_;
   GoogleString local_ip_;
 
+  Timer* timer_;  // NULL unless phase timing is on.
+  int64 start_ms_;
+  int64 threshold_ms_;
+  GoogleString url_;
+  bool is_resource_fetch_;
+  GoogleString filters_;
+  int64 phase_ms_[kNumPhases];  // -1 if not reached.
+  base::subtle::Atomic32 html_output_cache_outcome_;
+  NgxRequestTrace* trace_;  // Owned by RequestContext, as the root trace.
+
   DISALLOW_COPY_AND_ASSIGN(NgxRequestContext);
 };
 
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ngx_request_trace.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/function.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/null_message_handler.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kRateOverride[] = "ngx_request_trace_rate_override";
+const char kTracesWritten[] = "ngx_request_traces_written";
+const char kBytesDropped[] = "ngx_request_trace_bytes_dropped";
+
+// Longer trace messages are truncated.
+const int kMaxMessageBytes = 1024;
+
+void AppendJsonString(const StringPiece& str, GoogleString* out) {
+  out->push_back('"');
+  for (size_t i = 0; i < str.size(); ++i) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out->append(buf);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+}  // namespace
+
+NgxRequestTrace::NgxRequestTrace(NgxTraceLog* log, int64 trace_id,
+                                 int64 start_us, const StringPiece& url)
+    : log_(log),
+      root_(this),
+      trace_id_(trace_id),
+      name_(url.as_string()),
+      start_us_(start_us),
+      ended_(false),
+      mutex_(log->thread_system()->NewMutex()),
+      dropped_bytes_(0),
+      num_dependents_(0) {
+  set_tracing_enabled(true);
+}
+
+NgxRequestTrace::NgxRequestTrace(NgxRequestTrace* root, int span_id,
+                                 const StringPiece& label)
+    : log_(root->log_),
+      root_(root),
+      trace_id_(root->trace_id_),
+      span_id_(StrCat(Integer64ToString(root->trace_id_), ".",
+                      IntegerToString(span_id))),
+      name_(label.as_string()),
+      start_us_(log_->timer()->NowUs()),
+      ended_(false),
+      dropped_bytes_(0),
+      num_dependents_(0) {
+  set_tracing_enabled(true);
+  AddEvent(name_, 'b', start_us_, "");
+}
+
+NgxRequestTrace::~NgxRequestTrace() {
+  if (root_ != this) {
+    return;
+  }
+  // PSOL need not release what it creates.
+  for (int i = 0, n = dependents_.size(); i < n; ++i) {
+    dependents_[i]->End();
+    delete dependents_[i];
+  }
+  End();
+  log_->Write(&events_, dropped_bytes_);
+}
+
+void NgxRequestTrace::TraceVPrintf(const char* fmt, va_list argp) {
+  char message[kMaxMessageBytes];
+  vsnprintf(message, sizeof(message), fmt, argp);
+  int64 now_us = log_->timer()->NowUs();
+  if (root_ == this) {
+    AddEvent(message, 'i', now_us, "\"s\":\"t\"");
+  } else {
+    AddEvent(message, 'n', now_us, "");
+  }
+}
+
+void NgxRequestTrace::End() {
+  int64 now_us = log_->timer()->NowUs();
+  ScopedMutex lock(root_->mutex_.get());
+  if (ended_) {
+    return;
+  }
+  ended_ = true;
+  if (root_ == this) {
+    AddEventLocked(name_, 'X', start_us_,
+                   StrCat("\"dur\":", Integer64ToString(now_us - start_us_)));
+  } else {
+    AddEventLocked(name_, 'e', now_us, "");
+  }
+}
+
+NgxRequestTrace* NgxRequestTrace::NewDependent(const StringPiece& label) {
+  DCHECK(root_ == this);
+  int span_id;
+  {
+    ScopedMutex lock(mutex_.get());
+    span_id = ++num_dependents_;
+  }
+  NgxRequestTrace* dependent = new NgxRequestTrace(this, span_id, label);
+  ScopedMutex lock(mutex_.get());
+  dependents_.push_back(dependent);
+  return dependent;
+}
+
+void NgxRequestTrace::ReleaseDependent(NgxRequestTrace* dependent) {
+  DCHECK(root_ == this);
+  {
+    ScopedMutex lock(mutex_.get());
+    TraceVector::iterator p =
+        std::find(dependents_.begin(), dependents_.end(), dependent);
+    if (p == dependents_.end()) {
+      return;
+    }
+    dependents_.erase(p);
+  }
+  dependent->End();
+  delete dependent;
+}
+
+void NgxRequestTrace::AddEvent(const StringPiece& name, char phase,
+                               int64 ts_us, const StringPiece& extra) {
+  ScopedMutex lock(root_->mutex_.get());
+  AddEventLocked(name, phase, ts_us, extra);
+}
+
+void NgxRequestTrace::AddEventLocked(const StringPiece& name, char phase,
+                                     int64 ts_us, const StringPiece& extra) {
+  GoogleString event = "{\"name\":";
+  AppendJsonString(name, &event);
+  StrAppend(&event, ",\"cat\":\"pagespeed\",\"ph\":\"",
+            StringPiece(&phase, 1), "\",\"ts\":", Integer64ToString(ts_us),
+            ",\"pid\":", IntegerToString(log_->pid()));
+  StrAppend(&event, ",\"tid\":", Integer64ToString(trace_id_));
+  if (!span_id_.empty()) {
+    StrAppend(&event, ",\"id\":\"", span_id_, "\"");
+  }
+  if (!extra.empty()) {
+    StrAppend(&event, ",", extra);
+  }
+  event.append("},\n");
+
+  if (root_->events_.size() + event.size() > NgxTraceLog::kMaxEventBytes) {
+    root_->dropped_bytes_ += event.size();
+  } else {
+    root_->events_.append(event);
+  }
+}
+
+class NgxTraceLog::WriteFunction : public Function {
+ public:
+  WriteFunction(NgxTraceLog* log, GoogleString* events, int dropped_bytes)
+      : log_(log),
+        dropped_bytes_(dropped_bytes) {
+    events_.swap(*events);
+  }
+
+ protected:
+  virtual void Run() {
+    log_->WriteNow(events_, dropped_bytes_);
+  }
+
+  // The queue overflowed, or we're shutting down.
+  virtual void Cancel() {
+    log_->bytes_dropped_->Add(events_.size() + dropped_bytes_);
+  }
+
+ private:
+  NgxTraceLog* log_;
+  GoogleString events_;
+  int dropped_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(WriteFunction);
+};
+
+NgxTraceLog::NgxTraceLog(const StringPiece& file_prefix,
+                         int64 samples_per_million, Statistics* statistics,
+                         ThreadSystem* thread_system,
+                         FileSystem* file_system, Timer* timer,
+                         MessageHandler* handler)
+    : configured_samples_per_million_(samples_per_million),
+      pid_(getpid()),
+      filename_(StrCat(file_prefix, ".", IntegerToString(pid_), ".json")),
+      thread_system_(thread_system),
+      file_system_(file_system),
+      timer_(timer),
+      handler_(handler),
+      rate_override_(statistics->GetVariable(kRateOverride)),
+      traces_written_(statistics->GetVariable(kTracesWritten)),
+      bytes_dropped_(statistics->GetVariable(kBytesDropped)),
+      last_trace_id_(0),
+      sample_credit_(0),
+      write_pool_(new QueuedWorkerPool(1, "trace_writer", thread_system)),
+      write_sequence_(write_pool_->NewSequence()),
+      shut_down_(false),
+      file_mutex_(thread_system->NewMutex()),
+      file_(NULL),
+      file_bytes_(0),
+      open_failed_(false) {
+  write_sequence_->set_max_queue_size(kMaxQueuedWrites);
+}
+
+NgxTraceLog::~NgxTraceLog() {
+  ShutDown();
+  if (file_ != NULL) {
+    file_system_->Close(file_, handler_);
+  }
+}
+
+void NgxTraceLog::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kRateOverride);
+  statistics->AddVariable(kTracesWritten);
+  statistics->AddVariable(kBytesDropped);
+}
+
+bool NgxTraceLog::ShouldTrace() {
+  int64 rate = samples_per_million();
+  if (rate <= 0) {
+    return false;
+  }
+  // Spreads the samples evenly rather than randomly.
+  sample_credit_ += rate;
+  if (sample_credit_ < kMillion) {
+    return false;
+  }
+  sample_credit_ %= kMillion;
+  return true;
+}
+
+int64 NgxTraceLog::samples_per_million() {
+  // Reads as -1 if statistics couldn't attach to shared memory.
+  int64 rate = rate_override_->Get();
+  return rate > 0 ? rate - 1 : configured_samples_per_million_;
+}
+
+void NgxTraceLog::set_samples_per_million(int64 x) {
+  rate_override_->Set(x + 1);
+}
+
+void NgxTraceLog::Write(GoogleString* events, int dropped_bytes) {
+  write_sequence_->Add(new WriteFunction(this, events, dropped_bytes));
+}
+
+void NgxTraceLog::ShutDown() {
+  if (!shut_down_) {
+    shut_down_ = true;
+    write_pool_->ShutDown();
+  }
+}
+
+void NgxTraceLog::WriteNow(const StringPiece& events, int dropped_bytes) {
+  ScopedMutex lock(file_mutex_.get());
+  if (file_ == NULL && !OpenLocked(false)) {
+    return;
+  }
+  // A file holding only the opening '[' is as small as it gets.
+  if (file_bytes_ + static_cast<int64>(events.size()) > kMaxFileBytes &&
+      file_bytes_ > 2 && !OpenLocked(true)) {
+    return;
+  }
+  file_->Write(events, handler_);
+  file_->Flush(handler_);
+  file_bytes_ += events.size();
+  traces_written_->Add(1);
+  if (dropped_bytes > 0) {
+    bytes_dropped_->Add(dropped_bytes);
+  }
+}
+
+bool NgxTraceLog::OpenLocked(bool rotate) {
+  if (file_ != NULL) {
+    file_system_->Close(file_, handler_);
+    file_ = NULL;
+  }
+  if (open_failed_) {
+    return false;
+  }
+  if (rotate) {
+    GoogleString old_filename = StrCat(filename_, ".1");
+    file_system_->RenameFile(filename_.c_str(), old_filename.c_str(),
+                             handler_);
+  }
+  NullMessageHandler null_handler;
+  int64 size;
+  if (!file_system_->Size(filename_, &size, &null_handler)) {
+    size = 0;
+  }
+  file_ = file_system_->OpenOutputFileForAppend(filename_.c_str(), handler_);
+  if (file_ == NULL) {
+    open_failed_ = true;
+    handler_->Message(kWarning, "Can't open request trace file %s",
+                      filename_.c_str());
+    return false;
+  }
+  file_bytes_ = size;
+  if (size == 0) {
+    file_->Write("[\n", handler_);
+    file_bytes_ = 2;
+  }
+  return true;
+}
+
+}  // namespace net_instaweb
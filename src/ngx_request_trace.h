@@ -0,0 +1,201 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Samples requests and writes what PSOL traces for them as Chrome trace
+// JSON, the format chrome://tracing and Perfetto load.
+//
+// PSOL reports trace events through the RequestTrace on a request's
+// RequestContext: TracePrintf() on the root trace from the driver and the
+// caches, and on dependent traces it creates for the fetches and rewrites
+// the request sets off.  With "pagespeed RequestTraceFile <prefix>", one in
+// every million / "pagespeed RequestTraceSamplesPerMillion" requests gets
+// an NgxRequestTrace as its root.  The request as a whole becomes a span on
+// a track of its own, each dependent trace an async span, and each message
+// an instant event on the span it came in on.
+//
+// A request's events are buffered, and written when its RequestContext
+// goes away, after any rewrites it started have finished.  That may be on
+// any thread, so the writing itself is left to a thread of the log's own.
+// Each worker appends to <prefix>.<pid>.json, one event per line, after an
+// opening '['.  The trace format allows leaving out the closing ']', so the
+// files can be loaded at any time.  A file that outgrows kMaxFileBytes is
+// moved to <prefix>.<pid>.json.1, replacing the one before, and a new one
+// started.
+//
+// The rate can be changed without a reload, through
+// /ngx_pagespeed_trace?per_million=<n>, which goes for every worker as long
+// as statistics are in shared memory.
+
+#ifndef NGX_REQUEST_TRACE_H_
+#define NGX_REQUEST_TRACE_H_
+
+#include <cstdarg>
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/file_system.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
+#include "net/instaweb/util/public/request_trace.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class MessageHandler;
+class NgxTraceLog;
+class Statistics;
+class ThreadSystem;
+class Timer;
+class Variable;
+
+// A root trace, owning the event buffer of the whole request and its
+// dependent traces, or one of those dependent traces.
+class NgxRequestTrace : public RequestTrace {
+ public:
+  // A root trace for the request for url, starting at start_us.
+  NgxRequestTrace(NgxTraceLog* log, int64 trace_id, int64 start_us,
+                  const StringPiece& url);
+  // For a root trace, ends any dependent traces still open and hands the
+  // buffered events to the log.
+  virtual ~NgxRequestTrace();
+
+  virtual void TraceVPrintf(const char* fmt, va_list argp);
+
+  // Ends the request's span.  The nginx side calls this for the root when
+  // it is done with the request; dependent traces end when released.
+  void End();
+
+  // Only on the root.  The root owns the dependent trace.
+  NgxRequestTrace* NewDependent(const StringPiece& label);
+  // Ends dependent and deletes it.
+  void ReleaseDependent(NgxRequestTrace* dependent);
+
+ private:
+  typedef std::vector<NgxRequestTrace*> TraceVector;
+
+  NgxRequestTrace(NgxRequestTrace* root, int span_id,
+                  const StringPiece& label);
+
+  // Appends an event of the given phase to the root's buffer, named name,
+  // at ts_us, with extra holding any further JSON members.
+  void AddEvent(const StringPiece& name, char phase, int64 ts_us,
+                const StringPiece& extra);
+  void AddEventLocked(const StringPiece& name, char phase, int64 ts_us,
+                      const StringPiece& extra);
+
+  NgxTraceLog* log_;
+  NgxRequestTrace* root_;  // this for the root.
+  const int64 trace_id_;
+  // "<trace id>.<n>" for the n-th dependent trace, empty for the root.
+  const GoogleString span_id_;
+  const GoogleString name_;
+  const int64 start_us_;
+  bool ended_;
+
+  // On the root only.  mutex_ guards everything below it, and ended_ on
+  // every trace.
+  scoped_ptr<AbstractMutex> mutex_;
+  GoogleString events_;
+  int dropped_bytes_;
+  int num_dependents_;
+  TraceVector dependents_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxRequestTrace);
+};
+
+class NgxTraceLog {
+ public:
+  static const int64 kMillion = 1000000;
+  // Events past this many bytes for one request are dropped.
+  static const size_t kMaxEventBytes = 1024 * 1024;
+  static const int64 kMaxFileBytes = 64 * 1024 * 1024;
+  // Traces waiting past this many for the disk are dropped, oldest first.
+  static const size_t kMaxQueuedWrites = 100;
+
+  // Writes to <file_prefix>.<pid>.json.  samples_per_million is the rate
+  // configured, until changed at runtime.
+  NgxTraceLog(const StringPiece& file_prefix, int64 samples_per_million,
+              Statistics* statistics, ThreadSystem* thread_system,
+              FileSystem* file_system, Timer* timer,
+              MessageHandler* handler);
+  ~NgxTraceLog();
+
+  static void InitStats(Statistics* statistics);
+
+  // Whether to trace the next request.  Only from the nginx thread.
+  bool ShouldTrace();
+  // Numbers the traces of this process.  Only from the nginx thread.
+  int64 NextTraceId() { return ++last_trace_id_; }
+
+  // The rate in effect, in every worker.
+  int64 samples_per_million();
+  void set_samples_per_million(int64 x);
+
+  const GoogleString& filename() const { return filename_; }
+  int pid() const { return pid_; }
+
+  // Any thread.  Takes the contents of events, and queues them for the
+  // writing thread.
+  void Write(GoogleString* events, int dropped_bytes);
+  // Writes what is being written, and drops what is still queued.  Later
+  // writes are dropped too.
+  void ShutDown();
+
+  ThreadSystem* thread_system() { return thread_system_; }
+  Timer* timer() { return timer_; }
+
+ private:
+  class WriteFunction;
+
+  // On the writing thread.
+  void WriteNow(const StringPiece& events, int dropped_bytes);
+  // Opens the file, or starts a new one after moving it aside.
+  bool OpenLocked(bool rotate);
+
+  const int64 configured_samples_per_million_;
+  const int pid_;
+  const GoogleString filename_;
+  ThreadSystem* thread_system_;
+  FileSystem* file_system_;
+  Timer* timer_;
+  MessageHandler* handler_;
+  // Zero, or one more than the rate set at runtime.
+  Variable* rate_override_;
+  Variable* traces_written_;
+  Variable* bytes_dropped_;
+
+  // nginx thread only.
+  int64 last_trace_id_;
+  int64 sample_credit_;
+
+  scoped_ptr<QueuedWorkerPool> write_pool_;
+  QueuedWorkerPool::Sequence* write_sequence_;
+  bool shut_down_;
+
+  scoped_ptr<AbstractMutex> file_mutex_;
+  // These are guarded by file_mutex_; the file is opened lazily.
+  FileSystem::OutputFile* file_;
+  int64 file_bytes_;
+  bool open_failed_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxTraceLog);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_REQUEST_TRACE_H_
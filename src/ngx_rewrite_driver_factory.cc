@@ -18,13 +18,28 @@
 
 #include "ngx_rewrite_driver_factory.h"
 
+#include <algorithm>
 #include <cstdio>
 
 #include "log_message_handler.h"
+#include "ngx_cache_purger.h"
+#include "ngx_cache_stats_report.h"
+#include "ngx_dictionary_compressed_cache.h"
+#include "ngx_fast_hasher.h"
+#include "ngx_filter_cpu_timer.h"
+#include "ngx_html_load_shedder.h"
+#include "ngx_html_output_cache.h"
+#include "ngx_mem_cache.h"
 #include "ngx_message_handler.h"
+#include "ngx_property_cache_batcher.h"
+#include "ngx_queue_wait_sampler.h"
+#include "ngx_request_trace.h"
 #include "ngx_rewrite_options.h"
+#include "ngx_scheduler.h"
 #include "ngx_server_context.h"
+#include "ngx_shared_mem_statistics.h"
 #include "ngx_thread_system.h"
+#include "ngx_tinylfu_cache.h"
 #include "ngx_url_async_fetcher.h"
 #include "pthread_shared_mem.h"
 
@@ -34,21 +49,27 @@
 #include "net/instaweb/http/public/wget_url_fetcher.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/rewrite_driver_factory.h"
+#include "net/instaweb/rewriter/public/rewrite_stats.h"
 #include "net/instaweb/rewriter/public/server_context.h"
 #include "net/instaweb/rewriter/public/static_asset_manager.h"
 #include "net/instaweb/system/public/system_caches.h"
+#include "net/instaweb/util/public/cache_stats.h"
+#include "net/instaweb/util/public/compressed_cache.h"
 #include "net/instaweb/util/public/google_message_handler.h"
 #include "net/instaweb/util/public/null_shared_mem.h"
 #include "net/instaweb/util/public/property_cache.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
 #include "net/instaweb/util/public/scheduler_thread.h"
 #include "net/instaweb/util/public/posix_timer.h"
 #include "net/instaweb/util/public/shared_circular_buffer.h"
-#include "net/instaweb/util/public/shared_mem_statistics.h"
 #include "net/instaweb/util/public/slow_worker.h"
 #include "net/instaweb/util/public/stdio_file_system.h"
 #include "net/instaweb/util/public/string.h"
 #include "net/instaweb/util/public/string_util.h"
 #include "net/instaweb/util/public/thread_system.h"
+#include "net/instaweb/util/public/timer.h"
+#include "net/instaweb/util/public/waveform.h"
+#include "net/instaweb/util/public/write_through_cache.h"
 
 namespace net_instaweb {
 
@@ -68,6 +89,9 @@ namespace {
 
 const char kShutdownCount[] = "child_shutdown_count";
 
+// Used when MemcachedTimeoutUs isn't set.
+const int64 kDefaultNativeMemcachedTimeoutMs = 500;
+
 }  // namespace
 
 NgxRewriteDriverFactory::NgxRewriteDriverFactory(
@@ -86,11 +110,34 @@ NgxRewriteDriverFactory::NgxRewriteDriverFactory(
       install_crash_handler_(false),
       message_buffer_size_(0),
       shared_circular_buffer_(NULL),
+      cache_purge_ttl_ms_(ServerContext::kGeneratedMaxAgeMs),
       statistics_frozen_(false),
+      use_sharded_statistics_(false),
+      num_html_threads_(0),
+      num_rewrite_threads_(0),
+      num_expensive_rewrite_threads_(0),
+      expensive_rewrite_cpus_(0),
+      num_worker_processes_(1),
+      scheduler_slack_us_(0),
+      queue_wait_sample_interval_ms_(0),
+      queue_wait_sampler_(NULL),
+      low_priority_load_shedding_threshold_(
+          QueuedWorkerPool::kNoLoadShedding),
+      html_load_shedding_queue_depth_(0),
+      html_load_shedding_in_flight_(0),
+      html_load_shedding_latency_ms_(0),
+      filter_cpu_timing_every_(0),
+      request_trace_samples_per_million_(0),
       ngx_url_async_fetcher_(NULL),
       log_(NULL),
       resolver_timeout_(NGX_CONF_UNSET_MSEC),
-      use_native_fetcher_(false) {
+      use_native_fetcher_(false),
+      use_fast_hasher_(false),
+      use_html_output_cache_(false),
+      use_compression_dictionary_(false),
+      use_tinylfu_cache_(false),
+      use_native_memcached_(false),
+      native_memcached_hot_key_replicas_(1) {
   InitializeDefaultOptions();
   default_options()->set_beacon_url("/ngx_pagespeed_beacon");
   set_message_handler(ngx_message_handler_);
@@ -111,6 +158,9 @@ NgxRewriteDriverFactory::~NgxRewriteDriverFactory() {
 }
 
 Hasher* NgxRewriteDriverFactory::NewHasher() {
+  if (use_fast_hasher_) {
+    return new NgxFastHasher;
+  }
   return new MD5Hasher;
 }
 
@@ -174,6 +224,94 @@ NamedLockManager* NgxRewriteDriverFactory::DefaultLockManager() {
 
 void NgxRewriteDriverFactory::SetupCaches(ServerContext* server_context) {
   caches_->SetupCaches(server_context);
+  NgxServerContext* ngx_server_context =
+      static_cast<NgxServerContext*>(server_context);
+
+  CacheInterface* tinylfu_cache = GetTinyLfuCache(ngx_server_context);
+  if (tinylfu_cache != NULL) {
+    // SystemCaches put its LRUCache in front of both the HTTP cache and the
+    // metadata cache.  Keep it for the HTTP cache, but take it off the
+    // metadata cache, which gets the TinyLFU cache further down instead.
+    // With CompressMetadataCache it is inside a CompressedCache, which we
+    // rebuild around what is behind the LRUCache.
+    CacheInterface* metadata_cache = server_context->metadata_cache();
+    bool compressed = (dynamic_cast<CompressedCache*>(metadata_cache) != NULL);
+    if (compressed) {
+      metadata_cache = metadata_cache->Backend();
+    }
+    WriteThroughCache* lru_metadata_cache =
+        dynamic_cast<WriteThroughCache*>(metadata_cache);
+    if (lru_metadata_cache != NULL) {
+      metadata_cache = lru_metadata_cache->cache2();
+      if (compressed) {
+        metadata_cache = new CompressedCache(metadata_cache,
+                                             server_context->statistics());
+        server_context->DeleteCacheOnDestruction(metadata_cache);
+      }
+      server_context->set_metadata_cache(metadata_cache);
+    } else if (ngx_server_context->config()->lru_cache_kb_per_process() > 0) {
+      message_handler()->Message(
+          kWarning, "Could not find the LRU cache in front of the metadata "
+          "cache %s; it stays there, in front of the TinyLFU cache.",
+          server_context->metadata_cache()->Name());
+    }
+  }
+
+  CacheInterface* memcached = GetNativeMemcached(ngx_server_context);
+  if (memcached != NULL) {
+    // SystemCaches never saw this config's memcached servers (see RootInit),
+    // so the metadata cache it built ends at the file or shared memory cache.
+    // Write through to memcached behind that, and let the property cache
+    // talk to memcached directly so its MultiGets are pipelined.
+    CacheInterface* metadata_cache = new WriteThroughCache(
+        server_context->metadata_cache(), memcached);
+    server_context->DeleteCacheOnDestruction(metadata_cache);
+    server_context->set_metadata_cache(metadata_cache);
+    server_context->MakePropertyCaches(memcached);
+  }
+
+  if (tinylfu_cache != NULL) {
+    WriteThroughCache* metadata_cache = new WriteThroughCache(
+        tinylfu_cache, server_context->metadata_cache());
+    metadata_cache->set_cache1_limit(
+        ngx_server_context->config()->lru_cache_byte_limit());
+    server_context->DeleteCacheOnDestruction(metadata_cache);
+    server_context->set_metadata_cache(metadata_cache);
+  }
+
+  if (ngx_server_context->compress_metadata_with_dictionary()) {
+    // Outermost, so the memory tier holds compressed values too and gets
+    // the extra capacity.
+    CacheInterface* metadata_cache = new NgxDictionaryCompressedCache(
+        server_context->metadata_cache(), shared_dictionary_.get(),
+        WorkerPool(kLowPriorityRewriteWorkers), thread_system(), timer(),
+        server_context->statistics());
+    server_context->DeleteCacheOnDestruction(metadata_cache);
+    server_context->set_metadata_cache(metadata_cache);
+  }
+
+  // SystemCaches' CacheStats count each tier; count the metadata cache as a
+  // whole too, so it can be told apart from the HTTP and property caches.
+  CacheInterface* metadata_cache = new CacheStats(
+      NgxCacheStatsReport::kMetadataCachePrefix,
+      server_context->metadata_cache(), timer(), server_context->statistics());
+  server_context->DeleteCacheOnDestruction(metadata_cache);
+  server_context->set_metadata_cache(metadata_cache);
+
+  // Rebuild the property caches on top of a batcher, so the cohort lookups
+  // for a request reach the backend as one MultiGet.
+  CacheInterface* property_cache_backend = const_cast<CacheInterface*>(
+      server_context->page_property_cache()->cache_backend());
+  NgxPropertyCacheBatcher* batcher = new NgxPropertyCacheBatcher(
+      property_cache_backend, timer(), thread_system(),
+      server_context->statistics());
+  server_context->DeleteCacheOnDestruction(batcher);
+  CacheInterface* property_cache = new CacheStats(
+      NgxCacheStatsReport::kPropertyCachePrefix, batcher, timer(),
+      server_context->statistics());
+  server_context->DeleteCacheOnDestruction(property_cache);
+  server_context->MakePropertyCaches(property_cache);
+  ngx_server_context->set_property_cache_batcher(batcher);
 
   server_context->set_enable_property_cache(true);
   PropertyCache* pcache = server_context->page_property_cache();
@@ -185,6 +323,56 @@ void NgxRewriteDriverFactory::SetupCaches(ServerContext* server_context) {
   }
 }
 
+CacheInterface* NgxRewriteDriverFactory::GetNativeMemcached(
+    NgxServerContext* server_context) {
+  const GoogleString& spec = server_context->native_memcached_servers();
+  if (spec.empty()) {
+    return NULL;
+  }
+  NativeMemcachedMap::iterator p = native_memcached_map_.find(spec);
+  if (p != native_memcached_map_.end()) {
+    return p->second;
+  }
+
+  NgxRewriteOptions* config = server_context->config();
+  int64 timeout_ms = kDefaultNativeMemcachedTimeoutMs;
+  if (config->has_memcached_timeout_us()) {
+    timeout_ms = std::max(1, config->memcached_timeout_us() / 1000);
+  }
+  NgxMemCache* mem_cache = new NgxMemCache(
+      spec, timeout_ms, native_memcached_hot_key_replicas_,
+      &memcached_hasher_, statistics(), timer(), thread_system(),
+      message_handler());
+  DeleteOnDestruction(mem_cache);
+  native_memcaches_.push_back(mem_cache);
+  CacheInterface* cache = new CacheStats(
+      NgxMemCache::kStatsPrefix, mem_cache, timer(), statistics());
+  DeleteOnDestruction(cache);
+  native_memcached_map_[spec] = cache;
+  return cache;
+}
+
+CacheInterface* NgxRewriteDriverFactory::GetTinyLfuCache(
+    NgxServerContext* server_context) {
+  int64 kb = server_context->tinylfu_cache_kb_per_process();
+  if (kb == 0) {
+    return NULL;
+  }
+  const GoogleString& path = server_context->config()->file_cache_path();
+  TinyLfuCacheMap::iterator p = tinylfu_cache_map_.find(path);
+  if (p != tinylfu_cache_map_.end()) {
+    return p->second;
+  }
+  CacheInterface* cache = new NgxTinyLfuCache(
+      kb * 1024, thread_system(), statistics());
+  DeleteOnDestruction(cache);
+  cache = new CacheStats(NgxTinyLfuCache::kStatsPrefix, cache, timer(),
+                         statistics());
+  DeleteOnDestruction(cache);
+  tinylfu_cache_map_[path] = cache;
+  return cache;
+}
+
 RewriteOptions* NgxRewriteDriverFactory::NewRewriteOptions() {
   NgxRewriteOptions* options = new NgxRewriteOptions();
   options->SetRewriteLevel(RewriteOptions::kCoreFilters);
@@ -201,6 +389,87 @@ void NgxRewriteDriverFactory::PrintMemCacheStats(GoogleString* out) {
   // TODO(morlovich): Port the client code to proper API, so it gets
   // shm stats, too.
   caches_->PrintCacheStats(SystemCaches::kIncludeMemcached, out);
+  for (int i = 0, n = native_memcaches_.size(); i < n; ++i) {
+    native_memcaches_[i]->PrintServerStatus(out);
+  }
+  if (use_compression_dictionary_) {
+    NgxDictionaryCompressedCache::PrintStats(statistics(), out);
+  }
+}
+
+QueuedWorkerPool* NgxRewriteDriverFactory::CreateWorkerPool(
+    WorkerPoolCategory pool, StringPiece name) {
+  int num_threads = 0;
+  switch (pool) {
+    case kHtmlWorkers:
+      num_threads = num_html_threads_;
+      break;
+    case kRewriteWorkers:
+      num_threads = num_rewrite_threads_;
+      break;
+    case kLowPriorityRewriteWorkers:
+      // For LowPriorityRewriteNice.
+      ngx_thread_system_->set_low_priority_thread_prefix(name);
+      // Rewrite() itself runs here, which makes this where image compression
+      // spends its CPU.  Every worker process has its own pool, so to keep
+      // the machine-wide total to expensive_rewrite_cpus_ each gets its
+      // share, though never less than one thread.
+      num_threads = num_expensive_rewrite_threads_;
+      if (expensive_rewrite_cpus_ > 0) {
+        int share =
+            std::max(1, expensive_rewrite_cpus_ / num_worker_processes_);
+        num_threads = (num_threads > 0) ? std::min(num_threads, share) : share;
+      }
+      break;
+    case kNumWorkerPools:
+      break;
+  }
+  QueuedWorkerPool* worker_pool = (num_threads > 0) ?
+      new QueuedWorkerPool(num_threads, name, thread_system()) :
+      RewriteDriverFactory::CreateWorkerPool(pool, name);
+  // No set_queue_size_stat() here: WorkerPool() replaces it with RewriteStats'
+  // waveform once this returns.  ChildInit() repoints the pools afterwards.
+  return worker_pool;
+}
+
+Waveform* NgxRewriteDriverFactory::QueueDepthWaveform(
+    WorkerPoolCategory pool) {
+  if (html_load_shedder_.get() != NULL) {
+    return html_load_shedder_->queue_depth(pool);
+  }
+  return rewrite_stats()->thread_queue_depth(pool);
+}
+
+int NgxRewriteDriverFactory::LowPriorityLoadSheddingThreshold() const {
+  return low_priority_load_shedding_threshold_;
+}
+
+void NgxRewriteDriverFactory::AddPlatformSpecificRewritePasses(
+    RewriteDriver* driver) {
+  RewriteDriverFactory::AddPlatformSpecificRewritePasses(driver);
+  if (filter_cpu_timing_every_ > 0) {
+    NgxFilterCpuTimer::AddEndFilter(driver);
+  }
+}
+
+Scheduler* NgxRewriteDriverFactory::CreateScheduler() {
+  return new NgxScheduler(thread_system(), timer());
+}
+
+void NgxRewriteDriverFactory::RenderWorkerPoolQueueDepths(
+    Writer* writer, MessageHandler* handler) {
+  static const char* const kPoolTitles[kNumWorkerPools] = {
+    "HTML worker queue depth",
+    "Rewrite worker queue depth",
+    "Low-priority rewrite worker queue depth",
+  };
+  writer->Write("<h3>Worker pools (this process)</h3>", handler);
+  Waveform::RenderHeader(writer, handler);
+  for (int i = 0; i < kNumWorkerPools; ++i) {
+    WorkerPoolCategory pool = static_cast<WorkerPoolCategory>(i);
+    QueueDepthWaveform(pool)->Render(
+        kPoolTitles[i], "sequences", writer, handler);
+  }
 }
 
 bool NgxRewriteDriverFactory::InitNgxUrlAsyncFecther() {
@@ -211,6 +480,15 @@ bool NgxRewriteDriverFactory::InitNgxUrlAsyncFecther() {
   return ngx_url_async_fetcher_->Init();
 }
 
+bool NgxRewriteDriverFactory::InitNgxMemCaches() {
+  for (int i = 0, n = native_memcaches_.size(); i < n; ++i) {
+    if (!native_memcaches_[i]->Init()) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool NgxRewriteDriverFactory::CheckResolver() {
   if (use_native_fetcher_ && resolver_ == NULL) {
     return false;
@@ -221,6 +499,9 @@ bool NgxRewriteDriverFactory::CheckResolver() {
 void NgxRewriteDriverFactory::StopCacheActivity() {
   RewriteDriverFactory::StopCacheActivity();
   caches_->StopCacheActivity();
+  for (int i = 0, n = native_memcaches_.size(); i < n; ++i) {
+    native_memcaches_[i]->ShutDown();
+  }
 }
 
 NgxServerContext* NgxRewriteDriverFactory::MakeNgxServerContext() {
@@ -244,11 +525,19 @@ void NgxRewriteDriverFactory::ShutDown() {
     message_handler()->Message(kInfo, "Shutting down ngx_pagespeed root");
   }
 
+  if (queue_wait_sampler_ != NULL) {
+    queue_wait_sampler_->Stop();
+  }
   RewriteDriverFactory::ShutDown();
+  // After the rewrites, so that the traces they held get written.
+  if (trace_log_.get() != NULL) {
+    trace_log_->ShutDown();
+  }
   caches_->ShutDown(message_handler());
 
   ngx_message_handler_->set_buffer(NULL);
   ngx_html_parse_message_handler_->set_buffer(NULL);
+  ngx_html_parse_message_handler_->set_filter_cpu_timer(NULL);
 
   // TODO(oschaaf): enable this once the shared memory cleanup code
   // supports our ordering of events during a configuration reload
@@ -261,6 +550,12 @@ void NgxRewriteDriverFactory::ShutDown() {
     if (shared_circular_buffer_ != NULL) {
       shared_circular_buffer_->GlobalCleanup(message_handler());
     }
+    if (cache_purger_ != NULL) {
+      cache_purger_->GlobalCleanup(message_handler());
+    }
+    if (shared_dictionary_ != NULL) {
+      shared_dictionary_->GlobalCleanup(message_handler());
+    }
   }
 }
 
@@ -269,6 +564,8 @@ void NgxRewriteDriverFactory::StartThreads() {
     return;
   }
   ngx_thread_system_->PermitThreadStarting();
+  // The scheduler may predate the configuration, so set this only now.
+  static_cast<NgxScheduler*>(scheduler())->set_slack_us(scheduler_slack_us_);
   // TODO(jefftk): use a native nginx timer instead of running our own thread.
   // See issue #111.
   SchedulerThread* thread = new SchedulerThread(thread_system(), scheduler());
@@ -276,6 +573,14 @@ void NgxRewriteDriverFactory::StartThreads() {
   CHECK(ok) << "Unable to start scheduler thread";
   defer_cleanup(thread->MakeDeleter());
   threads_started_ = true;
+
+  if (queue_wait_sample_interval_ms_ > 0) {
+    queue_wait_sampler_ = new NgxQueueWaitSampler(
+        this, thread_system(), scheduler(), statistics(),
+        queue_wait_sample_interval_ms_);
+    DeleteOnDestruction(queue_wait_sampler_);
+    queue_wait_sampler_->Start();
+  }
 }
 
 void NgxRewriteDriverFactory::ParentOrChildInit(ngx_log_t* log) {
@@ -285,6 +590,8 @@ void NgxRewriteDriverFactory::ParentOrChildInit(ngx_log_t* log) {
   ngx_message_handler_->set_log(log);
   ngx_html_parse_message_handler_->set_log(log);
   SharedCircularBufferInit(is_root_process_);
+  CachePurgerInit(is_root_process_);
+  SharedDictionaryInit(is_root_process_);
 }
 
 // TODO(jmarantz): make this per-vhost.
@@ -307,6 +614,29 @@ void NgxRewriteDriverFactory::SharedCircularBufferInit(bool is_root) {
   }
 }
 
+void NgxRewriteDriverFactory::CachePurgerInit(bool is_root) {
+  cache_purger_.reset(NULL);
+  if (shared_mem_runtime() != NULL) {
+    scoped_ptr<NgxCachePurger> purger(new NgxCachePurger(
+        shared_mem_runtime(), filename_prefix().as_string(), thread_system(),
+        timer(), cache_purge_ttl_ms_));
+    if (purger->InitSegment(is_root, message_handler())) {
+      cache_purger_.reset(purger.release());
+    }
+  }
+}
+
+void NgxRewriteDriverFactory::SharedDictionaryInit(bool is_root) {
+  shared_dictionary_.reset(NULL);
+  if (use_compression_dictionary_ && shared_mem_runtime() != NULL) {
+    scoped_ptr<NgxSharedDictionary> dictionary(new NgxSharedDictionary(
+        shared_mem_runtime(), filename_prefix().as_string()));
+    if (dictionary->InitSegment(is_root, message_handler())) {
+      shared_dictionary_.reset(dictionary.release());
+    }
+  }
+}
+
 void NgxRewriteDriverFactory::RootInit(ngx_log_t* log) {
   net_instaweb::log_message_handler::Install(log);
 
@@ -317,7 +647,29 @@ void NgxRewriteDriverFactory::RootInit(ngx_log_t* log) {
   for (NgxServerContextSet::iterator p = uninitialized_server_contexts_.begin(),
            e = uninitialized_server_contexts_.end(); p != e; ++p) {
     NgxServerContext* server_context = *p;
-    caches_->RegisterConfig(server_context->config());
+    NgxRewriteOptions* config = server_context->config();
+    if (use_native_memcached_ && !config->memcached_servers().empty()) {
+      // Keep SystemCaches from setting up AprMemCache and its threads for
+      // these servers; SetupCaches() will use NgxMemCache instead.
+      server_context->set_native_memcached_servers(
+          config->memcached_servers());
+      config->set_memcached_servers("");
+    }
+    if (use_tinylfu_cache_ && config->lru_cache_kb_per_process() > 0) {
+      // Split the per-process memory between SystemCaches' LRUCache, which
+      // stays in front of the HTTP cache, and an NgxTinyLfuCache that
+      // SetupCaches() puts in front of the metadata cache in its place.
+      int64 kb = config->lru_cache_kb_per_process();
+      server_context->set_tinylfu_cache_kb_per_process(kb - kb / 2);
+      config->set_lru_cache_kb_per_process(kb / 2);
+    }
+    if (use_compression_dictionary_ && config->compress_metadata_cache()) {
+      // And from wrapping the metadata cache in a CompressedCache; we wrap
+      // it in an NgxDictionaryCompressedCache in SetupCaches() instead.
+      server_context->set_compress_metadata_with_dictionary(true);
+      config->set_compress_metadata_cache(false);
+    }
+    caches_->RegisterConfig(config);
   }
 
   caches_->RootInit();
@@ -330,6 +682,29 @@ void NgxRewriteDriverFactory::ChildInit(ngx_log_t* log) {
   if (shared_mem_statistics_.get() != NULL) {
     shared_mem_statistics_->Init(false, message_handler());
   }
+  html_load_shedder_.reset(new NgxHtmlLoadShedder(
+      thread_system(), timer(), statistics(), html_load_shedding_queue_depth_,
+      html_load_shedding_in_flight_, html_load_shedding_latency_ms_));
+  // Have every pool report its queue depth to the shedder.  This has to
+  // follow WorkerPool(), which sets RewriteStats' waveform on a new pool, and
+  // precede the server contexts' ChildInit(), since a Sequence copies the
+  // waveform its pool has when it is made.
+  for (int i = 0; i < kNumWorkerPools; ++i) {
+    WorkerPoolCategory pool = static_cast<WorkerPoolCategory>(i);
+    WorkerPool(pool)->set_queue_size_stat(
+        html_load_shedder_->queue_depth(pool));
+  }
+  if (filter_cpu_timing_every_ > 0) {
+    filter_cpu_timer_.reset(new NgxFilterCpuTimer(
+        statistics(), timer(), filter_cpu_timing_every_));
+    ngx_html_parse_message_handler_->set_filter_cpu_timer(
+        filter_cpu_timer_.get());
+  }
+  if (!request_trace_file_.empty()) {
+    trace_log_.reset(new NgxTraceLog(
+        request_trace_file_, request_trace_samples_per_million_, statistics(),
+        thread_system(), file_system(), timer(), message_handler()));
+  }
 
   caches_->ChildInit();
   for (NgxServerContextSet::iterator p = uninitialized_server_contexts_.begin(),
@@ -357,7 +732,7 @@ Statistics* NgxRewriteDriverFactory::MakeGlobalSharedMemStatistics(
   return shared_mem_statistics_.get();
 }
 
-SharedMemStatistics* NgxRewriteDriverFactory::
+NgxSharedMemStatistics* NgxRewriteDriverFactory::
 AllocateAndInitSharedMemStatistics(
     const StringPiece& name, const bool logging,
     const int64 logging_interval_ms,
@@ -365,10 +740,11 @@ AllocateAndInitSharedMemStatistics(
   // Note that we create the statistics object in the parent process, and
   // it stays around in the kids but gets reinitialized for them
   // inside ChildInit(), called from pagespeed_child_init.
-  SharedMemStatistics* stats = new SharedMemStatistics(
+  NgxSharedMemStatistics* stats = new NgxSharedMemStatistics(
       logging_interval_ms, StrCat(logging_file_base, name), logging,
       StrCat(filename_prefix(), name), shared_mem_runtime(), message_handler(),
-      file_system(), timer());
+      file_system(), timer(),
+      use_sharded_statistics_ ? NgxSharedMemStatistics::kDefaultNumShards : 1);
   InitStats(stats);
   stats->Init(true, message_handler());
   return stats;
@@ -382,6 +758,18 @@ void NgxRewriteDriverFactory::InitStats(Statistics* statistics) {
   NgxServerContext::InitStats(statistics);
   SystemCaches::InitStats(statistics);
   SerfUrlAsyncFetcher::InitStats(statistics);
+  NgxMemCache::InitStats(statistics);
+  NgxPropertyCacheBatcher::InitStats(statistics);
+  NgxTinyLfuCache::InitStats(statistics);
+  NgxHtmlOutputCacheLookup::InitStats(statistics);
+  NgxHtmlLoadShedder::InitStats(statistics);
+  NgxQueueWaitSampler::InitStats(statistics);
+  if (filter_cpu_timing_every_ > 0) {
+    NgxFilterCpuTimer::InitStats(statistics);
+  }
+  NgxTraceLog::InitStats(statistics);
+  NgxDictionaryCompressedCache::InitStats(statistics);
+  NgxCacheStatsReport::InitStats(statistics);
   PropertyCache::InitCohortStats(RewriteDriver::kBeaconCohort, statistics);
   PropertyCache::InitCohortStats(RewriteDriver::kDomCohort, statistics);
 
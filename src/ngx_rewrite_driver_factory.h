@@ -26,7 +26,9 @@ extern "C" {
   #include <ngx_log.h>
 }
 
+#include <map>
 #include <set>
+#include <vector>
 
 #include "apr_pools.h"
 #include "net/instaweb/system/public/system_rewrite_driver_factory.h"
@@ -40,18 +42,29 @@ extern "C" {
 namespace net_instaweb {
 
 class AbstractSharedMem;
+class CacheInterface;
+class NgxCachePurger;
+class NgxFilterCpuTimer;
+class NgxTraceLog;
+class NgxHtmlLoadShedder;
+class NgxMemCache;
 class NgxMessageHandler;
+class NgxQueueWaitSampler;
 class NgxRewriteOptions;
 class NgxServerContext;
+class NgxSharedDictionary;
+class NgxSharedMemStatistics;
 class NgxThreadSystem;
 class NgxUrlAsyncFetcher;
+class QueuedWorkerPool;
 class SharedCircularBuffer;
 class SharedMemRefererStatistics;
-class SharedMemStatistics;
 class SlowWorker;
 class StaticAssetManager;
 class Statistics;
 class SystemCaches;
+class Waveform;
+class Writer;
 
 class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
  public:
@@ -78,6 +91,9 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   // Print out details of all the connections to memcached servers.
   void PrintMemCacheStats(GoogleString* out);
   bool InitNgxUrlAsyncFecther();
+  // Sets up the native memcached clients.  Like InitNgxUrlAsyncFecther, must
+  // be called in the worker process after ChildInit().
+  bool InitNgxMemCaches();
   // Check resolver configed or not.
   bool CheckResolver();
 
@@ -85,8 +101,9 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   // release the base class resources.
   // Initializes all the statistics objects created transitively by
   // NgxRewriteDriverFactory, including nginx-specific and
-  // platform-independent statistics.
-  static void InitStats(Statistics* statistics);
+  // platform-independent statistics.  Per-filter CPU times are only there
+  // with FilterCpuTimingEvery, which must be parsed by then.
+  void InitStats(Statistics* statistics);
   virtual void ShutDown();
   virtual void StopCacheActivity();
   NgxServerContext* MakeNgxServerContext();
@@ -124,6 +141,8 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   void RootInit(ngx_log_t* log);
   void ChildInit(ngx_log_t* log);
   void SharedCircularBufferInit(bool is_root);
+  void CachePurgerInit(bool is_root);
+  void SharedDictionaryInit(bool is_root);
   // Build global shared-memory statistics.  This is invoked if at least
   // one server context (global or VirtualHost) enables statistics.
   Statistics* MakeGlobalSharedMemStatistics(bool logging,
@@ -131,11 +150,18 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
                                             const GoogleString& logging_file);
 
   // Creates and ::Initializes a shared memory statistics object.
-  SharedMemStatistics* AllocateAndInitSharedMemStatistics(
+  NgxSharedMemStatistics* AllocateAndInitSharedMemStatistics(
       const StringPiece& name, const bool logging,
       const int64 logging_interval_ms, const GoogleString& logging_file);
 
   NgxMessageHandler* ngx_message_handler() { return ngx_message_handler_; }
+  NgxThreadSystem* ngx_thread_system() { return ngx_thread_system_; }
+  // NULL if shared memory is unavailable.
+  NgxCachePurger* cache_purger() { return cache_purger_.get(); }
+  // How long purges stay in effect; see NgxCachePurger.
+  void set_cache_purge_ttl_ms(int64 x) {
+    cache_purge_ttl_ms_ = x;
+  }
   void set_main_conf(NgxRewriteOptions* main_conf) {  main_conf_ = main_conf; }
 
   bool use_per_vhost_statistics() const {
@@ -169,6 +195,117 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   void set_use_native_fetcher(bool x) {
     use_native_fetcher_ = x;
   }
+  bool use_native_memcached() {
+    return use_native_memcached_;
+  }
+  void set_use_native_memcached(bool x) {
+    use_native_memcached_ = x;
+  }
+  // Whether NewHasher returns an NgxFastHasher instead of an MD5Hasher.  Must
+  // be set before the first server context is initialized.
+  bool use_fast_hasher() {
+    return use_fast_hasher_;
+  }
+  void set_use_fast_hasher(bool x) {
+    use_fast_hasher_ = x;
+  }
+  // Whether the metadata cache's per-process memory tier is an
+  // NgxTinyLfuCache instead of SystemCaches' LRUCache.
+  bool use_tinylfu_cache() {
+    return use_tinylfu_cache_;
+  }
+  void set_use_tinylfu_cache(bool x) {
+    use_tinylfu_cache_ = x;
+  }
+  // Whether CompressMetadataCache uses NgxDictionaryCompressedCache instead
+  // of SystemCaches' CompressedCache.
+  bool use_compression_dictionary() {
+    return use_compression_dictionary_;
+  }
+  void set_use_compression_dictionary(bool x) {
+    use_compression_dictionary_ = x;
+  }
+  // Whether rewritten HTML is cached by a hash of the origin HTML, see
+  // NgxHtmlOutputCacheLookup.
+  bool use_html_output_cache() {
+    return use_html_output_cache_;
+  }
+  void set_use_html_output_cache(bool x) {
+    use_html_output_cache_ = x;
+  }
+  // Whether statistics variables are split into per-thread shards, see
+  // NgxSharedMemStatistics.
+  bool use_sharded_statistics() {
+    return use_sharded_statistics_;
+  }
+  void set_use_sharded_statistics(bool x) {
+    use_sharded_statistics_ = x;
+  }
+  int native_memcached_hot_key_replicas() {
+    return native_memcached_hot_key_replicas_;
+  }
+  void set_native_memcached_hot_key_replicas(int x) {
+    native_memcached_hot_key_replicas_ = x;
+  }
+  // Threads per worker pool, in every nginx worker process; 0 leaves the
+  // pool to RewriteDriverFactory, which gives it one.
+  void set_num_html_threads(int x) {
+    num_html_threads_ = x;
+  }
+  void set_num_rewrite_threads(int x) {
+    num_rewrite_threads_ = x;
+  }
+  void set_num_expensive_rewrite_threads(int x) {
+    num_expensive_rewrite_threads_ = x;
+  }
+  // Limits the low-priority pool threads across all worker processes to
+  // about x, see CreateWorkerPool(); 0 for no limit.
+  void set_expensive_rewrite_cpus(int x) {
+    expensive_rewrite_cpus_ = x;
+  }
+  void set_num_worker_processes(int x) {
+    num_worker_processes_ = x;
+  }
+  // See NgxScheduler.
+  void set_scheduler_slack_us(int64 x) {
+    scheduler_slack_us_ = x;
+  }
+  // See NgxQueueWaitSampler; 0 turns it off.
+  void set_queue_wait_sample_interval_ms(int64 x) {
+    queue_wait_sample_interval_ms_ = x;
+  }
+  // Times the HTML filters of one in every x HTML requests; 0 for none.
+  void set_filter_cpu_timing_every(int x) {
+    filter_cpu_timing_every_ = x;
+  }
+  // NULL unless filter timing is on, and before ChildInit().
+  NgxFilterCpuTimer* filter_cpu_timer() { return filter_cpu_timer_.get(); }
+  // See NgxTraceLog; requests are only traced with a file set.
+  void set_request_trace_file(const StringPiece& x) {
+    x.CopyToString(&request_trace_file_);
+  }
+  void set_request_trace_samples_per_million(int64 x) {
+    request_trace_samples_per_million_ = x;
+  }
+  // NULL unless a trace file is set, and before ChildInit().
+  NgxTraceLog* trace_log() { return trace_log_.get(); }
+  void set_low_priority_load_shedding_threshold(int x) {
+    low_priority_load_shedding_threshold_ = x;
+  }
+  // Thresholds for NgxHtmlLoadShedder; 0 disables each.
+  void set_html_load_shedding_queue_depth(int x) {
+    html_load_shedding_queue_depth_ = x;
+  }
+  void set_html_load_shedding_in_flight(int x) {
+    html_load_shedding_in_flight_ = x;
+  }
+  void set_html_load_shedding_latency_ms(int64 x) {
+    html_load_shedding_latency_ms_ = x;
+  }
+  // NULL before ChildInit().
+  NgxHtmlLoadShedder* html_load_shedder() { return html_load_shedder_.get(); }
+  // Renders the recent queue depth of each worker pool in this process.
+  void RenderWorkerPoolQueueDepths(Writer* writer, MessageHandler* handler);
 
   // We use a beacon handler to collect data for critical images,
   // css, etc., so filters should be configured accordingly.
@@ -178,7 +315,26 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
     return true;
   }
 
+  virtual void AddPlatformSpecificRewritePasses(RewriteDriver* driver);
+
+ protected:
+  virtual QueuedWorkerPool* CreateWorkerPool(WorkerPoolCategory pool,
+                                             StringPiece name);
+  virtual int LowPriorityLoadSheddingThreshold() const;
+  virtual Scheduler* CreateScheduler();
+
  private:
+  // Where a pool records its queue depth: the load shedder's waveform in a
+  // worker process, where ChildInit() sets it, or else RewriteStats'.
+  Waveform* QueueDepthWaveform(WorkerPoolCategory pool);
+
+  // Returns the (shared) native memcached client for server_context, or NULL
+  // if it has no memcached servers or UseNativeMemcached is off.
+  CacheInterface* GetNativeMemcached(NgxServerContext* server_context);
+  // Returns the (shared) TinyLFU memory cache for server_context, or NULL if
+  // it has no memory cache or LRUCacheAdmission is lru.
+  CacheInterface* GetTinyLfuCache(NgxServerContext* server_context);
+
   NgxThreadSystem* ngx_thread_system_;
   Timer* timer_;
   scoped_ptr<AbstractSharedMem> shared_mem_runtime_;
@@ -203,14 +359,62 @@ class NgxRewriteDriverFactory : public SystemRewriteDriverFactory {
   bool install_crash_handler_;
   int message_buffer_size_;
   scoped_ptr<SharedCircularBuffer> shared_circular_buffer_;
-  scoped_ptr<SharedMemStatistics> shared_mem_statistics_;
+  scoped_ptr<NgxCachePurger> cache_purger_;
+  int64 cache_purge_ttl_ms_;
+  // NULL unless use_compression_dictionary_ and shared memory is available.
+  scoped_ptr<NgxSharedDictionary> shared_dictionary_;
+  scoped_ptr<NgxSharedMemStatistics> shared_mem_statistics_;
   bool statistics_frozen_;
+  bool use_sharded_statistics_;
+  int num_html_threads_;
+  int num_rewrite_threads_;
+  int num_expensive_rewrite_threads_;
+  int expensive_rewrite_cpus_;
+  int num_worker_processes_;
+  int64 scheduler_slack_us_;
+  int64 queue_wait_sample_interval_ms_;
+  // Deleted through DeleteOnDestruction(), after the scheduler thread.
+  NgxQueueWaitSampler* queue_wait_sampler_;
+  // QueuedWorkerPool::kNoLoadShedding, or how many sequences may wait in the
+  // low-priority pool before the oldest are dropped.
+  int low_priority_load_shedding_threshold_;
+  int html_load_shedding_queue_depth_;
+  int html_load_shedding_in_flight_;
+  int64 html_load_shedding_latency_ms_;
+  scoped_ptr<NgxHtmlLoadShedder> html_load_shedder_;
+  int filter_cpu_timing_every_;
+  scoped_ptr<NgxFilterCpuTimer> filter_cpu_timer_;
+  GoogleString request_trace_file_;
+  int64 request_trace_samples_per_million_;
+  scoped_ptr<NgxTraceLog> trace_log_;
 
   NgxUrlAsyncFetcher* ngx_url_async_fetcher_;
   ngx_log_t* log_;
   ngx_msec_t resolver_timeout_;
   ngx_resolver_t* resolver_;
   bool use_native_fetcher_;
+  bool use_fast_hasher_;
+  bool use_html_output_cache_;
+  bool use_compression_dictionary_;
+
+  // TinyLFU memory caches, one per file cache path like SystemCaches'
+  // LRUCaches, wrapped in CacheStats.  Owned through DeleteOnDestruction().
+  bool use_tinylfu_cache_;
+  typedef std::map<GoogleString, CacheInterface*> TinyLfuCacheMap;
+  TinyLfuCacheMap tinylfu_cache_map_;
+
+  // Native memcached clients, one per distinct server spec, mapped to their
+  // CacheStats wrappers.  Both are owned by the factory through
+  // DeleteOnDestruction().
+  bool use_native_memcached_;
+  // How many servers a hot key is replicated to; 1 disables replication.
+  int native_memcached_hot_key_replicas_;
+  typedef std::map<GoogleString, CacheInterface*> NativeMemcachedMap;
+  NativeMemcachedMap native_memcached_map_;
+  std::vector<NgxMemCache*> native_memcaches_;
+  // Memcached keys are hashed with MD5, like SystemCaches does for
+  // AprMemCache, independent of the resource hasher.
+  MD5Hasher memcached_hasher_;
 
   DISALLOW_COPY_AND_ASSIGN(NgxRewriteDriverFactory);
 };
@@ -25,12 +25,15 @@ extern "C" {
 }
 
 #include "ngx_pagespeed.h"
+#include "ngx_request_trace.h"
 #include "ngx_rewrite_driver_factory.h"
+#include "ngx_thread_system.h"
 
 #include "net/instaweb/public/version.h"
 #include "net/instaweb/rewriter/public/file_load_policy.h"
 #include "net/instaweb/rewriter/public/rewrite_options.h"
 #include "net/instaweb/system/public/system_caches.h"
+#include "net/instaweb/util/public/queued_worker_pool.h"
 #include "net/instaweb/util/public/timer.h"
 
 namespace net_instaweb {
@@ -48,7 +51,15 @@ void NgxRewriteOptions::Init() {
 }
 
 void NgxRewriteOptions::AddProperties() {
-  // Nothing ngx-specific for now.
+  add_ngx_option(
+      -1, &NgxRewriteOptions::max_page_processing_delay_ms_, "nmppd",
+      "Total time an HTML response may wait for rewrites, or -1");
+  add_ngx_option(
+      -1, &NgxRewriteOptions::slow_request_log_threshold_ms_, "nsrlt",
+      "Log requests pagespeed spends longer than this on, or -1");
+  add_ngx_option(
+      false, &NgxRewriteOptions::admin_handlers_, "nah",
+      "Serve the purge and trace handlers");
 
   MergeSubclassProperties(ngx_properties_);
   NgxRewriteOptions config;
@@ -56,7 +67,10 @@ void NgxRewriteOptions::AddProperties() {
 }
 
 void NgxRewriteOptions::InitializeSignaturesAndDefaults() {
-  // Calls to foo_.DoNotUseForSignatureComputation() would go here.
+  // Only changes how long we wait, not what the rewrites produce.
+  max_page_processing_delay_ms_.DoNotUseForSignatureComputation();
+  slow_request_log_threshold_ms_.DoNotUseForSignatureComputation();
+  admin_handlers_.DoNotUseForSignatureComputation();
 
   // Set default header value.
   set_default_x_header_value(kModPagespeedVersion);
@@ -189,6 +203,224 @@ NgxRewriteOptions::ParseAndSetOptions(
         } else {
           result = RewriteOptions::kOptionValueInvalid;
         }
+      } else if (IsDirective(directive, "HashFunction")) {
+        if (IsDirective(arg, "murmur3")) {
+          driver_factory->set_use_fast_hasher(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "md5")) {
+          driver_factory->set_use_fast_hasher(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "LRUCacheAdmission")) {
+        if (IsDirective(arg, "tinylfu")) {
+          driver_factory->set_use_tinylfu_cache(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "lru")) {
+          driver_factory->set_use_tinylfu_cache(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "UseNativeMemcached")) {
+        if (IsDirective(arg, "on")) {
+          driver_factory->set_use_native_memcached(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "off")) {
+          driver_factory->set_use_native_memcached(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "CompressMetadataCacheDictionary")) {
+        if (IsDirective(arg, "on")) {
+          driver_factory->set_use_compression_dictionary(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "off")) {
+          driver_factory->set_use_compression_dictionary(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "ShardedStatistics")) {
+        if (IsDirective(arg, "on")) {
+          driver_factory->set_use_sharded_statistics(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "off")) {
+          driver_factory->set_use_sharded_statistics(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "HtmlOutputCache")) {
+        if (IsDirective(arg, "on")) {
+          driver_factory->set_use_html_output_cache(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "off")) {
+          driver_factory->set_use_html_output_cache(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "NativeMemcachedHotKeyReplicas")) {
+        int replicas;
+        bool ok = StringToInt(arg.as_string(), &replicas);
+        if (ok && replicas >= 1) {
+          driver_factory->set_native_memcached_hot_key_replicas(replicas);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "NumHtmlThreads") ||
+                 IsDirective(directive, "NumRewriteThreads") ||
+                 IsDirective(directive, "NumExpensiveRewriteThreads")) {
+        int num_threads;
+        bool ok = StringToInt(arg.as_string(), &num_threads);
+        if (ok && num_threads >= 1) {
+          if (IsDirective(directive, "NumHtmlThreads")) {
+            driver_factory->set_num_html_threads(num_threads);
+          } else if (IsDirective(directive, "NumRewriteThreads")) {
+            driver_factory->set_num_rewrite_threads(num_threads);
+          } else {
+            driver_factory->set_num_expensive_rewrite_threads(num_threads);
+          }
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "ThreadCpuAffinity")) {
+        if (driver_factory->ngx_thread_system()->SetCpuAffinity(arg)) {
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "LowPriorityRewriteNice")) {
+        // See NgxThreadSystem::set_low_priority_nice() for the costs.
+        int nice;
+        bool ok = StringToInt(arg.as_string(), &nice);
+        if (ok && nice >= 0 && nice <= 19) {
+          driver_factory->ngx_thread_system()->set_low_priority_nice(nice);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "QueueWaitSampleIntervalMs")) {
+        int64 interval_ms;
+        bool ok = StringToInt64(arg.as_string(), &interval_ms);
+        if (ok && interval_ms >= 0) {
+          driver_factory->set_queue_wait_sample_interval_ms(interval_ms);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "FilterCpuTimingEvery")) {
+        int every;
+        bool ok = StringToInt(arg.as_string(), &every);
+        if (ok && every >= 0) {
+          driver_factory->set_filter_cpu_timing_every(every);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "RequestTraceFile")) {
+        if (arg.starts_with("/")) {
+          driver_factory->set_request_trace_file(arg);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "RequestTraceSamplesPerMillion")) {
+        int64 per_million;
+        bool ok = StringToInt64(arg.as_string(), &per_million);
+        if (ok && per_million >= 0 && per_million <= NgxTraceLog::kMillion) {
+          driver_factory->set_request_trace_samples_per_million(per_million);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "CachePurgeTtlSec")) {
+        int64 ttl_sec;
+        bool ok = StringToInt64(arg.as_string(), &ttl_sec);
+        if (ok && ttl_sec >= 1) {
+          driver_factory->set_cache_purge_ttl_ms(ttl_sec * Timer::kSecondMs);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "SchedulerSlackUs")) {
+        int64 slack_us;
+        bool ok = StringToInt64(arg.as_string(), &slack_us);
+        if (ok && slack_us >= 0) {
+          driver_factory->set_scheduler_slack_us(slack_us);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "ExpensiveRewriteCpus")) {
+        int cpus;
+        bool ok = StringToInt(arg.as_string(), &cpus);
+        if (ok && cpus >= 1) {
+          driver_factory->set_expensive_rewrite_cpus(cpus);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "LowPriorityLoadSheddingThreshold")) {
+        int threshold;
+        bool ok = StringToInt(arg.as_string(), &threshold);
+        if (ok && (threshold >= 1 ||
+                   threshold == QueuedWorkerPool::kNoLoadShedding)) {
+          driver_factory->set_low_priority_load_shedding_threshold(threshold);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "HtmlLoadSheddingQueueDepth") ||
+                 IsDirective(directive, "HtmlLoadSheddingInFlight") ||
+                 IsDirective(directive, "HtmlLoadSheddingLatencyMs")) {
+        int threshold;
+        bool ok = StringToInt(arg.as_string(), &threshold);
+        if (ok && threshold >= 0) {
+          if (IsDirective(directive, "HtmlLoadSheddingQueueDepth")) {
+            driver_factory->set_html_load_shedding_queue_depth(threshold);
+          } else if (IsDirective(directive, "HtmlLoadSheddingInFlight")) {
+            driver_factory->set_html_load_shedding_in_flight(threshold);
+          } else {
+            driver_factory->set_html_load_shedding_latency_ms(threshold);
+          }
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "MaxPageProcessingDelayMs")) {
+        int delay_ms;
+        bool ok = StringToInt(arg.as_string(), &delay_ms);
+        if (ok && delay_ms >= -1) {
+          set_max_page_processing_delay_ms(delay_ms);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "AdminHandlers")) {
+        if (IsDirective(arg, "on")) {
+          set_admin_handlers(true);
+          result = RewriteOptions::kOptionOk;
+        } else if (IsDirective(arg, "off")) {
+          set_admin_handlers(false);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
+      } else if (IsDirective(directive, "SlowRequestLogThresholdMs")) {
+        int64 threshold_ms;
+        bool ok = StringToInt64(arg.as_string(), &threshold_ms);
+        if (ok && threshold_ms >= -1) {
+          set_slow_request_log_threshold_ms(threshold_ms);
+          result = RewriteOptions::kOptionOk;
+        } else {
+          result = RewriteOptions::kOptionValueInvalid;
+        }
       } else {
         result = ParseAndSetOptionFromName1(directive, args[1], &msg, handler);
       }
@@ -66,6 +66,37 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   static const NgxRewriteOptions* DynamicCast(const RewriteOptions* instance);
   static NgxRewriteOptions* DynamicCast(RewriteOptions* instance);
 
+  // How long, in total, an HTML response may wait for rewrites, across all
+  // its flush windows; once spent, what remains is served unrewritten.  -1,
+  // the default, for no limit beyond RewriteDeadlinePerFlushMs per flush.
+  // See RewriteDriver::set_max_page_processing_delay_ms.
+  int max_page_processing_delay_ms() const {
+    return max_page_processing_delay_ms_.value();
+  }
+  void set_max_page_processing_delay_ms(int x) {
+    set_option(x, &max_page_processing_delay_ms_);
+  }
+
+  // HTML and .pagespeed. requests that take pagespeed at least this long are
+  // logged with a breakdown of where the time went, see
+  // NgxRequestContext::LogIfSlow().  -1, the default, logs none.
+  int64 slow_request_log_threshold_ms() const {
+    return slow_request_log_threshold_ms_.value();
+  }
+  void set_slow_request_log_threshold_ms(int64 x) {
+    set_option(x, &slow_request_log_threshold_ms_);
+  }
+
+  // Whether /ngx_pagespeed_purge and /ngx_pagespeed_trace are served.  Off
+  // by default, since they change what every worker does; turn it on only
+  // where access is restricted to trusted clients.
+  bool admin_handlers() const {
+    return admin_handlers_.value();
+  }
+  void set_admin_handlers(bool x) {
+    set_option(x, &admin_handlers_);
+  }
+
 
  private:
   // Helper methods for ParseAndSetOptions().  Each can:
@@ -104,13 +135,15 @@ class NgxRewriteOptions : public SystemRewriteOptions {
   void Init();
   void InitializeSignaturesAndDefaults();
 
-  // Add an option to ngx_properties_
+  // Add an option to ngx_properties_.  PSOL has no OptionEnum for these, so
+  // ParseAndSetOptions handles them by name itself.
   template<class RewriteOptionsSubclass, class OptionClass>
   static void add_ngx_option(typename OptionClass::ValueType default_value,
                              OptionClass RewriteOptionsSubclass::*offset,
                              const char* id,
-                             OptionEnum option_enum) {
-    AddProperty(default_value, offset, id, option_enum, ngx_properties_);
+                             const char* help) {
+    AddProperty(default_value, offset, id, kEndOfOptions, kDirectoryScope,
+                help, ngx_properties_);
   }
 
   // Helper for ParseAndSetOptions.  Returns whether the two directives equal,
@@ -119,6 +152,10 @@ class NgxRewriteOptions : public SystemRewriteOptions {
 
   // TODO(jefftk): support fetch proxy in server and location blocks.
 
+  Option<int> max_page_processing_delay_ms_;
+  Option<int64> slow_request_log_threshold_ms_;
+  Option<bool> admin_handlers_;
+
   DISALLOW_COPY_AND_ASSIGN(NgxRewriteOptions);
 };
 
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_scheduler.h"
+
+namespace net_instaweb {
+
+NgxScheduler::NgxScheduler(ThreadSystem* thread_system, Timer* timer)
+    : Scheduler(thread_system, timer),
+      slack_us_(0) {
+}
+
+NgxScheduler::~NgxScheduler() {
+}
+
+void NgxScheduler::AwaitWakeupUntilUs(int64 wakeup_time_us) {
+  // 0 means there are no alarms; leave that alone.
+  if (slack_us_ > 0 && wakeup_time_us > 0) {
+    int64 remainder = wakeup_time_us % slack_us_;
+    if (remainder != 0) {
+      wakeup_time_us += slack_us_ - remainder;
+    }
+  }
+  Scheduler::AwaitWakeupUntilUs(wakeup_time_us);
+}
+
+}  // namespace net_instaweb
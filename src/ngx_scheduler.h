@@ -0,0 +1,61 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A Scheduler that coalesces its wakeups.
+//
+// Every HTML rewrite adds a deadline alarm, and with many rewrites in flight
+// the scheduler thread wakes for each alarm that comes due, taking the
+// scheduler mutex from the threads adding and cancelling alarms every time.
+// With a slack of N us we sleep until the next multiple of N at or after the
+// earliest alarm, so alarms due within the same N us run on one wakeup, at
+// the cost of running up to N us late.
+//
+// Scheduler keeps its alarms to itself, and AddAlarm() and CancelAlarm() are
+// not virtual, so how it stores them is not ours to change; this is what we
+// can do from outside.
+
+#ifndef NGX_SCHEDULER_H_
+#define NGX_SCHEDULER_H_
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/scheduler.h"
+
+namespace net_instaweb {
+
+class ThreadSystem;
+class Timer;
+
+class NgxScheduler : public Scheduler {
+ public:
+  NgxScheduler(ThreadSystem* thread_system, Timer* timer);
+  virtual ~NgxScheduler();
+
+  // 0, the default, behaves as Scheduler.  Set before the scheduler thread
+  // starts.
+  void set_slack_us(int64 x) { slack_us_ = x; }
+
+ protected:
+  virtual void AwaitWakeupUntilUs(int64 wakeup_time_us);
+
+ private:
+  int64 slack_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxScheduler);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SCHEDULER_H_
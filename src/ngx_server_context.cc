@@ -21,12 +21,12 @@
 #include "ngx_request_context.h"
 #include "ngx_rewrite_options.h"
 #include "ngx_rewrite_driver_factory.h"
+#include "ngx_shared_mem_statistics.h"
 #include "net/instaweb/apache/add_headers_fetcher.h"
 #include "net/instaweb/apache/loopback_route_fetcher.h"
 #include "net/instaweb/rewriter/public/rewrite_driver.h"
 #include "net/instaweb/rewriter/public/rewrite_stats.h"
 #include "net/instaweb/system/public/system_caches.h"
-#include "net/instaweb/util/public/shared_mem_statistics.h"
 #include "net/instaweb/util/public/split_statistics.h"
 #include "net/instaweb/util/public/statistics.h"
 
@@ -42,6 +42,10 @@ const char kHtmlRewriteTimeUsHistogram[] = "Html Time us Histogram";
 NgxServerContext::NgxServerContext(NgxRewriteDriverFactory* factory)
     : SystemServerContext(factory),
       ngx_factory_(factory),
+      tinylfu_cache_kb_per_process_(0),
+      compress_metadata_with_dictionary_(false),
+      property_cache_batcher_(NULL),
+      cache_flush_timestamp_ms_(0),
       initialized_(false) {
 }
 
@@ -79,6 +83,15 @@ void NgxServerContext::ChildInit() {
   }
 }
 
+bool NgxServerContext::UpdateCacheFlushTimestampMs(int64 timestamp_ms) {
+  bool updated = SystemServerContext::UpdateCacheFlushTimestampMs(
+      timestamp_ms);
+  if (updated) {
+    base::subtle::Release_Store(&cache_flush_timestamp_ms_, timestamp_ms);
+  }
+  return updated;
+}
+
 void NgxServerContext::CreateLocalStatistics(
     Statistics* global_statistics) {
   local_statistics_ =
@@ -91,7 +104,7 @@ void NgxServerContext::CreateLocalStatistics(
       ngx_factory_->thread_system(), local_statistics_, global_statistics));
   // local_statistics_ was ::InitStat'd by AllocateAndInitSharedMemStatistics,
   // but we need to take care of split_statistics_.
-  NgxRewriteDriverFactory::InitStats(split_statistics_.get());
+  ngx_factory_->InitStats(split_statistics_.get());
 }
 
 void NgxServerContext::InitStats(Statistics* statistics) {
@@ -21,14 +21,16 @@
 #ifndef NGX_SERVER_CONTEXT_H_
 #define NGX_SERVER_CONTEXT_H_
 
+#include "base/atomicops.h"
 #include "net/instaweb/system/public/system_server_context.h"
 
 namespace net_instaweb {
 
+class NgxPropertyCacheBatcher;
 class NgxRewriteDriverFactory;
 class NgxRewriteOptions;
+class NgxSharedMemStatistics;
 class RewriteStats;
-class SharedMemStatistics;
 class Statistics;
 
 class NgxServerContext : public SystemServerContext {
@@ -56,19 +58,66 @@ class NgxServerContext : public SystemServerContext {
   GoogleString hostname_identifier() { return hostname_identifier_; }
   void set_hostname_identifier(GoogleString x) { hostname_identifier_ = x; }
   NgxRewriteDriverFactory* ngx_rewrite_driver_factory() { return ngx_factory_; }
+  // The MemcachedServers spec served by NgxMemCache rather than SystemCaches.
+  // Empty unless UseNativeMemcached is on.
+  const GoogleString& native_memcached_servers() const {
+    return native_memcached_servers_;
+  }
+  void set_native_memcached_servers(const GoogleString& x) {
+    native_memcached_servers_ = x;
+  }
+  // The part of LruCacheKbPerProcess served by NgxTinyLfuCache, for the
+  // metadata cache, rather than by SystemCaches' LRUCache, which keeps the
+  // HTTP cache.  Zero unless LRUCacheAdmission is tinylfu.
+  int64 tinylfu_cache_kb_per_process() const {
+    return tinylfu_cache_kb_per_process_;
+  }
+  void set_tinylfu_cache_kb_per_process(int64 x) {
+    tinylfu_cache_kb_per_process_ = x;
+  }
+  // Whether SetupCaches() should compress the metadata cache with an
+  // NgxDictionaryCompressedCache, in place of SystemCaches' CompressedCache.
+  bool compress_metadata_with_dictionary() const {
+    return compress_metadata_with_dictionary_;
+  }
+  void set_compress_metadata_with_dictionary(bool x) {
+    compress_metadata_with_dictionary_ = x;
+  }
+  // Backs both property caches; set up by SetupCaches().  Owned by the
+  // ServerContext, via DeleteCacheOnDestruction().
+  NgxPropertyCacheBatcher* property_cache_batcher() {
+    return property_cache_batcher_;
+  }
+  void set_property_cache_batcher(NgxPropertyCacheBatcher* x) {
+    property_cache_batcher_ = x;
+  }
+  // The cache flush timestamp last applied to the global options, or 0.
+  // FlushCacheIfNecessary() is driven by a per-worker timer, so this is all
+  // the request path needs to look at.
+  int64 cache_flush_timestamp_ms() const {
+    return base::subtle::Acquire_Load(&cache_flush_timestamp_ms_);
+  }
+
+ protected:
+  virtual bool UpdateCacheFlushTimestampMs(int64 timestamp_ms);
 
  private:
   NgxRewriteDriverFactory* ngx_factory_;
   // hostname_identifier_ is used to distinguish the name of shared memory
   // segments associated with this ServerContext
   GoogleString hostname_identifier_;
+  GoogleString native_memcached_servers_;
+  int64 tinylfu_cache_kb_per_process_;
+  bool compress_metadata_with_dictionary_;
+  NgxPropertyCacheBatcher* property_cache_batcher_;
+  base::subtle::Atomic64 cache_flush_timestamp_ms_;
   bool initialized_;
 
   // Non-NULL if we have per-vhost stats.
   scoped_ptr<Statistics> split_statistics_;
 
   // May be NULL. Owned by *split_statistics_.
-  SharedMemStatistics* local_statistics_;
+  NgxSharedMemStatistics* local_statistics_;
   // These are non-NULL if we have per-vhost stats.
   scoped_ptr<RewriteStats> local_rewrite_stats_;
 
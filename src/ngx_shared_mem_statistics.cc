@@ -0,0 +1,553 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_shared_mem_statistics.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "net/instaweb/util/public/abstract_shared_mem.h"
+#include "net/instaweb/util/public/message_handler.h"
+#include "net/instaweb/util/public/shared_mem_statistics.h"
+#include "net/instaweb/util/public/stl_util.h"
+#include "net/instaweb/util/public/writer.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kSegmentName[] = "ngx_variables";
+
+// Shards start on their own cache lines, so that no two threads write to the
+// same line unless they share a shard.
+const size_t kCacheLineBytes = 64;
+
+size_t RoundUpToCacheLine(size_t bytes) {
+  return (bytes + kCacheLineBytes - 1) & ~(kCacheLineBytes - 1);
+}
+
+// Raises *value to new_value if that is larger.
+void AtomicMax(volatile base::subtle::Atomic64* value, int64 new_value) {
+  base::subtle::Atomic64 old_value = base::subtle::NoBarrier_Load(value);
+  while (new_value > old_value) {
+    base::subtle::Atomic64 seen = base::subtle::NoBarrier_CompareAndSwap(
+        value, old_value, new_value);
+    if (seen == old_value) {
+      break;
+    }
+    old_value = seen;
+  }
+}
+
+// Holds the calling thread's shard plus one, or NULL before it claims one.
+// There is one key for the process rather than one per statistics object,
+// of which there is one per server block, as keys are a scarce resource.
+// A thread claims its shard from the first statistics object it adds to,
+// and keeps that shard in all of them.
+pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t shard_key;
+
+void CreateShardKey() {
+  CHECK_EQ(0, pthread_key_create(&shard_key, NULL));
+}
+
+GoogleString JsonDouble(double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.1f", value);
+  return buf;
+}
+
+}  // namespace
+
+struct NgxSharedMemStatistics::SegmentHeader {
+  // Incremented by each thread as it claims a shard.
+  base::subtle::Atomic32 next_shard;
+  char padding[kCacheLineBytes - sizeof(base::subtle::Atomic32)];
+};
+
+NgxSharedMemVariable::NgxSharedMemVariable(const StringPiece& name,
+                                           NgxSharedMemStatistics* statistics,
+                                           int index)
+    : name_(name.as_string()),
+      statistics_(statistics),
+      index_(index) {
+}
+
+NgxSharedMemVariable::~NgxSharedMemVariable() {
+}
+
+int64 NgxSharedMemVariable::Get() const {
+  if (statistics_->Slot(0, index_) == NULL) {
+    return -1;
+  }
+  int64 value = 0;
+  for (int i = 0; i < statistics_->num_shards_; ++i) {
+    value += base::subtle::NoBarrier_Load(statistics_->Slot(i, index_));
+  }
+  return value;
+}
+
+void NgxSharedMemVariable::Set(int64 new_value) {
+  if (statistics_->Slot(0, index_) == NULL) {
+    return;
+  }
+  base::subtle::NoBarrier_Store(statistics_->Slot(0, index_), new_value);
+  for (int i = 1; i < statistics_->num_shards_; ++i) {
+    base::subtle::NoBarrier_Store(statistics_->Slot(i, index_), 0);
+  }
+}
+
+int64 NgxSharedMemVariable::SetReturningPreviousValue(int64 new_value) {
+  if (statistics_->Slot(0, index_) == NULL) {
+    return -1;
+  }
+  // Variables used this way are only ever Set(), so all but the first shard
+  // are 0, and the exchange on the first shard is what decides which of
+  // several racing callers sees the old value.
+  int64 previous = base::subtle::NoBarrier_AtomicExchange(
+      statistics_->Slot(0, index_), new_value);
+  for (int i = 1; i < statistics_->num_shards_; ++i) {
+    previous += base::subtle::NoBarrier_AtomicExchange(
+        statistics_->Slot(i, index_), 0);
+  }
+  return previous;
+}
+
+int64 NgxSharedMemVariable::Add(int delta) {
+  volatile base::subtle::Atomic64* slot =
+      statistics_->Slot(statistics_->CurrentShard(), index_);
+  if (slot == NULL) {
+    return -1;
+  }
+  // Still atomic, as threads may share a shard.
+  int64 value = base::subtle::NoBarrier_AtomicIncrement(slot, delta);
+  if (statistics_->num_shards_ == 1) {
+    return value;
+  }
+  // Callers rely on getting the new total back.
+  return Get();
+}
+
+struct NgxSharedMemHistogram::Body {
+  base::subtle::Atomic64 sum;
+  base::subtle::Atomic64 max;
+  // kMaxValue - the minimum, so that the zeroed segment means "no minimum".
+  base::subtle::Atomic64 min_complement;
+  base::subtle::Atomic64 buckets[kMaxBuckets];
+};
+
+NgxSharedMemHistogram::NgxSharedMemHistogram()
+    : body_(NULL) {
+}
+
+NgxSharedMemHistogram::~NgxSharedMemHistogram() {
+}
+
+int NgxSharedMemHistogram::BucketIndex(int64 value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  // Keep the top kSubBucketBits - 1 bits below the leading one.
+  int shift = (63 - __builtin_clzll(value)) - (kSubBucketBits - 1);
+  return static_cast<int>(shift * (kSubBuckets / 2) + (value >> shift));
+}
+
+int64 NgxSharedMemHistogram::BucketLowerBound(int index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  int shift = index / (kSubBuckets / 2) - 1;
+  return (index % (kSubBuckets / 2) + kSubBuckets / 2) << shift;
+}
+
+void NgxSharedMemHistogram::Add(double value) {
+  if (body_ == NULL) {
+    return;
+  }
+  int64 rounded = 0;
+  if (value >= kMaxValue) {
+    rounded = kMaxValue;
+  } else if (value > 0) {
+    rounded = static_cast<int64>(value + 0.5);
+  }
+  base::subtle::NoBarrier_AtomicIncrement(&body_->buckets[BucketIndex(rounded)],
+                                          1);
+  base::subtle::NoBarrier_AtomicIncrement(&body_->sum, rounded);
+  AtomicMax(&body_->max, rounded);
+  AtomicMax(&body_->min_complement, kMaxValue - rounded);
+}
+
+void NgxSharedMemHistogram::Clear() {
+  if (body_ == NULL) {
+    return;
+  }
+  base::subtle::NoBarrier_Store(&body_->sum, 0);
+  base::subtle::NoBarrier_Store(&body_->max, 0);
+  base::subtle::NoBarrier_Store(&body_->min_complement, 0);
+  for (int i = 0; i < kMaxBuckets; ++i) {
+    base::subtle::NoBarrier_Store(&body_->buckets[i], 0);
+  }
+}
+
+int NgxSharedMemHistogram::NumBuckets() {
+  if (body_ == NULL) {
+    return 0;
+  }
+  for (int i = kMaxBuckets - 1; i >= 0; --i) {
+    if (base::subtle::NoBarrier_Load(&body_->buckets[i]) != 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+double NgxSharedMemHistogram::BucketStart(int index) {
+  return BucketLowerBound(index);
+}
+
+double NgxSharedMemHistogram::BucketCount(int index) {
+  if (body_ == NULL || index < 0 || index >= kMaxBuckets) {
+    return 0;
+  }
+  return base::subtle::NoBarrier_Load(&body_->buckets[index]);
+}
+
+double NgxSharedMemHistogram::CountInternal() {
+  double count = 0;
+  for (int i = 0, n = NumBuckets(); i < n; ++i) {
+    count += BucketCount(i);
+  }
+  return count;
+}
+
+double NgxSharedMemHistogram::AverageInternal() {
+  double count = CountInternal();
+  if (count == 0) {
+    return 0;
+  }
+  return base::subtle::NoBarrier_Load(&body_->sum) / count;
+}
+
+double NgxSharedMemHistogram::StandardDeviationInternal() {
+  // From the bucket midpoints, as the buckets are narrow enough that the
+  // error is small next to the spread.
+  double count = CountInternal();
+  if (count == 0) {
+    return 0;
+  }
+  double average = AverageInternal();
+  double sum_of_squares = 0;
+  for (int i = 0, n = NumBuckets(); i < n; ++i) {
+    double midpoint = (BucketLowerBound(i) + BucketLowerBound(i + 1) - 1) / 2.0;
+    sum_of_squares += BucketCount(i) * (midpoint - average) *
+        (midpoint - average);
+  }
+  return sqrt(sum_of_squares / count);
+}
+
+double NgxSharedMemHistogram::MaximumInternal() {
+  if (body_ == NULL) {
+    return 0;
+  }
+  return base::subtle::NoBarrier_Load(&body_->max);
+}
+
+double NgxSharedMemHistogram::MinimumInternal() {
+  if (body_ == NULL || CountInternal() == 0) {
+    return 0;
+  }
+  return kMaxValue - base::subtle::NoBarrier_Load(&body_->min_complement);
+}
+
+double NgxSharedMemHistogram::PercentileInternal(const double perc) {
+  double count = CountInternal();
+  if (count == 0) {
+    return 0;
+  }
+  // Interpolate within the bucket holding the perc'th value, then keep the
+  // result within what was actually seen.
+  double target = count * perc / 100;
+  double below = 0;
+  double result = MaximumInternal();
+  for (int i = 0, n = NumBuckets(); i < n; ++i) {
+    double in_bucket = BucketCount(i);
+    if (in_bucket > 0 && below + in_bucket >= target) {
+      double start = BucketLowerBound(i);
+      double width = BucketLowerBound(i + 1) - start;
+      result = start + width * (target - below) / in_bucket;
+      break;
+    }
+    below += in_bucket;
+  }
+  return std::max(MinimumInternal(), std::min(MaximumInternal(), result));
+}
+
+NgxSharedMemStatistics::NgxSharedMemStatistics(
+    int64 logging_interval_ms, const StringPiece& logging_file, bool logging,
+    const GoogleString& filename_prefix, AbstractSharedMem* shm_runtime,
+    MessageHandler* message_handler, FileSystem* file_system, Timer* timer,
+    int num_shards)
+    : shm_runtime_(shm_runtime),
+      segment_name_(StrCat(filename_prefix, kSegmentName)),
+      num_shards_(std::max(num_shards, 1)),
+      shard_bytes_(0),
+      shards_(NULL),
+      lock_free_(!logging),
+      shm_statistics_(new SharedMemStatistics(
+          logging_interval_ms, logging_file, logging, filename_prefix,
+          shm_runtime, message_handler, file_system, timer)) {
+  if (num_shards_ > 1) {
+    pthread_once(&shard_key_once, CreateShardKey);
+  }
+}
+
+NgxSharedMemStatistics::~NgxSharedMemStatistics() {
+  STLDeleteElements(&variables_);
+  STLDeleteElements(&histograms_);
+}
+
+size_t NgxSharedMemStatistics::SegmentSize() const {
+  return sizeof(SegmentHeader) + num_shards_ * shard_bytes_ +
+      histograms_.size() * RoundUpToCacheLine(
+          sizeof(NgxSharedMemHistogram::Body));
+}
+
+NgxSharedMemStatistics::SegmentHeader* NgxSharedMemStatistics::header()
+    const {
+  return reinterpret_cast<SegmentHeader*>(const_cast<char*>(
+      segment_->Base()));
+}
+
+int NgxSharedMemStatistics::CurrentShard() {
+  if (num_shards_ == 1 || shards_ == NULL) {
+    return 0;
+  }
+  intptr_t shard_plus_one =
+      reinterpret_cast<intptr_t>(pthread_getspecific(shard_key));
+  if (shard_plus_one == 0) {
+    base::subtle::Atomic32 claimed = base::subtle::NoBarrier_AtomicIncrement(
+        &header()->next_shard, 1) - 1;
+    shard_plus_one = static_cast<uint32>(claimed) % num_shards_ + 1;
+    pthread_setspecific(shard_key, reinterpret_cast<void*>(shard_plus_one));
+  }
+  // In case another statistics object has fewer shards.
+  return (shard_plus_one - 1) % num_shards_;
+}
+
+void NgxSharedMemStatistics::Init(bool parent,
+                                  MessageHandler* message_handler) {
+  shm_statistics_->Init(parent, message_handler);
+  if (variables_.empty() && histograms_.empty()) {
+    return;
+  }
+
+  shard_bytes_ = RoundUpToCacheLine(
+      variables_.size() * sizeof(base::subtle::Atomic64));
+  if (parent) {
+    // CreateSegment zeroes the memory, so all variables start at 0.
+    segment_.reset(shm_runtime_->CreateSegment(segment_name_, SegmentSize(),
+                                               message_handler));
+  } else {
+    segment_.reset(shm_runtime_->AttachToSegment(segment_name_, SegmentSize(),
+                                                 message_handler));
+  }
+  if (segment_.get() == NULL) {
+    message_handler->Message(
+        kError, "Unable to %s statistics segment %s; variables will read -1",
+        parent ? "create" : "attach to", segment_name_.c_str());
+    shards_ = NULL;
+    for (int i = 0, n = histograms_.size(); i < n; ++i) {
+      histograms_[i]->body_ = NULL;
+    }
+    return;
+  }
+  shards_ = segment_->Base() + sizeof(SegmentHeader);
+  volatile char* histogram_base = shards_ + num_shards_ * shard_bytes_;
+  for (int i = 0, n = histograms_.size(); i < n; ++i) {
+    histograms_[i]->body_ = reinterpret_cast<NgxSharedMemHistogram::Body*>(
+        const_cast<char*>(histogram_base + i * RoundUpToCacheLine(
+            sizeof(NgxSharedMemHistogram::Body))));
+  }
+  if (num_shards_ > 1) {
+    // A forked child inherits the shard its parent's thread claimed; have
+    // it claim its own.
+    pthread_setspecific(shard_key, NULL);
+  }
+}
+
+void NgxSharedMemStatistics::GlobalCleanup(MessageHandler* message_handler) {
+  shm_statistics_->GlobalCleanup(message_handler);
+  if (segment_.get() != NULL) {
+    shm_runtime_->DestroySegment(segment_name_, message_handler);
+  }
+}
+
+Variable* NgxSharedMemStatistics::AddVariable(const StringPiece& name) {
+  if (!lock_free_) {
+    return shm_statistics_->AddVariable(name);
+  }
+  Variable* var = FindVariable(name);
+  if (var == NULL) {
+    // Variables are laid out in the segment in the order they are added, so
+    // they must all be added before Init(), as with SharedMemStatistics.
+    DCHECK(segment_.get() == NULL);
+    NgxSharedMemVariable* new_var =
+        new NgxSharedMemVariable(name, this, variables_.size());
+    variables_.push_back(new_var);
+    variable_map_[new_var->name_] = new_var;
+    var = new_var;
+  }
+  return var;
+}
+
+Variable* NgxSharedMemStatistics::FindVariable(const StringPiece& name) const {
+  if (!lock_free_) {
+    return shm_statistics_->FindVariable(name);
+  }
+  VariableMap::const_iterator p = variable_map_.find(name.as_string());
+  return p == variable_map_.end() ? NULL : p->second;
+}
+
+Histogram* NgxSharedMemStatistics::AddHistogram(const StringPiece& name) {
+  if (!lock_free_) {
+    return shm_statistics_->AddHistogram(name);
+  }
+  Histogram* hist = FindHistogram(name);
+  if (hist == NULL) {
+    DCHECK(segment_.get() == NULL);
+    NgxSharedMemHistogram* new_hist = new NgxSharedMemHistogram;
+    histograms_.push_back(new_hist);
+    histogram_names_.push_back(name.as_string());
+    histogram_map_[name.as_string()] = new_hist;
+    hist = new_hist;
+  }
+  return hist;
+}
+
+Histogram* NgxSharedMemStatistics::FindHistogram(
+    const StringPiece& name) const {
+  if (!lock_free_) {
+    return shm_statistics_->FindHistogram(name);
+  }
+  HistogramMap::const_iterator p = histogram_map_.find(name.as_string());
+  return p == histogram_map_.end() ? NULL : p->second;
+}
+
+TimedVariable* NgxSharedMemStatistics::AddTimedVariable(
+    const StringPiece& name, const StringPiece& group) {
+  return shm_statistics_->AddTimedVariable(name, group);
+}
+
+TimedVariable* NgxSharedMemStatistics::FindTimedVariable(
+    const StringPiece& name) const {
+  return shm_statistics_->FindTimedVariable(name);
+}
+
+const StringVector& NgxSharedMemStatistics::HistogramNames() {
+  if (!lock_free_) {
+    return shm_statistics_->HistogramNames();
+  }
+  return histogram_names_;
+}
+
+const std::map<GoogleString, StringVector>&
+NgxSharedMemStatistics::TimedVariableMap() {
+  return shm_statistics_->TimedVariableMap();
+}
+
+void NgxSharedMemStatistics::Dump(Writer* writer,
+                                  MessageHandler* message_handler) {
+  // Same layout as StatisticsTemplate::Dump: names left, values right.
+  std::vector<GoogleString> values(variables_.size());
+  size_t longest_string = 0;
+  for (int i = 0, n = variables_.size(); i < n; ++i) {
+    values[i] = Integer64ToString(variables_[i]->Get());
+    longest_string = std::max(longest_string,
+                              variables_[i]->name_.size() + values[i].size());
+  }
+  GoogleString line;
+  for (int i = 0, n = variables_.size(); i < n; ++i) {
+    const GoogleString& name = variables_[i]->name_;
+    line = StrCat(name, ": ");
+    line.append(longest_string - name.size() - values[i].size(), ' ');
+    StrAppend(&line, values[i], "\n");
+    writer->Write(line, message_handler);
+  }
+  // Timed variables, and all variables when logging.
+  shm_statistics_->Dump(writer, message_handler);
+}
+
+void NgxSharedMemStatistics::DumpConsoleVarsToWriter(
+    int64 current_time_ms, Writer* writer, MessageHandler* message_handler) {
+  shm_statistics_->DumpConsoleVarsToWriter(current_time_ms, writer,
+                                           message_handler);
+}
+
+void NgxSharedMemStatistics::Clear() {
+  for (int i = 0, n = variables_.size(); i < n; ++i) {
+    variables_[i]->Clear();
+  }
+  for (int i = 0, n = histograms_.size(); i < n; ++i) {
+    histograms_[i]->Clear();
+  }
+  shm_statistics_->Clear();
+}
+
+ConsoleStatisticsLogger* NgxSharedMemStatistics::console_logger() {
+  return shm_statistics_->console_logger();
+}
+
+void NgxSharedMemStatistics::PrintHistogramsJson(Statistics* statistics,
+                                                 GoogleString* out) {
+  static const double kPercentiles[] = { 50, 90, 99, 99.9 };
+  static const char* const kPercentileNames[] = {
+    "p50", "p90", "p99", "p999"
+  };
+  const StringVector& names = statistics->HistogramNames();
+  out->append("{");
+  for (int i = 0, n = names.size(); i < n; ++i) {
+    Histogram* histogram = statistics->FindHistogram(names[i]);
+    StrAppend(out, i == 0 ? "" : ",", "\n  \"", names[i], "\": {");
+    StrAppend(out, "\"count\": ", JsonDouble(histogram->Count()),
+              ", \"mean\": ", JsonDouble(histogram->Average()));
+    StrAppend(out, ", \"min\": ", JsonDouble(histogram->Minimum()),
+              ", \"max\": ", JsonDouble(histogram->Maximum()));
+    for (int j = 0, m = arraysize(kPercentiles); j < m; ++j) {
+      StrAppend(out, ", \"", kPercentileNames[j], "\": ",
+                JsonDouble(histogram->Percentile(kPercentiles[j])));
+    }
+    // [start, limit, count] for each bucket that has any values.
+    out->append(", \"buckets\": [");
+    const char* separator = "";
+    for (int j = 0, m = histogram->NumBuckets(); j < m; ++j) {
+      double count = histogram->BucketCount(j);
+      if (count == 0) {
+        continue;
+      }
+      StrAppend(out, separator, "[", JsonDouble(histogram->BucketStart(j)),
+                ", ", JsonDouble(histogram->BucketLimit(j)));
+      StrAppend(out, ", ", JsonDouble(count), "]");
+      separator = ", ";
+    }
+    out->append("]}");
+  }
+  out->append("\n}\n");
+}
+
+}  // namespace net_instaweb
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Shared memory statistics whose variables are updated without locking.
+//
+// SharedMemVariable takes a process-shared mutex around every read and
+// write, and the rewrite and cache statistics touch several variables per
+// request from every worker and rewrite thread.  Here each variable is a
+// 64-bit slot in a segment of its own, updated with atomic instructions.
+// Histograms are log-linear, see NgxSharedMemHistogram, with buckets in the
+// same segment, likewise updated atomically.  Timed variables still come
+// from a SharedMemStatistics, with its locking.
+//
+// The console logger dumps variables and histograms from inside
+// SharedMemStatistics, so when statistics logging is on all of them are left
+// to SharedMemStatistics.
+//
+// Even without a lock, every thread adding to the same slot bounces its
+// cache line between CPUs.  With more than one shard, each thread of each
+// process claims a shard on first use, and has a private, cache line aligned
+// copy of every variable there.  Get() sums the shards.  Threads only share
+// a shard once there are more threads than shards, which costs contention
+// but not accuracy.
+
+#ifndef NGX_SHARED_MEM_STATISTICS_H_
+#define NGX_SHARED_MEM_STATISTICS_H_
+
+#include <map>
+#include <vector>
+
+#include "base/atomicops.h"
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/null_mutex.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
+
+namespace net_instaweb {
+
+class AbstractSharedMem;
+class AbstractSharedMemSegment;
+class FileSystem;
+class MessageHandler;
+class NgxSharedMemStatistics;
+class SharedMemStatistics;
+class Timer;
+class Writer;
+
+class NgxSharedMemVariable : public Variable {
+ public:
+  virtual ~NgxSharedMemVariable();
+  // Like SharedMemVariable, reads as -1 and ignores writes if we could not
+  // attach to the segment.
+  virtual int64 Get() const;
+  // Set() overwrites all shards, so it should not race with Add().
+  virtual void Set(int64 new_value);
+  virtual int64 SetReturningPreviousValue(int64 new_value);
+  // With several shards, reads every shard to return the new total, but only
+  // writes the calling thread's.
+  virtual int64 Add(int delta);
+  virtual StringPiece GetName() const { return name_; }
+
+ private:
+  friend class NgxSharedMemStatistics;
+
+  NgxSharedMemVariable(const StringPiece& name,
+                       NgxSharedMemStatistics* statistics, int index);
+
+  const GoogleString name_;
+  NgxSharedMemStatistics* statistics_;
+  const int index_;  // Offset within each shard.
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedMemVariable);
+};
+
+// A histogram with HdrHistogram-style log-linear buckets: values below
+// kSubBuckets each have a bucket of their own, and every power of two above
+// that is split into kSubBuckets / 2 equal buckets, so a bucket is never
+// wider than 1/32 of its lower bound.  That keeps tail percentiles accurate
+// from a few microseconds up to hours without any configured range, so
+// SetMinValue(), SetMaxValue() and SetSuggestedNumBuckets() are ignored.
+//
+// Values are rounded to integers, and clamped to [0, kMaxValue].
+//
+// Add() only does atomic operations on the shared buckets.  Readers sum the
+// buckets without locking, so a reading taken during an Add() may be off by
+// that one value.
+class NgxSharedMemHistogram : public Histogram {
+ public:
+  static const int kSubBucketBits = 6;
+  static const int64 kSubBuckets = 1 << kSubBucketBits;
+  static const int kMaxValueBits = 36;
+  static const int64 kMaxValue = (static_cast<int64>(1) << kMaxValueBits) - 1;
+  static const int kMaxBuckets =
+      (kMaxValueBits - kSubBucketBits + 1) * (kSubBuckets / 2) +
+      kSubBuckets / 2;
+
+  virtual ~NgxSharedMemHistogram();
+  virtual void Add(double value);
+  virtual void Clear();
+  // Up to the highest non-empty bucket, so that rendering skips the tail.
+  virtual int NumBuckets();
+  virtual void EnableNegativeBuckets() {}
+  virtual void SetMinValue(double value) {}
+  virtual void SetMaxValue(double value) {}
+  virtual void SetSuggestedNumBuckets(int i) {}
+  virtual double BucketStart(int index);
+  virtual double BucketCount(int index);
+
+ protected:
+  virtual AbstractMutex* lock() { return &mutex_; }
+  virtual double AverageInternal();
+  virtual double PercentileInternal(const double perc);
+  virtual double StandardDeviationInternal();
+  virtual double CountInternal();
+  virtual double MaximumInternal();
+  virtual double MinimumInternal();
+
+ private:
+  friend class NgxSharedMemStatistics;
+
+  struct Body;
+
+  NgxSharedMemHistogram();
+
+  static int BucketIndex(int64 value);
+  static int64 BucketLowerBound(int index);
+
+  // Points into the segment; NULL until attached.
+  Body* body_;
+  NullMutex mutex_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedMemHistogram);
+};
+
+class NgxSharedMemStatistics : public Statistics {
+ public:
+  // Shards used by "pagespeed ShardedStatistics on".
+  static const int kDefaultNumShards = 64;
+
+  // Arguments other than num_shards are as for SharedMemStatistics.
+  NgxSharedMemStatistics(int64 logging_interval_ms,
+                         const StringPiece& logging_file, bool logging,
+                         const GoogleString& filename_prefix,
+                         AbstractSharedMem* shm_runtime,
+                         MessageHandler* message_handler,
+                         FileSystem* file_system, Timer* timer,
+                         int num_shards);
+  virtual ~NgxSharedMemStatistics();
+
+  // As SharedMemStatistics::Init: call once per process after all variables
+  // and histograms are added, with parent = true in the root process first.
+  void Init(bool parent, MessageHandler* message_handler);
+  void GlobalCleanup(MessageHandler* message_handler);
+
+  virtual Variable* AddVariable(const StringPiece& name);
+  virtual Variable* FindVariable(const StringPiece& name) const;
+  virtual Histogram* AddHistogram(const StringPiece& name);
+  virtual Histogram* FindHistogram(const StringPiece& name) const;
+  virtual TimedVariable* AddTimedVariable(const StringPiece& name,
+                                          const StringPiece& group);
+  virtual TimedVariable* FindTimedVariable(const StringPiece& name) const;
+  virtual const StringVector& HistogramNames();
+  virtual const std::map<GoogleString, StringVector>& TimedVariableMap();
+  virtual void Dump(Writer* writer, MessageHandler* message_handler);
+  virtual void DumpConsoleVarsToWriter(int64 current_time_ms, Writer* writer,
+                                       MessageHandler* message_handler);
+  virtual void Clear();
+  virtual ConsoleStatisticsLogger* console_logger();
+
+  // Appends count, mean, min, max, p50, p90, p99, p999 and the non-empty
+  // buckets of each histogram as a JSON object keyed by name.  Works on any
+  // Statistics, though only ours have fine enough buckets for the tail.
+  static void PrintHistogramsJson(Statistics* statistics, GoogleString* out);
+
+ private:
+  friend class NgxSharedMemVariable;
+
+  struct SegmentHeader;
+  typedef std::map<GoogleString, NgxSharedMemVariable*> VariableMap;
+  typedef std::map<GoogleString, NgxSharedMemHistogram*> HistogramMap;
+
+  size_t SegmentSize() const;
+  SegmentHeader* header() const;
+  // The calling thread's shard, claiming one on first use.
+  int CurrentShard();
+  // NULL if we could not attach to the segment.
+  volatile base::subtle::Atomic64* Slot(int shard, int index) const {
+    if (shards_ == NULL) {
+      return NULL;
+    }
+    return reinterpret_cast<volatile base::subtle::Atomic64*>(
+        shards_ + shard * shard_bytes_) + index;
+  }
+
+  AbstractSharedMem* shm_runtime_;
+  const GoogleString segment_name_;
+  const int num_shards_;
+  size_t shard_bytes_;
+  volatile char* shards_;
+  // Variables and histograms come from shm_statistics_ instead when false.
+  const bool lock_free_;
+  scoped_ptr<SharedMemStatistics> shm_statistics_;
+  scoped_ptr<AbstractSharedMemSegment> segment_;
+  std::vector<NgxSharedMemVariable*> variables_;  // In segment order.
+  VariableMap variable_map_;
+  std::vector<NgxSharedMemHistogram*> histograms_;  // In segment order.
+  StringVector histogram_names_;
+  HistogramMap histogram_map_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxSharedMemStatistics);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_SHARED_MEM_STATISTICS_H_
@@ -18,19 +18,208 @@
 
 #include "ngx_thread_system.h"
 
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
 #include "apr_thread_proc.h"
+#include "base/logging.h"
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/thread.h"
 
 namespace net_instaweb {
 
 class Timer;
 
-NgxThreadSystem::NgxThreadSystem() : may_start_threads_(false) {}
+namespace {
+
+// Linux keeps this much of a thread's name, including the terminating NUL.
+const size_t kThreadNameSize = 16;
+
+// Parses a list like "0-3,8,10-11" into cpus.  False if it is malformed,
+// empty or names CPUs we can't represent.
+bool ParseCpuList(const StringPiece& list, cpu_set_t* cpus) {
+  CPU_ZERO(cpus);
+  StringPieceVector ranges;
+  SplitStringPieceToVector(list, ",", &ranges, true);
+  for (int i = 0, n = ranges.size(); i < n; ++i) {
+    StringPiece range = ranges[i];
+    TrimWhitespace(&range);
+    StringPiece first = range;
+    StringPiece last = range;
+    size_t dash = range.find('-');
+    if (dash != StringPiece::npos) {
+      first = range.substr(0, dash);
+      last = range.substr(dash + 1);
+    }
+    int from, to;
+    if (!StringToInt(first.as_string(), &from) ||
+        !StringToInt(last.as_string(), &to) ||
+        from < 0 || to < from || to >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu = from; cpu <= to; ++cpu) {
+      CPU_SET(cpu, cpus);
+    }
+  }
+  return CPU_COUNT(cpus) > 0;
+}
+
+// Adds the hyperthreads sharing a core with cpu, cpu included.
+void AddThreadSiblings(int cpu, cpu_set_t* cpus) {
+  char path[128];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  FILE* file = fopen(path, "r");
+  if (file == NULL) {
+    return;
+  }
+  char buf[256];
+  if (fgets(buf, sizeof(buf), file) != NULL) {
+    cpu_set_t siblings;
+    if (ParseCpuList(buf, &siblings)) {
+      CPU_OR(cpus, cpus, &siblings);
+    }
+  }
+  fclose(file);
+}
+
+pid_t CurrentThreadId() {
+  return syscall(SYS_gettid);
+}
+
+}  // namespace
+
+// Like PthreadThreadSystem's threads, but also tells the OS the thread's
+// name before BeforeThreadRunHook(), which places the thread by it.
+class NgxThreadSystem::NgxThreadImpl : public ThreadSystem::ThreadImpl {
+ public:
+  NgxThreadImpl(NgxThreadSystem* thread_system, Thread* wrapper,
+                ThreadFlags flags)
+      : thread_system_(thread_system),
+        wrapper_(wrapper),
+        flags_(flags) {
+  }
+
+  virtual ~NgxThreadImpl() {}
+
+  virtual bool StartImpl() {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (flags_ == ThreadSystem::kDetached) {
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    }
+    int result = pthread_create(&thread_, &attr, InvokeRun, this);
+    pthread_attr_destroy(&attr);
+    return (result == 0);
+  }
+
+  virtual void JoinImpl() {
+    void* ignored;
+    pthread_join(thread_, &ignored);
+  }
+
+ private:
+  static void* InvokeRun(void* self_ptr) {
+    NgxThreadImpl* self = static_cast<NgxThreadImpl*>(self_ptr);
+    GoogleString name = self->wrapper_->name().substr(0, kThreadNameSize - 1);
+    prctl(PR_SET_NAME, name.c_str(), 0, 0, 0);
+    self->thread_system_->BeforeThreadRunHook();
+    // Run() may delete the wrapper, and us with it.
+    self->wrapper_->Run();
+    return NULL;
+  }
+
+  NgxThreadSystem* thread_system_;
+  Thread* wrapper_;
+  ThreadFlags flags_;
+  pthread_t thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxThreadImpl);
+};
+
+NgxThreadSystem::NgxThreadSystem()
+    : may_start_threads_(false),
+      affinity_mode_(kAffinityOff),
+      have_thread_cpus_(false),
+      low_priority_nice_(0),
+      base_nice_(0),
+      prefix_mutex_(NewMutex()) {
+  CPU_ZERO(&thread_cpus_);
+}
 
 NgxThreadSystem::~NgxThreadSystem() {}
 
+bool NgxThreadSystem::SetCpuAffinity(const StringPiece& spec) {
+  if (StringCaseEqual(spec, "off")) {
+    affinity_mode_ = kAffinityOff;
+  } else if (StringCaseEqual(spec, "siblings")) {
+    affinity_mode_ = kAffinitySiblings;
+  } else if (ParseCpuList(spec, &thread_cpus_)) {
+    affinity_mode_ = kAffinityCpuList;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 void NgxThreadSystem::PermitThreadStarting() {
   CHECK(!may_start_threads_);
   may_start_threads_ = true;
+
+  // We're on the worker's main thread, which nginx has already moved to its
+  // worker_cpu_affinity CPUs and worker_priority.
+  errno = 0;
+  int nice = getpriority(PRIO_PROCESS, CurrentThreadId());
+  if (errno == 0) {
+    base_nice_ = nice;
+  }
+  switch (affinity_mode_) {
+    case kAffinityOff:
+      break;
+    case kAffinityCpuList:
+      have_thread_cpus_ = true;
+      break;
+    case kAffinitySiblings: {
+      cpu_set_t worker_cpus;
+      if (sched_getaffinity(0, sizeof(worker_cpus), &worker_cpus) != 0) {
+        break;
+      }
+      CPU_ZERO(&thread_cpus_);
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &worker_cpus)) {
+          AddThreadSiblings(cpu, &thread_cpus_);
+        }
+      }
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &worker_cpus)) {
+          CPU_CLR(cpu, &thread_cpus_);
+        }
+      }
+      // Without hyperthreading, or an unpinned worker, there's nowhere
+      // better to go.
+      have_thread_cpus_ = (CPU_COUNT(&thread_cpus_) > 0);
+      break;
+    }
+  }
+}
+
+void NgxThreadSystem::set_low_priority_thread_prefix(
+    const StringPiece& prefix) {
+  ScopedMutex lock(prefix_mutex_.get());
+  prefix.CopyToString(&low_priority_thread_prefix_);
+}
+
+ThreadSystem::ThreadImpl* NgxThreadSystem::NewThreadImpl(
+    Thread* wrapper, ThreadFlags flags) {
+  return new NgxThreadImpl(this, wrapper, flags);
 }
 
 void NgxThreadSystem::BeforeThreadRunHook() {
@@ -41,6 +230,36 @@ void NgxThreadSystem::BeforeThreadRunHook() {
   // If this fails you can get a backtrace from gdb by setting a breakpoint on
   // "pthread_create".
   CHECK(may_start_threads_);
+
+  pid_t tid = CurrentThreadId();
+  if (have_thread_cpus_) {
+    sched_setaffinity(tid, sizeof(thread_cpus_), &thread_cpus_);
+  }
+
+  if (low_priority_nice_ == 0) {
+    return;
+  }
+  char name[kThreadNameSize] = "";
+  prctl(PR_GET_NAME, name, 0, 0, 0);
+  bool low_priority;
+  {
+    ScopedMutex lock(prefix_mutex_.get());
+    StringPiece prefix(low_priority_thread_prefix_.data(),
+                       std::min(low_priority_thread_prefix_.size(),
+                                kThreadNameSize - 1));
+    low_priority = !prefix.empty() && StringPiece(name).starts_with(prefix);
+  }
+  // Threads inherit their creator's nice value, and any thread may start a
+  // worker for any pool, so set it either way.  Going back down to base_nice_
+  // needs CAP_SYS_NICE or a high enough RLIMIT_NICE, which a worker running
+  // as an unprivileged user usually lacks; then a thread started from a
+  // low-priority one stays at the low priority.
+  int nice = std::min(base_nice_ + (low_priority ? low_priority_nice_ : 0),
+                      19);
+  if (setpriority(PRIO_PROCESS, tid, nice) != 0) {
+    LOG(WARNING) << "Could not set the nice value of thread " << name
+                 << " to " << nice << ": " << strerror(errno);
+  }
 }
 
 }  // namespace net_instaweb
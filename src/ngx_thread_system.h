@@ -23,12 +23,18 @@
 #ifndef NGX_THREAD_SYSTEM_H_
 #define NGX_THREAD_SYSTEM_H_
 
+#include <sched.h>
+
 #include "base/logging.h"
 #include "net/instaweb/util/public/basictypes.h"
 #include "net/instaweb/util/public/pthread_thread_system.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/string.h"
+#include "net/instaweb/util/public/string_util.h"
 
 namespace net_instaweb {
 
+class AbstractMutex;
 class Timer;
 
 class NgxThreadSystem : public PthreadThreadSystem {
@@ -42,11 +48,55 @@ class NgxThreadSystem : public PthreadThreadSystem {
   // before then.
   void PermitThreadStarting();
 
+  // Where pagespeed threads run, for "pagespeed ThreadCpuAffinity":
+  //  - "off" leaves them on the CPUs of their worker, from
+  //    worker_cpu_affinity,
+  //  - "siblings" moves them to the other hyperthreads of those CPUs' cores,
+  //    or leaves them be if there are none,
+  //  - a CPU list like "2-3,6" puts them there.
+  // Returns false if spec is none of these.  Must be called before
+  // PermitThreadStarting().
+  bool SetCpuAffinity(const StringPiece& spec);
+
+  // Threads whose names start with prefix run this much nicer than their
+  // worker process, for the low-priority rewrite pool.  The pool is created,
+  // and names itself, on first use, while other threads may be starting.
+  //
+  // Rewrite() runs on that pool even when an HTML response is waiting on it,
+  // so on a busy machine this slows HTML down as well as resources.  Also,
+  // unless the worker may lower nice values (CAP_SYS_NICE or RLIMIT_NICE),
+  // a thread that a low-priority thread happens to start inherits its nice
+  // value and can't be put back; BeforeThreadRunHook() logs when that
+  // happens.
+  void set_low_priority_nice(int x) { low_priority_nice_ = x; }
+  void set_low_priority_thread_prefix(const StringPiece& prefix);
+
  protected:
+  // Runs in each new thread.  Our own NgxThreadImpl starts the threads, so
+  // that by now the OS knows the thread by its name.
   virtual void BeforeThreadRunHook();
 
  private:
+  class NgxThreadImpl;
+  enum AffinityMode {
+    kAffinityOff,
+    kAffinitySiblings,
+    kAffinityCpuList,
+  };
+
+  virtual ThreadImpl* NewThreadImpl(Thread* wrapper, ThreadFlags flags);
+
   bool may_start_threads_;
+  AffinityMode affinity_mode_;
+  // The CPUs for kAffinityCpuList; for kAffinitySiblings, filled in by
+  // PermitThreadStarting() once the worker is on its own CPUs.
+  cpu_set_t thread_cpus_;
+  bool have_thread_cpus_;
+  int low_priority_nice_;
+  // The worker's nice value, which other threads are kept at.
+  int base_nice_;
+  scoped_ptr<AbstractMutex> prefix_mutex_;
+  GoogleString low_priority_thread_prefix_;  // Guarded by prefix_mutex_.
 
   DISALLOW_COPY_AND_ASSIGN(NgxThreadSystem);
 };
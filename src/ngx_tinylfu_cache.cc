@@ -0,0 +1,222 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ngx_tinylfu_cache.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "net/instaweb/util/public/abstract_mutex.h"
+#include "net/instaweb/util/public/cache_stats.h"
+#include "net/instaweb/util/public/statistics.h"
+#include "net/instaweb/util/public/stl_util.h"
+#include "net/instaweb/util/public/thread_system.h"
+
+namespace net_instaweb {
+
+namespace {
+
+const char kTinyLfuAdmissions[] = "ngx_tinylfu_admissions";
+const char kTinyLfuRejections[] = "ngx_tinylfu_rejections";
+
+// The window gets 1% of the space, as in Caffeine.
+const size_t kWindowPercent = 1;
+
+// The sketch has one set of counters per kBytesPerCounter bytes of cache,
+// which is in the ballpark of a metadata cache entry.
+const size_t kBytesPerCounter = 512;
+const size_t kMinCounters = 1 << 10;
+const size_t kMaxCounters = 1 << 22;
+const int kSketchDepth = 4;
+const uint8 kMaxCount = 15;
+
+// Counters are halved after this many accesses per counter slot.
+const int kSamplesPerCounter = 10;
+
+}  // namespace
+
+const char NgxTinyLfuCache::kStatsPrefix[] = "ngx_tinylfu_cache";
+
+NgxTinyLfuCache::NgxTinyLfuCache(size_t max_bytes,
+                                 ThreadSystem* thread_system,
+                                 Statistics* statistics)
+    : window_limit_(std::max(static_cast<size_t>(1),
+                             max_bytes * kWindowPercent / 100)),
+      main_limit_(max_bytes - std::min(max_bytes, window_limit_)),
+      mutex_(thread_system->NewMutex()),
+      window_bytes_(0),
+      main_bytes_(0),
+      samples_(0),
+      admissions_(statistics->GetVariable(kTinyLfuAdmissions)),
+      rejections_(statistics->GetVariable(kTinyLfuRejections)) {
+  size_t counters = kMinCounters;
+  while (counters < kMaxCounters && counters * kBytesPerCounter < max_bytes) {
+    counters <<= 1;
+  }
+  sketch_.resize(counters, 0);
+  sketch_mask_ = counters - 1;
+  sample_limit_ = static_cast<int>(counters) * kSamplesPerCounter;
+}
+
+NgxTinyLfuCache::~NgxTinyLfuCache() {
+  STLDeleteElements(&window_);
+  STLDeleteElements(&main_);
+}
+
+void NgxTinyLfuCache::InitStats(Statistics* statistics) {
+  statistics->AddVariable(kTinyLfuAdmissions);
+  statistics->AddVariable(kTinyLfuRejections);
+  CacheStats::InitStats(kStatsPrefix, statistics);
+}
+
+// FNV-1a; split into two halves below for double hashing.
+uint64 NgxTinyLfuCache::KeyHash(const StringPiece& key) {
+  uint64 h = 14695981039346656037ULL;
+  for (int i = 0, n = key.size(); i < n; ++i) {
+    h = (h ^ static_cast<unsigned char>(key[i])) * 1099511628211ULL;
+  }
+  return h;
+}
+
+void NgxTinyLfuCache::RecordAccess(uint64 hash) {
+  uint64 step = (hash >> 32) | 1;
+  for (int i = 0; i < kSketchDepth; ++i) {
+    uint8& count = sketch_[(hash + i * step) & sketch_mask_];
+    if (count < kMaxCount) {
+      ++count;
+    }
+  }
+  if (++samples_ >= sample_limit_) {
+    samples_ = 0;
+    for (size_t i = 0, n = sketch_.size(); i < n; ++i) {
+      sketch_[i] >>= 1;
+    }
+  }
+}
+
+int NgxTinyLfuCache::Frequency(uint64 hash) const {
+  uint64 step = (hash >> 32) | 1;
+  int result = kMaxCount;
+  for (int i = 0; i < kSketchDepth; ++i) {
+    int count = sketch_[(hash + i * step) & sketch_mask_];
+    result = std::min(result, count);
+  }
+  return result;
+}
+
+size_t NgxTinyLfuCache::EntrySize(const Entry* entry) const {
+  return entry->key->size() + entry->value.size();
+}
+
+void NgxTinyLfuCache::Get(const GoogleString& key, Callback* callback) {
+  KeyState key_state = kNotFound;
+  {
+    ScopedMutex lock(mutex_.get());
+    RecordAccess(KeyHash(key));
+    Map::iterator p = map_.find(key);
+    if (p != map_.end()) {
+      ListNode node = p->second;
+      Entry* entry = *node;
+      EntryList* list = entry->in_main ? &main_ : &window_;
+      list->splice(list->begin(), *list, node);
+      *callback->value() = entry->value;
+      key_state = kAvailable;
+    }
+  }
+  ValidateAndReportResult(key, key_state, callback);
+}
+
+void NgxTinyLfuCache::Put(const GoogleString& key, SharedString* value) {
+  ScopedMutex lock(mutex_.get());
+  RecordAccess(KeyHash(key));
+  Map::iterator p = map_.find(key);
+  if (p != map_.end()) {
+    Remove(p);
+  }
+  if (key.size() + value->size() > main_limit_) {
+    return;  // Would never be admitted.
+  }
+
+  std::pair<Map::iterator, bool> inserted =
+      map_.insert(Map::value_type(key, window_.end()));
+  Entry* entry = new Entry;
+  entry->key = &inserted.first->first;
+  entry->value = *value;
+  entry->in_main = false;
+  window_.push_front(entry);
+  inserted.first->second = window_.begin();
+  window_bytes_ += EntrySize(entry);
+  DrainWindow();
+}
+
+void NgxTinyLfuCache::DrainWindow() {
+  while (window_bytes_ > window_limit_ && !window_.empty()) {
+    Entry* candidate = window_.back();
+    size_t candidate_size = EntrySize(candidate);
+    bool admit = true;
+    if (main_bytes_ + candidate_size > main_limit_ && !main_.empty()) {
+      // Only take the main LRU's victim's place if we're more popular.
+      admit = Frequency(KeyHash(*candidate->key)) >
+          Frequency(KeyHash(*main_.back()->key));
+    }
+    if (!admit) {
+      rejections_->Add(1);
+      Remove(map_.find(*candidate->key));
+      continue;
+    }
+    while (main_bytes_ + candidate_size > main_limit_ && !main_.empty()) {
+      Remove(map_.find(*main_.back()->key));
+    }
+    window_.pop_back();
+    window_bytes_ -= candidate_size;
+    candidate->in_main = true;
+    main_.push_front(candidate);
+    main_bytes_ += candidate_size;
+    map_[*candidate->key] = main_.begin();
+    admissions_->Add(1);
+  }
+}
+
+void NgxTinyLfuCache::Remove(Map::iterator p) {
+  DCHECK(p != map_.end());
+  ListNode node = p->second;
+  Entry* entry = *node;
+  size_t size = EntrySize(entry);
+  if (entry->in_main) {
+    main_.erase(node);
+    main_bytes_ -= size;
+  } else {
+    window_.erase(node);
+    window_bytes_ -= size;
+  }
+  map_.erase(p);
+  delete entry;
+}
+
+void NgxTinyLfuCache::Delete(const GoogleString& key) {
+  ScopedMutex lock(mutex_.get());
+  Map::iterator p = map_.find(key);
+  if (p != map_.end()) {
+    Remove(p);
+  }
+}
+
+size_t NgxTinyLfuCache::size_bytes() {
+  ScopedMutex lock(mutex_.get());
+  return window_bytes_ + main_bytes_;
+}
+
+}  // namespace net_instaweb
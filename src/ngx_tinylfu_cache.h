@@ -0,0 +1,118 @@
+/*
+ * Copyright 2013 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// In-process memory cache with a W-TinyLFU admission policy, as a
+// scan-resistant alternative to LRUCache.
+//
+// New entries go into a small LRU window.  When the window overflows its
+// oldest entry becomes a candidate for the main LRU, and is only let in if
+// a frequency sketch says it has been used more often than the entry the
+// main LRU would evict to make room for it.  A sweep of one-off keys thus
+// churns through the window without pushing out the entries that every
+// page needs.  The sketch is a count-min sketch of 4-bit counters that are
+// halved periodically, so popularity ages out.
+//
+// Like LRUCache, sizes are counted as key plus value bytes.  Unlike
+// LRUCache it is thread-safe.
+
+#ifndef NGX_TINYLFU_CACHE_H_
+#define NGX_TINYLFU_CACHE_H_
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "net/instaweb/util/public/basictypes.h"
+#include "net/instaweb/util/public/cache_interface.h"
+#include "net/instaweb/util/public/scoped_ptr.h"
+#include "net/instaweb/util/public/shared_string.h"
+#include "net/instaweb/util/public/string.h"
+
+namespace net_instaweb {
+
+class AbstractMutex;
+class Statistics;
+class ThreadSystem;
+class Variable;
+
+class NgxTinyLfuCache : public CacheInterface {
+ public:
+  NgxTinyLfuCache(size_t max_bytes, ThreadSystem* thread_system,
+                  Statistics* statistics);
+  virtual ~NgxTinyLfuCache();
+
+  // CacheStats prefix for the CacheStats wrapping this cache.
+  static const char kStatsPrefix[];
+
+  static void InitStats(Statistics* statistics);
+
+  virtual void Get(const GoogleString& key, Callback* callback);
+  virtual void Put(const GoogleString& key, SharedString* value);
+  virtual void Delete(const GoogleString& key);
+  virtual const char* Name() const { return "NgxTinyLfuCache"; }
+  virtual bool IsBlocking() const { return true; }
+  virtual bool IsHealthy() const { return true; }
+  virtual void ShutDown() {}
+
+  size_t size_bytes();
+
+ private:
+  struct Entry {
+    const GoogleString* key;  // owned by map_
+    SharedString value;
+    bool in_main;
+  };
+  typedef std::list<Entry*> EntryList;
+  typedef EntryList::iterator ListNode;
+  typedef std::map<GoogleString, ListNode> Map;
+
+  // Frequency sketch.  These expect mutex_ to be held.
+  void RecordAccess(uint64 hash);
+  int Frequency(uint64 hash) const;
+  static uint64 KeyHash(const StringPiece& key);
+
+  // Moves window entries into the main LRU, or drops them, until the window
+  // is back under its limit.  Requires mutex_.
+  void DrainWindow();
+  void Remove(Map::iterator p);
+  size_t EntrySize(const Entry* entry) const;
+
+  const size_t window_limit_;
+  const size_t main_limit_;
+
+  scoped_ptr<AbstractMutex> mutex_;
+  // Front is most recently used.
+  EntryList window_;
+  EntryList main_;
+  Map map_;
+  size_t window_bytes_;
+  size_t main_bytes_;
+
+  std::vector<uint8> sketch_;
+  uint64 sketch_mask_;
+  int samples_;
+  int sample_limit_;
+
+  Variable* admissions_;
+  Variable* rejections_;
+
+  DISALLOW_COPY_AND_ASSIGN(NgxTinyLfuCache);
+};
+
+}  // namespace net_instaweb
+
+#endif  // NGX_TINYLFU_CACHE_H_
@@ -724,6 +724,77 @@ start_test statistics load
 OUT=$($WGET_DUMP $STATISTICS_URL)
 check_from "$OUT" grep 'VHost-Specific Statistics'
 
+start_test per-cache statistics
+OUT=$($WGET_DUMP "$STATISTICS_URL?cache")
+check_from "$OUT" grep '<td>ngx_metadata_cache</td><td>use</td>'
+OUT=$($WGET_DUMP "$STATISTICS_URL?cache&json")
+check_from "$OUT" grep '"ngx_metadata_cache": {"kind": "use", "hits": [0-9]'
+
+start_test statistics in openmetrics format
+OUT=$($WGET_DUMP "$STATISTICS_URL?format=prometheus")
+check_from "$OUT" grep -i '^Content-Type: application/openmetrics-text'
+check_from "$OUT" grep '^# TYPE pagespeed_html_time_us_histogram summary$'
+check_from "$OUT" grep '^pagespeed_ngx_html_output_cache_hits{vhost="[^"]*"} [0-9]'
+check_from "$OUT" grep '^# EOF$'
+
+start_test histogram percentiles as json
+OUT=$($WGET_DUMP "$STATISTICS_URL?histograms&json")
+check_from "$OUT" grep '"Html Time us Histogram": {"count": [0-9]'
+check_from "$OUT" grep '"p99": [0-9.]*, "p999": [0-9.]*, "buckets": \['
+
+start_test worker pool queue depths on the statistics page
+OUT=$($WGET_DUMP "$STATISTICS_URL")
+check_from "$OUT" grep 'Rewrite worker queue depth'
+check_from "$OUT" grep 'Low-priority rewrite worker queue depth'
+
+start_test queue wait time by worker pool
+sleep 1
+OUT=$($WGET_DUMP "http://$HOSTNAME/ngx_pagespeed_global_statistics?histograms&json")
+check_from "$OUT" grep '"ngx_rewrite_queue_wait_us": {"count": [1-9]'
+check_from "$OUT" grep '"ngx_low_priority_queue_wait_us": {"count": [1-9]'
+
+start_test html filter cpu time by filter id
+OUT=$($WGET_DUMP "http://$HOSTNAME/ngx_pagespeed_global_statistics")
+check_from "$OUT" grep 'ngx_filter_cpu_timed_requests: *[1-9]'
+check_from "$OUT" grep 'ngx_filter_cpu_us_other: *[0-9]'
+
+start_test slow request log with phases
+$WGET_DUMP $EXAMPLE_ROOT/index.html > /dev/null
+OUT=$($WGET_DUMP "http://$HOSTNAME/ngx_pagespeed_message")
+check_from "$OUT" grep 'Slow pagespeed HTML request, .*/index.html; options=+.* done=+'
+
+start_test request tracing at a rate set at runtime
+TRACE_URL=http://$HOSTNAME/ngx_pagespeed_trace
+OUT=$($WGET_DUMP "$TRACE_URL?per_million=1000000")
+check_from "$OUT" grep 'Tracing 1000000 requests per million'
+$WGET_DUMP $EXAMPLE_ROOT/combine_css.html > /dev/null
+sleep 1
+OUT=$(cat $TEST_TMP/request_trace.*.json)
+check_from "$OUT" grep '^\[$'
+check_from "$OUT" grep '"name":".*/combine_css.html".*"ph":"X"'
+OUT=$($WGET_DUMP "$TRACE_URL?per_million=0")
+check_from "$OUT" grep 'Tracing 0 requests per million'
+
+start_test purge a single url and a prefix
+PURGE_URL=http://$HOSTNAME/ngx_pagespeed_purge
+PURGE_EXAMPLE=http://$HOSTNAME/mod_pagespeed_example
+OUT=$($WGET_DUMP "$PURGE_URL?url=$PURGE_EXAMPLE/styles/yellow.css")
+check_from "$OUT" grep 'Purged http://.*/styles/yellow.css'
+OUT=$($WGET_DUMP "$PURGE_URL?prefix=$PURGE_EXAMPLE/images/")
+check_from "$OUT" grep 'Purged prefix http://.*/images/'
+OUT=$($WGET_DUMP "$PURGE_URL")
+check_from "$OUT" grep ' prefix http://.*/mod_pagespeed_example/images/'
+OUT=$($WGET_DUMP "$PURGE_URL?url=not-a-url")
+check_from "$OUT" grep 'failed: not an absolute URL'
+
+start_test admin handlers are off without AdminHandlers
+WGET_ERROR=$(http_proxy=$SECONDARY_HOSTNAME $WGET -O /dev/null \
+  "http://xheader.example.com/ngx_pagespeed_purge?prefix=http://a.com/" 2>&1)
+check_from "$WGET_ERROR" fgrep -q "404 Not Found"
+WGET_ERROR=$(http_proxy=$SECONDARY_HOSTNAME $WGET -O /dev/null \
+  "http://xheader.example.com/ngx_pagespeed_trace?per_million=1000000" 2>&1)
+check_from "$WGET_ERROR" fgrep -q "404 Not Found"
+
 start_test scrape stats works
 
 check test $(scrape_stat image_rewrite_total_original_bytes) -ge 10000
@@ -1152,6 +1223,21 @@ check [ $(grep -c "[.]pagespeed[.]" $OUTFILE) -lt 1 ]
 http_proxy=$SECONDARY_HOSTNAME fetch_until $URL \
   'grep -c [.]pagespeed[.]' 1
 
+start_test MaxPageProcessingDelayMs in a location block.
+# The server waits up to a minute per flush window, so the first fetch outside
+# /budget/ comes back with its images rewritten.
+URL="max-page-delay.example.com/mod_pagespeed_example/rewrite_images.html"
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_from "$OUT" fgrep -q .pagespeed.ic.
+# /budget/ serves the same page, but its images have different URLs, so they
+# aren't cached yet, and with no time to wait for them it keeps the originals.
+URL="max-page-delay.example.com/budget/rewrite_images.html"
+OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP $URL)
+check_not_from "$OUT" fgrep -q .pagespeed.ic.
+# The rewrites finish in the background, for later requests.
+http_proxy=$SECONDARY_HOSTNAME fetch_until $URL \
+  'grep -m 1 -c [.]pagespeed[.]ic[.]' 1
+
 run_post_cache_flush
 
 # Test ForbidAllDisabledFilters, which is set in the config for
@@ -1377,6 +1463,32 @@ OUT=$(http_proxy=$SECONDARY_HOSTNAME $WGET_DUMP --header='Cookie: _GFURIOUS=0' \
       $EXP_NO_GA_EXTEND_CACHE)
 check_not_from "$OUT" fgrep -q 'Experiment:'
 
+start_test HTML load shedding passes HTML through while overloaded.
+# HtmlLoadSheddingInFlight can only be set in the http{} block, so reload with
+# it set to 1 and then put the usual config back.
+SHED_CONF="$TEST_TMP/pagespeed_test_shed.conf"
+sed -e 's/^http {$/&\n  pagespeed HtmlLoadSheddingInFlight 1;/' \
+  $PAGESPEED_CONF > $SHED_CONF
+check grep -q 'HtmlLoadSheddingInFlight 1' $SHED_CONF
+check_simple "$NGINX_EXECUTABLE" -s reload -c "$SHED_CONF"
+sleep 1
+SHED_STATS="http://$HOSTNAME/ngx_pagespeed_global_statistics"
+OLDSTATS=$OUTDIR/load_shed_stats.old
+NEWSTATS=$OUTDIR/load_shed_stats.new
+$WGET_DUMP $SHED_STATS > $OLDSTATS
+URL="http://loadshed.example.com/mod_pagespeed_example/index.html"
+# The first fetch is rewritten, and stays in flight while its origin trickles
+# in, so the second one has to be passed through.
+http_proxy=$SECONDARY_HOSTNAME $WGET -q -O /dev/null $URL &
+SLOW_PID=$!
+sleep 1
+check_simple env http_proxy=$SECONDARY_HOSTNAME $WGET -q -O /dev/null $URL
+wait $SLOW_PID
+$WGET_DUMP $SHED_STATS > $NEWSTATS
+check_stat $OLDSTATS $NEWSTATS ngx_html_load_shed_in_flight 1
+check_simple "$NGINX_EXECUTABLE" -s reload -c "$PAGESPEED_CONF"
+sleep 1
+
 # check_failures_and_exit will actually call exit, but we don't want it to.
 # Specifically we want it to call exit 3 instad of exit 1 if it finds
 # something.  Reimplement it here: